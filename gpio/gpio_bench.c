@@ -0,0 +1,422 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * gpio_bench - benchmark of gpio_lkm driver
+ *
+ * Measures cost of driver entry points from user space:
+ *  - open()/close() of a pin device
+ *  - toggle rate of one pin with text, binary and batched
+ *    binary commands, and of all pins toggled by parallel threads
+ *  - read() throughput of a pin device
+ *  - latency of write() as seen by user space and, if driver
+ *    "latency" parameter can be set, latency from entry to write
+ *    method to gpio_set_value() as measured by driver itself
+ *
+ * Results are printed as "test.metric=value" lines, one per line,
+ * so runs can be compared by scripts. Works on any gpiochip, for
+ * a stock PC use gpio-mockup:
+ *   modprobe gpio-mockup gpio_mockup_ranges=-1,32
+ *   insmod gpio_lkm.ko chip=gpio-mockup-A
+ *   ./gpio_bench -d 2
+ *
+ * Author: Roman Okhrimenko <mrromanjoe@gmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "gpio_lkm.h"
+
+#define CTL_DEVICE "/dev/gpio_lkm"
+#define LATENCY_PARAM "/sys/module/gpio_lkm/parameters/latency"
+#define BATCH 32
+#define MAX_THREADS 64
+
+static unsigned int duration = 2;
+static unsigned int iterations = 100000;
+static unsigned int nthreads = 4;
+static const struct gpio_lkm_state_page *state;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_pin(unsigned int gpio, int flags)
+{
+    char path[32];
+    int fd;
+
+    snprintf(path, sizeof(path), "/dev/GPIO%u", gpio);
+    fd = open(path, flags);
+    if (fd < 0)
+        perror(path);
+    return fd;
+}
+
+/* make pin an output, benchmarks toggle its level */
+static int pin_output(unsigned int gpio)
+{
+    int fd = open_pin(gpio, O_WRONLY);
+    int ret;
+
+    if (fd < 0)
+        return -1;
+    ret = write(fd, "out\n", 4) == 4 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+static void result(const char *test, const char *metric, double value)
+{
+    printf("%s.%s=%.1f\n", test, metric, value);
+}
+
+static void bench_open(unsigned int gpio)
+{
+    uint64_t start;
+    unsigned int i;
+    int fd;
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        fd = open_pin(gpio, O_RDWR);
+        if (fd < 0)
+            return;
+        close(fd);
+    }
+    result("open_release", "ns_per_op", (double)(now_ns() - start) / iterations);
+}
+
+/* run toggles until duration passes, time is checked every
+ * 1024 writes to keep clock_gettime() out of the numbers
+ */
+static double toggle_loop(int fd, const void *high, size_t high_len,
+                          const void *low, size_t low_len, unsigned int per_write)
+{
+    uint64_t start = now_ns(), end = start + duration * 1000000000ULL, now, ops = 0;
+    unsigned int i;
+
+    do
+    {
+        for (i = 0; i < 512; i++)
+        {
+            if (write(fd, high, high_len) != (ssize_t)high_len ||
+                write(fd, low, low_len) != (ssize_t)low_len)
+            {
+                perror("write");
+                return 0;
+            }
+        }
+        ops += 1024;
+        now = now_ns();
+    } while (now < end);
+
+    return ops * per_write * 1e9 / (now - start);
+}
+
+static void bench_toggle_text(unsigned int gpio)
+{
+    int fd = open_pin(gpio, O_WRONLY);
+
+    if (fd < 0)
+        return;
+    result("toggle_text", "ops_per_sec", toggle_loop(fd, "high\n", 5, "low\n", 4, 1));
+    close(fd);
+}
+
+static void bench_toggle_binary(unsigned int gpio)
+{
+    struct gpio_lkm_cmd high = { .op = GPIO_LKM_OP_HIGH, .pin = gpio };
+    struct gpio_lkm_cmd low = { .op = GPIO_LKM_OP_LOW, .pin = gpio };
+    __u32 mode = GPIO_LKM_MODE_BINARY;
+    int fd = open_pin(gpio, O_WRONLY);
+
+    if (fd < 0)
+        return;
+    if (ioctl(fd, GPIO_LKM_IOC_SET_MODE, &mode) < 0)
+        perror("GPIO_LKM_IOC_SET_MODE");
+    else
+        result("toggle_binary", "ops_per_sec", toggle_loop(fd, &high, sizeof(high), &low, sizeof(low), 1));
+    close(fd);
+}
+
+static void bench_toggle_batch(unsigned int gpio)
+{
+    struct gpio_lkm_cmd cmds[BATCH];
+    unsigned int i;
+    int fd;
+
+    fd = open(CTL_DEVICE, O_WRONLY);
+    if (fd < 0)
+    {
+        perror(CTL_DEVICE);
+        return;
+    }
+    memset(cmds, 0, sizeof(cmds));
+    for (i = 0; i < BATCH; i++)
+    {
+        cmds[i].op = (i & 1) ? GPIO_LKM_OP_LOW : GPIO_LKM_OP_HIGH;
+        cmds[i].pin = gpio;
+    }
+    /* the same batch is written twice per loop, levels keep toggling */
+    result("toggle_batch", "ops_per_sec", toggle_loop(fd, cmds, sizeof(cmds), cmds, sizeof(cmds), BATCH));
+    close(fd);
+}
+
+struct toggle_thread
+{
+    pthread_t thread;
+    unsigned int gpio;
+    double rate;
+};
+
+static void *toggle_thread_run(void *arg)
+{
+    struct toggle_thread *t = arg;
+    struct gpio_lkm_cmd high = { .op = GPIO_LKM_OP_HIGH, .pin = t->gpio };
+    struct gpio_lkm_cmd low = { .op = GPIO_LKM_OP_LOW, .pin = t->gpio };
+    __u32 mode = GPIO_LKM_MODE_BINARY;
+    int fd = open_pin(t->gpio, O_WRONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (ioctl(fd, GPIO_LKM_IOC_SET_MODE, &mode) == 0)
+        t->rate = toggle_loop(fd, &high, sizeof(high), &low, sizeof(low), 1);
+    close(fd);
+    return NULL;
+}
+
+/* each thread toggles its own pin, shows how driver scales */
+static void bench_toggle_pins(void)
+{
+    struct toggle_thread threads[MAX_THREADS];
+    unsigned int i, n = nthreads < state->npins ? nthreads : state->npins;
+    double total = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        threads[i].gpio = state->gpio[i];
+        threads[i].rate = 0;
+        if (pin_output(threads[i].gpio))
+            return;
+    }
+    for (i = 0; i < n; i++)
+        pthread_create(&threads[i].thread, NULL, toggle_thread_run, &threads[i]);
+    for (i = 0; i < n; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        total += threads[i].rate;
+    }
+
+    result("toggle_pins", "threads", n);
+    result("toggle_pins", "ops_per_sec", total);
+    result("toggle_pins", "ops_per_sec_per_pin", total / n);
+}
+
+static void bench_read(unsigned int gpio)
+{
+    static char buf[4096];
+    uint64_t start, end, bytes = 0, calls = 0;
+    int fd = open_pin(gpio, O_RDONLY);
+    ssize_t ret;
+
+    if (fd < 0)
+        return;
+
+    start = now_ns();
+    end = start + duration * 1000000000ULL / 2;
+    while (now_ns() < end)
+    {
+        ret = read(fd, buf, sizeof(buf));
+        if (ret <= 0)
+            break;
+        bytes += ret;
+    }
+    result("read_block", "bytes_per_sec", bytes * 1e9 / (now_ns() - start));
+
+    start = now_ns();
+    end = start + duration * 1000000000ULL / 2;
+    while (now_ns() < end)
+    {
+        if (read(fd, buf, 1) != 1)
+            break;
+        calls++;
+    }
+    result("read_byte", "calls_per_sec", calls * 1e9 / (now_ns() - start));
+
+    close(fd);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* percentile from log2 histogram, upper bound of the bucket */
+static double hist_percentile(const struct gpio_lkm_lat_hist *h, double p)
+{
+    uint64_t need = (uint64_t)(h->count * p), seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < GPIO_LKM_LAT_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > need)
+            return i == GPIO_LKM_LAT_BUCKETS - 1 ? h->max_ns : (double)(2ULL << i) - 1;
+    }
+    return h->max_ns;
+}
+
+static int latency_param(const char *value, char *old)
+{
+    int fd = open(LATENCY_PARAM, O_RDWR);
+    int ret = -1;
+
+    if (fd < 0)
+        return -1;
+    if (!old || read(fd, old, 1) == 1)
+        ret = pwrite(fd, value, 1, 0) == 1 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+static void bench_latency(unsigned int gpio)
+{
+    static const double pct[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *names[] = { "p50_ns", "p90_ns", "p99_ns", "p999_ns" };
+    struct gpio_lkm_cmd cmd = { .pin = gpio };
+    struct gpio_lkm_lat_hist hist;
+    uint64_t *samples, t;
+    char old = '0';
+    unsigned int i;
+    int fd, kernel;
+
+    samples = malloc(iterations * sizeof(*samples));
+    fd = open(CTL_DEVICE, O_RDWR);
+    if (!samples || fd < 0)
+    {
+        perror(CTL_DEVICE);
+        free(samples);
+        return;
+    }
+
+    /* driver side histogram needs root to flip the parameter */
+    kernel = latency_param("1", &old) == 0 && ioctl(fd, GPIO_LKM_IOC_LAT_RESET) == 0;
+
+    for (i = 0; i < iterations; i++)
+    {
+        cmd.op = (i & 1) ? GPIO_LKM_OP_LOW : GPIO_LKM_OP_HIGH;
+        t = now_ns();
+        if (write(fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+        {
+            perror("write");
+            break;
+        }
+        samples[i] = now_ns() - t;
+    }
+    iterations = i;
+
+    if (kernel && ioctl(fd, GPIO_LKM_IOC_LAT_HIST, &hist) == 0)
+    {
+        result("latency_kernel", "count", hist.count);
+        result("latency_kernel", "mean_ns", hist.count ? (double)hist.sum_ns / hist.count : 0);
+        for (i = 0; i < 4; i++)
+            result("latency_kernel", names[i], hist_percentile(&hist, pct[i]));
+        result("latency_kernel", "max_ns", hist.max_ns);
+    }
+    if (kernel)
+        latency_param(&old, NULL);
+
+    if (iterations)
+    {
+        qsort(samples, iterations, sizeof(*samples), cmp_u64);
+        result("latency_syscall", "count", iterations);
+        for (i = 0; i < 4; i++)
+            result("latency_syscall", names[i], samples[(size_t)(iterations * pct[i])]);
+        result("latency_syscall", "max_ns", samples[iterations - 1]);
+    }
+
+    free(samples);
+    close(fd);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p gpio] [-d seconds] [-n iterations] [-t threads]\n"
+                    "  -p  pin used by single pin tests (default: first managed pin)\n"
+                    "  -d  duration of each rate test in seconds (default 2)\n"
+                    "  -n  iterations of open and latency tests (default 100000)\n"
+                    "  -t  threads of multi pin toggle test (default 4)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int gpio = -1, fd, opt;
+
+    while ((opt = getopt(argc, argv, "p:d:n:t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p': gpio = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'n': iterations = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!duration || !iterations || !nthreads || nthreads > MAX_THREADS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* pin list is taken from state page of control device */
+    fd = open(CTL_DEVICE, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(CTL_DEVICE);
+        return 1;
+    }
+    state = mmap(NULL, sizeof(*state), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED || !state->npins)
+    {
+        fprintf(stderr, "cannot get pin list from %s\n", CTL_DEVICE);
+        return 1;
+    }
+    if (gpio < 0)
+        gpio = state->gpio[0];
+    if (pin_output(gpio))
+        return 1;
+
+    printf("bench.pin=%d\n", gpio);
+    printf("bench.pins=%u\n", state->npins);
+    printf("bench.duration_sec=%u\n", duration);
+
+    bench_open(gpio);
+    bench_toggle_text(gpio);
+    bench_toggle_binary(gpio);
+    bench_toggle_batch(gpio);
+    bench_toggle_pins();
+    bench_read(gpio);
+    bench_latency(gpio);
+
+    return 0;
+}
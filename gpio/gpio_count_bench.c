@@ -0,0 +1,199 @@
+/*
+* gpio_count_bench.c - Read cost of gpio_lkm edge counters
+* Consumer of gpio_lkm exported counter API. On load it runs
+* reader threads on 1, 2, ... online cpus, each polling counters
+* of one pin in a loop, and prints cost of a read for every
+* number of readers. Per cpu counters are only read here, so
+* cost of a read should stay flat as readers are added, and
+* grow only with number of possible cpus to sum up.
+* Results are printed to kernel log, module may be removed
+* right after it is loaded.
+* Author: Roman Okhrimenko <mrromanjoe@gmail.com>
+* License: GPL
+*/
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+
+#include "gpio_lkm.h"
+
+#define BENCH_RESCHED 1024 /* reads between voluntary reschedules */
+
+static int gpio = -1;
+module_param(gpio, int, 0444);
+MODULE_PARM_DESC(gpio, " Managed GPIO to read counters of (default=first managed pin)");
+
+static unsigned int duration_ms = 200;
+module_param(duration_ms, uint, 0444);
+MODULE_PARM_DESC(duration_ms, " Run time for each number of readers (default=200)");
+
+/*
+* struct bench_reader - Reader thread of one cpu
+* @task: thread bound to the cpu
+* @reads: counter reads done
+* @elapsed_ns: time the thread was reading
+*/
+struct bench_reader
+{
+    struct task_struct *task;
+    u64 reads;
+    u64 elapsed_ns;
+};
+
+/*
+* bench_reader_run - Poll counters until thread is stopped
+*/
+static int bench_reader_run(void *data)
+{
+    struct bench_reader *reader = data;
+    struct gpio_lkm_count count;
+    u64 start = ktime_get_ns();
+    u64 reads = 0;
+
+    while (!kthread_should_stop())
+    {
+        gpio_lkm_count_read(gpio, &count);
+        /* readers share cpus with the rest of system, do not
+         * hog them on kernels without preemption
+         */
+        if (++reads % BENCH_RESCHED == 0)
+            cond_resched();
+    }
+
+    reader->elapsed_ns = ktime_get_ns() - start;
+    reader->reads = reads;
+    return 0;
+}
+
+/*
+* bench_run - Run readers on first nreaders online cpus
+*/
+static int bench_run(struct bench_reader *readers, unsigned int nreaders)
+{
+    u64 reads = 0, elapsed = 0;
+    unsigned int i = 0, n;
+    int cpu;
+
+    for_each_online_cpu(cpu)
+    {
+        if (i == nreaders)
+            break;
+        readers[i].reads = 0;
+        readers[i].task = kthread_create_on_cpu(bench_reader_run, &readers[i], cpu, "gpio_bench/%u");
+        if (IS_ERR(readers[i].task))
+            break;
+        i++;
+    }
+    n = i;
+
+    for (i = 0; i < n; i++)
+        wake_up_process(readers[i].task);
+    msleep(duration_ms);
+    for (i = 0; i < n; i++)
+        kthread_stop(readers[i].task);
+
+    if (n < nreaders)
+        return -ENOMEM;
+
+    /* threads are stopped one by one, so each one is
+     * accounted for its own reading time
+     */
+    for (i = 0; i < n; i++)
+    {
+        reads += readers[i].reads;
+        elapsed += readers[i].elapsed_ns;
+    }
+    if (!reads || !elapsed)
+        return -EIO;
+
+    printk(KERN_INFO "[GPIO_COUNT_BENCH] - readers=%u reads=%llu ns_per_read=%llu reads_per_sec=%llu\n",
+           n, (unsigned long long)reads, (unsigned long long)div64_u64(elapsed, reads),
+           (unsigned long long)div64_u64(reads * n * NSEC_PER_SEC, elapsed));
+
+    return 0;
+}
+
+/*
+* bench_snapshot - Cost of reading all managed pins at once
+*/
+static void bench_snapshot(struct gpio_lkm_count *counts, unsigned int npins)
+{
+    u64 start, end, loops = 0;
+
+    start = ktime_get_ns();
+    end = start + (u64)duration_ms * NSEC_PER_MSEC;
+    do
+    {
+        gpio_lkm_count_snapshot(counts, npins);
+        if (++loops % BENCH_RESCHED == 0)
+            cond_resched();
+    } while (ktime_get_ns() < end);
+
+    printk(KERN_INFO "[GPIO_COUNT_BENCH] - snapshot pins=%u ns_per_snapshot=%llu\n",
+           npins, (unsigned long long)div64_u64(ktime_get_ns() - start, loops));
+}
+
+/*
+* gpio_count_bench_init - Run benchmark
+*/
+static int __init gpio_count_bench_init(void)
+{
+    struct gpio_lkm_count *counts;
+    struct bench_reader *readers;
+    unsigned int npins, n;
+    int ret = 0;
+
+    if (!duration_ms)
+        return -EINVAL;
+
+    counts = kcalloc(GPIO_LKM_STATE_MAX_PINS, sizeof(*counts), GFP_KERNEL);
+    readers = kcalloc(num_online_cpus(), sizeof(*readers), GFP_KERNEL);
+    if (!counts || !readers)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    npins = gpio_lkm_count_snapshot(counts, GPIO_LKM_STATE_MAX_PINS);
+    if (gpio < 0 && npins)
+        gpio = counts[0].pin;
+    if (gpio < 0 || gpio_lkm_count_read(gpio, &counts[0]))
+    {
+        printk(KERN_ALERT "[GPIO_COUNT_BENCH] - GPIO %d is not managed by gpio_lkm\n", gpio);
+        ret = -ENODEV;
+        goto out;
+    }
+
+    printk(KERN_INFO "[GPIO_COUNT_BENCH] - gpio=%d cpus_possible=%u cpus_online=%u\n",
+           gpio, num_possible_cpus(), num_online_cpus());
+
+    for (n = 1; n <= num_online_cpus(); n++)
+    {
+        if ((ret = bench_run(readers, n)))
+            goto out;
+    }
+    bench_snapshot(counts, npins);
+
+out:
+    kfree(readers);
+    kfree(counts);
+    return ret;
+}
+
+static void __exit gpio_count_bench_exit(void)
+{
+}
+
+module_init(gpio_count_bench_init);
+module_exit(gpio_count_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Roman Okhrimenko <mrromanjoe@gmail.com>");
+MODULE_DESCRIPTION("Read cost benchmark of gpio_lkm edge counters");
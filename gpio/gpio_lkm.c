@@ -11,14 +11,160 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/xarray.h>
+#include <linux/of.h>
+#include <linux/gpio/driver.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/fs.h>
+#include <linux/filter.h>
+#include <linux/workqueue.h>
+#include <linux/timerqueue.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/sched/types.h>
 
-/*disclaimer: not all of Raspberry pins
- * are available to be used as GPIOs */
-#define USE_GPIOS_NUM 14   /* number of GPIOs that we are going to allocate */
-#define MAX_GPIO_NUMBER 27 /* maximum number of GPIO available for allocation */
+#include "gpio_lkm.h"
+
+#define GPIO_LKM_MAX_PINS GPIO_LKM_STATE_MAX_PINS /* each pin should fit state page */
 #define DEVICE_NAME "gpio_lkm" /* name that will be assigned to this device in /dev fs */
-#define BUF_SIZE 512
+#define BUF_SIZE 16 /* longest text command with some slack */
+#define GPIO_LKM_CMD_CHUNK 32 /* binary commands copied from user at once */
 #define NUM_COM 4 /* number of commands that this driver support */
+#define GPIO_LKM_DEBOUNCE_MAX_NS 1000000000ULL /* longest debounce window, 1 s */
+#define GPIO_LKM_DEBOUNCE_MIN_TICK_NS 10000 /* shortest interval between debounce samples */
+#define GPIO_LKM_DEBOUNCE_MAX_SAMPLES 64
+#define GPIO_LKM_DEBOUNCE_DEFAULT_SAMPLES 4
+#define GPIO_LKM_COUNT_LINE 64 /* longest line of /dev/gpio_lkm_count */
+#define GPIO_LKM_CHIP_BATCH 64 /* queued writes of sleeping chip applied at once */
+#define GPIO_LKM_KEYPAD_QUEUE 64 /* key events queued, power of 2 */
+#define GPIO_LKM_KEYPAD_SCAN_NS 5000000 /* default keypad scan period */
+#define GPIO_LKM_KEYPAD_DEBOUNCE 4 /* default scans to accept a key change */
+#define GPIO_LKM_KEYPAD_IDLE_SCANS 8 /* scans without keys before scanning stops */
+#define GPIO_LKM_COALESCE_NS 1000000 /* default event coalescing interval, 1 ms */
+#define GPIO_LKM_COALESCE_MIN_NS 10000
+#define GPIO_LKM_COALESCE_MAX_NS 1000000000ULL
+#define GPIO_LKM_COALESCE_MAX_HZ 100000000 /* highest coalescing threshold */
+#define GPIO_LKM_BANK_PINS 32 /* lines of gpiochip in one bank */
+#define GPIO_LKM_BANK_NUM 8 /* banks with cpu of their own, higher lines share last one */
+/* devices which are not bound to pins take first minors: bus
+ * devices, control device /dev/gpio_lkm, logic analyzer
+ * /dev/gpio_lkm_la, edge counters /dev/gpio_lkm_count and
+ * keypad /dev/gpio_lkm_keypad. pin devices follow them in order
+ * of pin table, so minor of pin device maps to its index directly
+ */
+#define BUS_MINOR(n) (n)
+#define CTL_MINOR GPIO_LKM_BUS_NUM
+#define LA_MINOR (CTL_MINOR + 1)
+#define COUNT_MINOR (LA_MINOR + 1)
+#define KEYPAD_MINOR (COUNT_MINOR + 1)
+#define RING_MINOR (KEYPAD_MINOR + 1)
+#define PIN_MINOR_BASE (RING_MINOR + 1)
+#define GPIO_LKM_MINORS (PIN_MINOR_BASE + gpio_lkm_npins) /* number of minors to allocate */
+
+/*disclaimer: not all of Raspberry pins
+ * are available to be used as GPIOs. these ones
+ * are managed if no other pin table is given */
+static const unsigned int gpio_lkm_default_pins[] =
+{
+    4, 5, 6, 12, 13, 16, 17, 18, 22, 23, 24, 25, 26, 27,
+};
+
+/* pin table may be given as module parameters, for example
+ * "pins=4,17,27" for global GPIO numbers, or "chip=gpio-mockup-A"
+ * with optional "pins=0,1,2" offsets to take lines of one chip.
+ * without parameters table is taken from device tree node
+ * compatible with "romanjoe,gpio-lkm" (properties "pins" and
+ * "chip-label"), and at last defaults above are used
+ */
+static unsigned int pins[GPIO_LKM_MAX_PINS];
+static int pins_num;
+module_param_array(pins, uint, &pins_num, 0444);
+MODULE_PARM_DESC(pins, " GPIO numbers to manage, or line offsets if chip is given");
+
+static char *chip;
+module_param(chip, charp, 0444);
+MODULE_PARM_DESC(chip, " Label of gpiochip to take lines from, all lines if pins is empty");
+
+/* size of per open file queue of edge events, in records */
+static unsigned int event_fifo = 256;
+module_param(event_fifo, uint, 0444);
+MODULE_PARM_DESC(event_fifo, " Edge events queued per open file (power of 2, default=256)");
+
+/* size of per cpu ring of /dev/gpio_lkm_events, in records */
+static unsigned int event_ring = 4096;
+module_param(event_ring, uint, 0444);
+MODULE_PARM_DESC(event_ring, " Edge events queued per cpu ring (power of 2, default=4096)");
+
+/* edges may be handled in a worker thread per bank instead of
+ * hard interrupt handlers. worker of a bank is moved to cpu given
+ * for the bank, so the work leaves cpu taking interrupts
+ */
+static bool threaded;
+module_param(threaded, bool, 0444);
+MODULE_PARM_DESC(threaded, " Handle edges in worker thread of each bank (default=0)");
+
+static int bank_cpu[GPIO_LKM_BANK_NUM] = { [0 ... GPIO_LKM_BANK_NUM - 1] = -1 };
+static unsigned int bank_cpu_num;
+static int gpio_lkm_bank_cpu_set(const char *val, const struct kernel_param *kp);
+static int gpio_lkm_bank_cpu_get(char *buffer, const struct kernel_param *kp);
+static const struct kernel_param_ops gpio_lkm_bank_cpu_ops = {
+    .set = gpio_lkm_bank_cpu_set,
+    .get = gpio_lkm_bank_cpu_get,
+};
+static const struct kparam_array gpio_lkm_bank_cpu_arr = {
+    .max = GPIO_LKM_BANK_NUM,
+    .elemsize = sizeof(int),
+    .num = &bank_cpu_num,
+    .ops = &param_ops_int,
+    .elem = bank_cpu,
+};
+module_param_cb(bank_cpu, &gpio_lkm_bank_cpu_ops, &gpio_lkm_bank_cpu_arr, 0644);
+MODULE_PARM_DESC(bank_cpu, " Cpu of worker thread of each bank of 32 lines, -1=any (default=-1)");
+
+/* size of capture ring buffer in pages, including header page */
+static unsigned int capture_pages = 256;
+module_param(capture_pages, uint, 0444);
+MODULE_PARM_DESC(capture_pages, " Capture ring buffer size in pages (default=256)");
+
+/* in lazy mode pin devices are created at load, but pins are
+ * requested from gpio subsystem only when they are used
+ */
+static bool lazy;
+module_param(lazy, bool, 0444);
+MODULE_PARM_DESC(lazy, " Request pins on first use instead of at load (default=0)");
+
+static unsigned int lazy_idle = 60;
+module_param(lazy_idle, uint, 0644);
+MODULE_PARM_DESC(lazy_idle, " Seconds after last close before lazy pin is released, 0=never (default=60)");
+
+/* latency of write requests is measured only on demand, when it
+ * is off the cost is a single test per write
+ */
+static bool latency;
+module_param(latency, bool, 0644);
+MODULE_PARM_DESC(latency, " Collect write to pin latency histogram (default=0)");
+
+/* latency histogram is per cpu, writers on different cores do not
+ * share cache lines. ioctl of control device sums it up
+ */
+static DEFINE_PER_CPU(struct gpio_lkm_lat_hist, gpio_lkm_lat);
 
 /* buffer with set of supported commands */
 const char * commands[NUM_COM] = {"out", "in", "low", "high"};
@@ -32,12 +178,306 @@ enum commands { set_out  = 0,
 enum direction {in, out};
 enum state {low, high};
 
+/*
+* struct gpio_lkm_wave_kstep - Waveform step prepared for playback
+* @delta_ns: time to hold the step
+* @bits: pin levels already converted to bitmap for array call
+*/
+struct gpio_lkm_wave_kstep
+{
+    u64 delta_ns;
+    DECLARE_BITMAP(bits, GPIO_LKM_BUS_MAX_PINS);
+};
+
+/*
+* struct gpio_lkm_wave - Waveform playback engine of pin or bus device
+* @timer: step timer, fires at absolute time of each step
+* @lock: serializes start, stop and statistics requests
+* @stats_lock: protects counters updated from timer callback
+* @running: playback is active
+* @npins: number of driven pins
+* @descs: descriptors of driven pins, copied at start
+* @pins: per pin devices of driven pins, copied at start
+* @steps: prepared pattern
+* @nsteps: number of steps in pattern
+* @pos: index of next step
+* @repeat: number of cycles to play, 0 for endless playback
+* @period_ns: nominal cycle length, sum of all steps
+* @cycle_start: time when current cycle started
+* @cycles: completed cycles
+* @applied: applied steps
+* @period_min: shortest measured cycle
+* @period_max: longest measured cycle
+* @period_sum: sum of measured cycles, used for mean value
+* @late_min: smallest step delay from schedule
+* @late_max: largest step delay from schedule
+* @late_sum: sum of step delays, used for mean value
+*/
+struct gpio_lkm_wave
+{
+    struct hrtimer timer;
+    struct mutex lock;
+    spinlock_t stats_lock;
+    bool running;
+    unsigned int npins;
+    struct gpio_desc **descs;
+    struct gpio_lkm_dev **pins;
+    struct gpio_lkm_wave_kstep *steps;
+    unsigned int nsteps;
+    unsigned int pos;
+    u32 repeat;
+    u64 period_ns;
+    ktime_t cycle_start;
+    u64 cycles;
+    u64 applied;
+    u64 period_min;
+    u64 period_max;
+    u64 period_sum;
+    s64 late_min;
+    s64 late_max;
+    s64 late_sum;
+};
+
+/*
+* struct gpio_lkm_pcpu_count - Edge counters of a pin on one cpu
+* @syncp: lets readers on 32 bit cpus see consistent 64 bit values
+* @rising: rising edges reported on this cpu
+* @falling: falling edges reported on this cpu
+*/
+struct gpio_lkm_pcpu_count
+{
+    struct u64_stats_sync syncp;
+    u64 rising;
+    u64 falling;
+};
+
+/*
+* struct gpio_lkm_ring - Ring of edge events handled on one cpu
+* @events: records of edges, written only by the cpu which owns the
+*   ring with interrupts off, so producer needs no lock
+* @read_lock: serializes readers bound to the ring, they are consumers
+* @wait: readers and pollers sleep here waiting for events
+* @syncp: lets readers on 32 bit cpus see consistent counters
+* @queued: records put to @events
+* @dropped: records lost because @events was full
+*/
+struct gpio_lkm_ring
+{
+    DECLARE_KFIFO_PTR(events, struct gpio_lkm_event);
+    struct mutex read_lock;
+    wait_queue_head_t wait;
+    struct u64_stats_sync syncp;
+    u64 queued;
+    u64 dropped;
+};
+
+/*
+* struct gpio_lkm_quad_dec - Quadrature decoder
+* @lock: serializes interrupt handlers of both pins and readers
+* @a: pin of encoder output A, NULL if decoder is not bound
+* @b: pin of encoder output B
+* @prev: last decoded state, level of A in bit 1 and of B in bit 0
+* @position: counts, 4 per encoder cycle
+* @transitions: valid transitions decoded
+* @errors: illegal transitions, both levels changed at once
+* @last: time of last transition
+* @win_start: start of current velocity window
+* @win_pos: position at start of window
+* @velocity: counts per second over last complete window
+*/
+struct gpio_lkm_quad_dec
+{
+    spinlock_t lock;
+    struct gpio_lkm_dev *a;
+    struct gpio_lkm_dev *b;
+    unsigned int prev;
+    s64 position;
+    u64 transitions;
+    u64 errors;
+    u64 last;
+    u64 win_start;
+    s64 win_pos;
+    s64 velocity;
+};
+
+/*
+* struct gpio_lkm_chip - Sleeping gpiochip some managed pins belong to
+* I2C and SPI expanders cannot be accessed with spinlocks held, so
+* level writes to their pins are queued and applied by a worker
+* @node: entry in gpio_lkm_chips list
+* @gc: the chip
+* @users: managed pins of the chip, protected by gpio_lkm_chips_lock
+* @wq: ordered workqueue of the chip, its bus transfers never overlap
+* @work: applies queued writes
+* @lock: protects @pending and pending levels of pins, taken under
+*   pin locks
+* @pending: pins with level waiting to be written, in order of writes
+* @batches: array writes done by @work
+* @writes: pin levels written by them
+*/
+struct gpio_lkm_chip
+{
+    struct list_head node;
+    struct gpio_chip *gc;
+    unsigned int users;
+    struct workqueue_struct *wq;
+    struct work_struct work;
+    spinlock_t lock;
+    struct list_head pending;
+    u64 batches;
+    u64 writes;
+};
+
+/*
+* struct gpio_lkm_keypad - Matrix keypad scanner
+* @cdev: keypad device, key events are read from it
+* @mutex: serializes binding requests
+* @lock: protects fields below, taken from scanner thread and from
+*   interrupt handlers of columns
+* @thread: scanner, reads columns of one row per tick. it runs
+*   while keypad is bound
+* @wait: readers and pollers sleep here waiting for events
+* @read_lock: serializes readers, they are kfifo consumers
+* @events: queue of key events, filled by scanner
+* @nrows: number of rows, 0 if keypad is not bound
+* @ncols: number of columns
+* @rows: pins of rows, driven low one by one while scanning
+* @cols: pins of columns, their edge interrupts wake scanner up
+* @tick_ns: time each row is driven, scan period / rows
+* @debounce: scans a key should agree on to change its state
+* @scanning: scanner runs and column interrupts are masked. otherwise
+*   all rows are driven low and any column edge starts scanning
+* @busy: some key was seen down during current scan
+* @row: row driven now
+* @idle: complete scans in a row with all keys up
+* @count: debounce integrators of keys, 0 .. @debounce
+* @pressed: accepted state of keys, bit per key
+* @scans: complete scans done
+* @wakeups: scans started by column interrupt
+* @queued: key events queued
+* @dropped: key events lost because @events was full
+*/
+struct gpio_lkm_keypad
+{
+    struct cdev cdev;
+    struct mutex mutex;
+    spinlock_t lock;
+    struct task_struct *thread;
+    wait_queue_head_t wait;
+    struct mutex read_lock;
+    DECLARE_KFIFO(events, struct gpio_lkm_key_event, GPIO_LKM_KEYPAD_QUEUE);
+    unsigned int nrows;
+    unsigned int ncols;
+    struct gpio_lkm_dev *rows[GPIO_LKM_KEYPAD_MAX_ROWS];
+    struct gpio_lkm_dev *cols[GPIO_LKM_KEYPAD_MAX_COLS];
+    u64 tick_ns;
+    unsigned int debounce;
+    bool scanning;
+    bool busy;
+    unsigned int row;
+    unsigned int idle;
+    u8 count[GPIO_LKM_KEYPAD_MAX_ROWS * GPIO_LKM_KEYPAD_MAX_COLS];
+    u64 pressed;
+    u64 scans;
+    u64 wakeups;
+    u64 queued;
+    u64 dropped;
+};
+
+/*
+* struct gpio_lkm_batch - Edges of pin pending for delivery
+* index 0 of arrays is for rising edges, 1 for falling
+* @edges: number of edges of each kind
+* @first_ns: time of first edge
+* @last_ns: time of last edge of each kind
+* @seq: sequence number of last edge of each kind
+* @edge: last edge, GPIO_LKM_EDGE_RISING or GPIO_LKM_EDGE_FALLING
+* @gap_ns: time between last edge and the one before it
+*/
+struct gpio_lkm_batch
+{
+    unsigned int edges[2];
+    u64 first_ns;
+    u64 last_ns[2];
+    __u64 seq[2];
+    __u32 edge;
+    __u32 gap_ns;
+};
+
 /*
 * struct gpio_lkm_dev - Per gpio pin data structure
 * @cdev: instance of struct cdev
 * @pin: instance of struct gpio
+* @desc: descriptor of the pin, used for all accesses to it
+* @can_sleep: pin belongs to a chip behind a slow bus. it is never
+*   accessed under spinlocks, writes to it go to worker of @chip
+* @chip: sleeping chip of the pin, NULL for pins of fast chips
+* @chip_node: entry in list of pins with pending write, protected by
+*   lock of @chip
+* @chip_level: level pending write will set
+* @requested: pin is requested from gpio subsystem. in lazy mode it
+*   is set on first use, other fields describing the pin are valid
+*   only while it is set. changed under @dir_lock
+* @sticky: pin is used by control device, bus or binding and is kept
+*   requested until unload
+* @users: open files of pin device, protected by @dir_lock
+* @idle_work: gives lazy pin back after its device was closed
 * @state: logic state (low, high) of a GPIO pin
 * @dir: direction of a GPIO pin
+* @index: position of the pin in gpio_lkm_devp[] and state page bitmaps
+* @irq: edge interrupt used while pin is an input, -1 if not requested
+* @bank: bank of 32 lines of its gpiochip the pin is in, selects
+*   worker handling its edges in threaded mode
+* @edge_work: edge handed by hard handler to worker of the bank
+* @irq_ns: timestamp taken by hard handler for worker
+* @pin_lock: protects @state, @dir and hardware accesses to the pin, so
+*   cached values always follow hardware. taken from interrupt handler
+*   and timers, held only around a register access
+* @dir_lock: serializes direction changes, which may sleep to request
+*   or free edge interrupt and stop waveform
+* @debounce_ns: debounce window of input, 0 if edges are reported as is.
+*   this and other debounce fields are protected by @pin_lock
+* @debounce_samples: number of equal samples within the window needed
+*   to accept a level
+* @debounce_period: interval between samples, window / samples
+* @debounce_timer: samples level while interrupt is masked
+* @debounce_active: interrupt is masked and @debounce_timer runs
+* @debounce_start: time of the edge which opened the window
+* @debounce_last: level of last sample
+* @debounce_stable: number of equal samples in a row
+* @debounce_accepted: windows which ended with a level change
+* @debounce_rejected: windows which ended with the old level, bounces
+* @measure: period and pulse width of input are measured from edges
+* @measure_rise: time of last rising edge, 0 if not seen yet
+* @measure_fall: time of last falling edge, 0 if not seen yet
+* @measure_stats: measurement statistics, averages are kept scaled by
+*   1 << GPIO_LKM_MEASURE_EWMA_SHIFT. protected by @pin_lock as well
+* @lock: protects @readers list, taken from interrupt handler
+* @readers: open files which subscribed to edge events of the pin
+* @seq: number of edges seen by interrupt handler
+* @count: per cpu counters of reported edges, written without locks
+*   from interrupt handler and debounce timer, summed up by readers
+* @reflex: number of reflex rules watching this pin, changed under
+*   gpio_lkm_reflex_lock. handler skips the table while it is zero
+* @prev_edge: time of previous edge delivered, for filter programs.
+*   protected by @lock
+* @quad: quadrature decoder the pin is bound to, NULL if none. edges
+*   of bound pin are decoded instead of being reported
+* @keypad: matrix keypad the pin is row or column of, NULL if none.
+*   edges of bound column wake keypad scanner instead of being reported
+* @coalesce_hz: edge rate above which events are coalesced, 0 if never.
+*   this and other coalescing fields are protected by @lock
+* @coalesce_ns: coalescing interval, one record per interval is made
+* @coalesce_edges: edges within an interval which switch to coalesced mode
+* @coalesced: pin is in coalesced mode, @coalesce_timer flushes @batch
+* @coalesce_switches: number of switches between modes
+* @coalesce_start: start of interval edges are counted in, edge mode
+* @coalesce_count: edges counted since @coalesce_start
+* @coalesce_timer: ends coalescing intervals
+* @batch: edges not yet turned into records
+* @wave: waveform playback engine driving this pin alone
+* @wave_owner: waveform driving the pin, @wave or one of a bus, NULL
+*   if none. protected by gpio_lkm_waves_lock
 */
 
 struct gpio_lkm_dev
@@ -49,8 +489,397 @@ struct gpio_lkm_dev
     /* declare pin of struct gpio type,
      * provided by include/linux/gpio.h */
     struct gpio pin;
+    struct gpio_desc *desc;
+    bool can_sleep;
+    struct gpio_lkm_chip *chip;
+    struct list_head chip_node;
+    enum state chip_level;
+    bool requested;
+    bool sticky;
+    unsigned int users;
+    struct delayed_work idle_work;
     enum state state;
     enum direction dir;
+    unsigned int index;
+    int irq;
+    unsigned int bank;
+    struct kthread_work edge_work;
+    u64 irq_ns;
+    spinlock_t pin_lock;
+    struct mutex dir_lock;
+    u64 debounce_ns;
+    unsigned int debounce_samples;
+    u64 debounce_period;
+    struct hrtimer debounce_timer;
+    bool debounce_active;
+    u64 debounce_start;
+    enum state debounce_last;
+    unsigned int debounce_stable;
+    u64 debounce_accepted;
+    u64 debounce_rejected;
+    bool measure;
+    u64 measure_rise;
+    u64 measure_fall;
+    struct gpio_lkm_measure measure_stats;
+    spinlock_t lock;
+    struct list_head readers;
+    __u64 seq;
+    struct gpio_lkm_pcpu_count __percpu *count;
+    unsigned int reflex;
+    u64 prev_edge;
+    struct gpio_lkm_quad_dec *quad;
+    struct gpio_lkm_keypad *keypad;
+    unsigned int coalesce_hz;
+    u64 coalesce_ns;
+    unsigned int coalesce_edges;
+    bool coalesced;
+    u64 coalesce_switches;
+    u64 coalesce_start;
+    unsigned int coalesce_count;
+    struct hrtimer coalesce_timer;
+    struct gpio_lkm_batch batch;
+    struct gpio_lkm_wave wave;
+    struct gpio_lkm_wave *wave_owner;
+};
+
+/*
+* struct gpio_lkm_file - Per open file data of GPIO pin device
+* @dev: pin the file was opened for
+* @node: entry in list of pin readers
+* @edges: edges reported to this file, GPIO_LKM_EDGE_* mask
+* @revoked: pin stopped tracking edges while file was subscribed,
+*   reads fail once queued records are consumed
+* @events: queue of edge records, filled by interrupt handler
+* @batches: queue of batch records, used instead of @events by
+*   files subscribed with GPIO_LKM_EDGE_BATCH
+* @wait: readers and pollers sleep here waiting for events
+* @read_lock: serializes readers, they are kfifo consumers
+* @mode: write protocol, GPIO_LKM_MODE_TEXT or GPIO_LKM_MODE_BINARY
+* @queued: number of records put to @events or @batches
+* @dropped: number of records lost because queue was full
+* @filter: classic BPF program deciding which records are queued,
+*   NULL if all are. run and replaced under lock of the pin
+* @filter_accepted: number of records accepted by @filter
+* @filter_rejected: number of records dropped by @filter
+* @last_accept: time of last record accepted for this file
+*/
+struct gpio_lkm_file
+{
+    struct gpio_lkm_dev *dev;
+    struct list_head node;
+    unsigned int edges;
+    bool revoked;
+    DECLARE_KFIFO_PTR(events, struct gpio_lkm_event);
+    DECLARE_KFIFO_PTR(batches, struct gpio_lkm_event_batch);
+    wait_queue_head_t wait;
+    struct mutex read_lock;
+    unsigned int mode;
+    __u64 queued;
+    __u64 dropped;
+    struct bpf_prog *filter;
+    __u64 filter_accepted;
+    __u64 filter_rejected;
+    u64 last_accept;
+};
+
+/*
+* struct gpio_lkm_bus - Pin group (bus) device data structure
+* @cdev: instance of struct cdev
+* @lock: serializes configuration and writes to the bus
+* @npins: number of pins assigned to the bus, 0 if not configured
+* @pins: per pin devices of bus members, pins[n] is driven by bit n
+* @descs: gpio descriptors of bus members, used for array calls
+* @sel: scratch array of descriptors selected by write mask
+* @wave: waveform playback engine driving bus pins together
+*/
+struct gpio_lkm_bus
+{
+    struct cdev cdev;
+    struct mutex lock;
+    unsigned int npins;
+    struct gpio_lkm_dev *pins[GPIO_LKM_BUS_MAX_PINS];
+    struct gpio_desc *descs[GPIO_LKM_BUS_MAX_PINS];
+    struct gpio_desc *sel[GPIO_LKM_BUS_MAX_PINS];
+    struct gpio_lkm_wave wave;
+};
+
+/*
+* struct gpio_lkm_capture - Logic analyzer capture mode data
+* @cdev: instance of struct cdev for /dev/gpio_lkm_la
+* @lock: serializes start and stop requests
+* @timer: sampling timer, fires at requested rate
+* @wait: pollers of ring wait here for watermark
+* @ring: ring buffer, header page followed by samples. header is
+*   mapped writable for @tail, so the driver only copies its own
+*   fields out there and reads nothing back but @tail
+* @size: size of ring buffer in bytes
+* @head: number of samples written, published to header
+* @nsamples: capacity of ring in samples
+* @sample_size: size of one sample in bytes
+* @data_offset: offset of first sample from start of ring
+* @stats: capture counters, copied to header along with @head
+* @running: capture timer is active
+* @period_ns: sampling period
+* @watermark: number of new samples which wakes up pollers
+* @wake_head: ring head at the time of last wake up
+* @npins: number of sampled pins
+* @words: number of 64 bit words in a sample bitmap
+* @descs: descriptors of sampled pins, used for array call
+* @values: scratch bitmap for array call
+*/
+struct gpio_lkm_capture
+{
+    struct cdev cdev;
+    struct mutex lock;
+    struct hrtimer timer;
+    wait_queue_head_t wait;
+    struct gpio_lkm_capture_ring *ring;
+    size_t size;
+    __u32 head;
+    __u32 nsamples;
+    __u32 sample_size;
+    __u32 data_offset;
+    struct gpio_lkm_capture_stats stats;
+    bool running;
+    u64 period_ns;
+    __u32 watermark;
+    __u32 wake_head;
+    unsigned int npins;
+    unsigned int words;
+    struct gpio_desc **descs;
+    unsigned long *values;
+};
+
+/*
+* struct gpio_lkm_group - Pin group of in-kernel API
+* @npins: number of pins in group
+* @pins: pin devices, pins[n] is driven by bit n of value
+* @descs: descriptors of pins for array calls
+*/
+struct gpio_lkm_group
+{
+    unsigned int npins;
+    struct gpio_lkm_dev *pins[GPIO_LKM_BUS_MAX_PINS];
+    struct gpio_desc *descs[GPIO_LKM_BUS_MAX_PINS];
+};
+
+/*
+* struct gpio_lkm_serial_edge - Precomputed edge of bit-banged frame
+* @t_ns: time of the edge from start of frame
+* @line: 0 for data line, 1 for clock line
+* @level: level the line is set to
+*/
+struct gpio_lkm_serial_edge
+{
+    u32 t_ns;
+    u8 line;
+    u8 level;
+};
+
+/*
+* struct gpio_lkm_script_kstep - Script step prepared for execution
+* @dev: pin of level command, NULL for delay
+* @op: GPIO_LKM_OP_* opcode
+* @value: level or delay in ns
+*/
+struct gpio_lkm_script_kstep
+{
+    struct gpio_lkm_dev *dev;
+    u8 op;
+    u32 value;
+};
+
+/*
+* struct gpio_lkm_script - Timed script executed from hrtimer
+* @lock: serializes scripts, one is executed at a time
+* @timer: executes steps up to next delay, then sleeps for it
+* @done: completed when script ends or fails
+* @steps: prepared steps
+* @times: measured timing of steps
+* @nsteps: number of steps
+* @pos: next step to execute
+* @start: time script started at
+* @plan: time current group of steps is scheduled at
+* @status: 0 or error of failed step
+*/
+struct gpio_lkm_script
+{
+    struct mutex lock;
+    struct hrtimer timer;
+    struct completion done;
+    struct gpio_lkm_script_kstep *steps;
+    struct gpio_lkm_step_time *times;
+    unsigned int nsteps;
+    unsigned int pos;
+    ktime_t start;
+    ktime_t plan;
+    int status;
+};
+
+/*
+* struct gpio_lkm_reflex_rule - Reflex rule of driver table
+* @used: slot holds a rule
+* @in: input pin watched by rule
+* @out: output pin driven by rule
+* @edges: GPIO_LKM_EDGE_* mask of edges which fire the rule
+* @action: GPIO_LKM_REFLEX_* action
+* @pulse_ns: pulse width of pulse action
+* @pulse_timer: ends pulse
+* @pulse_active: output is inverted and @pulse_timer runs
+* @restore: level output returns to at the end of pulse
+* @hits: number of times rule fired
+* @lat_last: reaction latency of last hit
+* @lat_min: shortest reaction latency
+* @lat_max: longest reaction latency
+* @lat_sum: sum of reaction latencies, used for mean value
+*/
+struct gpio_lkm_reflex_rule
+{
+    bool used;
+    struct gpio_lkm_dev *in;
+    struct gpio_lkm_dev *out;
+    u32 edges;
+    u32 action;
+    u64 pulse_ns;
+    struct hrtimer pulse_timer;
+    bool pulse_active;
+    enum state restore;
+    u64 hits;
+    u64 lat_last;
+    u64 lat_min;
+    u64 lat_max;
+    u64 lat_sum;
+};
+
+/*
+* struct gpio_lkm_stepper_kmove - Move queued to stepper axis
+* @steps: number of steps
+* @dir: level of direction pin during the move
+* @vmax: cruise step rate
+* @accel: acceleration, steps per second squared
+*/
+struct gpio_lkm_stepper_kmove
+{
+    u32 steps;
+    enum state dir;
+    u32 vmax;
+    u32 accel;
+};
+
+/*
+* struct gpio_lkm_stepper - Stepper axis driven from hrtimer
+* @mutex: serializes requests to the axis
+* @lock: protects fields below, taken from timer
+* @timer: fires at rising and at falling edge of each step pulse
+* @step: pin of step input, NULL if axis is not bound
+* @dir: pin of direction input
+* @pulse_ns: step pulse width and direction setup time
+* @queue: moves waiting to be started
+* @head: next move in @queue
+* @count: number of moves in @queue
+* @running: axis is moving and @timer runs
+* @pulse_high: step pin is high, next tick ends the pulse
+* @cur: move being executed
+* @n: step of @cur being done
+* @v_start: step rate @cur starts with
+* @v_end: step rate @cur ends with, next move starts with it
+* @dir_level: current level of direction pin
+* @next: planned time of rising edge of step @n
+* @position: signed number of steps done
+* @velocity: step rate of current step
+* @moves: completed moves
+* @max_late: largest delay of a step from its schedule
+*/
+struct gpio_lkm_stepper
+{
+    struct mutex mutex;
+    spinlock_t lock;
+    struct hrtimer timer;
+    struct gpio_lkm_dev *step;
+    struct gpio_lkm_dev *dir;
+    u32 pulse_ns;
+    struct gpio_lkm_stepper_kmove queue[GPIO_LKM_STEPPER_QUEUE];
+    unsigned int head;
+    unsigned int count;
+    bool running;
+    bool pulse_high;
+    struct gpio_lkm_stepper_kmove cur;
+    u32 n;
+    u32 v_start;
+    u32 v_end;
+    enum state dir_level;
+    ktime_t next;
+    s64 position;
+    u32 velocity;
+    u64 moves;
+    u64 max_late;
+};
+
+/*
+* struct gpio_lkm_at_cmd - Scheduled output transition
+* @node: entry in queue, keyed by CLOCK_REALTIME time
+* @dev: output pin, NULL if slot is free
+* @level: level to set
+* @id: identifier returned to user space
+*/
+struct gpio_lkm_at_cmd
+{
+    struct timerqueue_node node;
+    struct gpio_lkm_dev *dev;
+    enum state level;
+    u64 id;
+};
+
+/*
+* struct gpio_lkm_at_queue - Output transitions at absolute time
+* @lock: protects fields below, taken from timer. pin lock is
+*   taken inside of it
+* @head: pending transitions ordered by time
+* @timer: CLOCK_REALTIME timer armed for the earliest transition,
+*   it follows changes of system time
+* @cmds: slots of transitions
+* @results: outcomes of fired transitions not read yet
+* @seq: last id given out
+* @pending: transitions in @head
+* @queued: transitions added
+* @fired: transitions done
+* @failed: transitions which found pin not an output
+* @cancelled: transitions cancelled
+* @lost: results dropped because @results was full
+* @late_min: smallest lateness
+* @late_max: largest lateness
+* @late_sum: sum of lateness, used for mean value
+*/
+struct gpio_lkm_at_queue
+{
+    spinlock_t lock;
+    struct timerqueue_head head;
+    struct hrtimer timer;
+    struct gpio_lkm_at_cmd cmds[GPIO_LKM_AT_MAX];
+    DECLARE_KFIFO(results, struct gpio_lkm_at_result, GPIO_LKM_AT_RESULTS);
+    u64 seq;
+    unsigned int pending;
+    u64 queued;
+    u64 fired;
+    u64 failed;
+    u64 cancelled;
+    u64 lost;
+    s64 late_min;
+    s64 late_max;
+    s64 late_sum;
+};
+
+/*
+* struct gpio_lkm_ctl_file - Per open file data of control device
+* @lock: protects @times
+* @times: timing of last script written to this file
+* @ntimes: number of records in @times not read yet
+*/
+struct gpio_lkm_ctl_file
+{
+    struct mutex lock;
+    struct gpio_lkm_step_time *times;
+    unsigned int ntimes;
 };
 
 /* to implement a char device driver we need to satisfy some
@@ -70,6 +899,9 @@ static int gpio_lkm_open(struct inode *inode, struct file *filp);
 static int gpio_lkm_release(struct inode *inode, struct file *filp);
 static ssize_t gpio_lkm_read (struct file *filp, char *buf, size_t count, loff_t *f_pos);
 static ssize_t gpio_lkm_write (struct file *filp, const char *buf, size_t count, loff_t *f_pos);
+static __poll_t gpio_lkm_poll (struct file *filp, poll_table *wait);
+static long gpio_lkm_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+static int gpio_lkm_fsync (struct file *filp, loff_t start, loff_t end, int datasync);
 
 /* declare structure gpio_lkm_fops which holds 
  * our implementations of callback functions,
@@ -83,6 +915,118 @@ static struct file_operations gpio_lkm_fops =
     .release = gpio_lkm_release,
     .read = gpio_lkm_read,
     .write = gpio_lkm_write,
+    .poll = gpio_lkm_poll,
+    .unlocked_ioctl = gpio_lkm_ioctl,
+    .fsync = gpio_lkm_fsync,
+};
+
+/* bus devices are separate char devices with their own set
+ * of callbacks. they accept binary value/mask words instead
+ * of text commands, so a whole group of pins is changed by
+ * one call to gpio subsystem
+ */
+static int gpio_lkm_bus_open(struct inode *inode, struct file *filp);
+static ssize_t gpio_lkm_bus_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t gpio_lkm_bus_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static long gpio_lkm_bus_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+
+static struct file_operations gpio_lkm_bus_fops =
+{
+    .owner = THIS_MODULE,
+    .open = gpio_lkm_bus_open,
+    .read = gpio_lkm_bus_read,
+    .write = gpio_lkm_bus_write,
+    .unlocked_ioctl = gpio_lkm_bus_ioctl,
+};
+
+/* control device is not bound to any pin. its mmap method
+ * exposes read-only page with state of all managed pins, so
+ * user space can poll them with plain memory loads. write
+ * method accepts binary commands for any of managed pins
+ */
+static int gpio_lkm_ctl_open (struct inode *inode, struct file *filp);
+static int gpio_lkm_ctl_release (struct inode *inode, struct file *filp);
+static ssize_t gpio_lkm_ctl_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t gpio_lkm_ctl_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+static ssize_t gpio_lkm_ctl_write_iter (struct kiocb *iocb, struct iov_iter *from);
+static int gpio_lkm_ctl_mmap (struct file *filp, struct vm_area_struct *vma);
+static long gpio_lkm_ctl_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* write() executes binary commands as they come, while writev()
+ * goes to write_iter method and runs them as a timed script
+ */
+static struct file_operations gpio_lkm_ctl_fops =
+{
+    .owner = THIS_MODULE,
+    .open = gpio_lkm_ctl_open,
+    .release = gpio_lkm_ctl_release,
+    .read = gpio_lkm_ctl_read,
+    .write = gpio_lkm_ctl_write,
+    .write_iter = gpio_lkm_ctl_write_iter,
+    .mmap = gpio_lkm_ctl_mmap,
+    .unlocked_ioctl = gpio_lkm_ctl_ioctl,
+};
+
+/* capture device samples all pins from timer interrupt into
+ * a ring buffer, which user space maps and drains without
+ * copying data through read()
+ */
+static long gpio_lkm_capture_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+static __poll_t gpio_lkm_capture_poll (struct file *filp, poll_table *wait);
+static int gpio_lkm_capture_mmap (struct file *filp, struct vm_area_struct *vma);
+
+static struct file_operations gpio_lkm_capture_fops =
+{
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = gpio_lkm_capture_ioctl,
+    .poll = gpio_lkm_capture_poll,
+    .mmap = gpio_lkm_capture_mmap,
+};
+
+/* counter device returns edge counts of all pins as text,
+ * one line per pin
+ */
+static ssize_t gpio_lkm_counts_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+
+static struct file_operations gpio_lkm_count_fops =
+{
+    .owner = THIS_MODULE,
+    .read = gpio_lkm_counts_read,
+    .llseek = default_llseek,
+};
+
+/* keypad device is configured by ioctl and returns key
+ * events as binary records
+ */
+static ssize_t gpio_lkm_keypad_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+static __poll_t gpio_lkm_keypad_poll (struct file *filp, poll_table *wait);
+static long gpio_lkm_keypad_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+
+static struct file_operations gpio_lkm_keypad_fops =
+{
+    .owner = THIS_MODULE,
+    .read = gpio_lkm_keypad_read,
+    .poll = gpio_lkm_keypad_poll,
+    .unlocked_ioctl = gpio_lkm_keypad_ioctl,
+};
+
+/* event device returns edge records of all pins from per cpu
+ * rings, each open file reads ring of the cpu it is bound to
+ */
+static int gpio_lkm_ring_open (struct inode *inode, struct file *filp);
+static int gpio_lkm_ring_release (struct inode *inode, struct file *filp);
+static ssize_t gpio_lkm_ring_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+static __poll_t gpio_lkm_ring_poll (struct file *filp, poll_table *wait);
+static long gpio_lkm_ring_ioctl (struct file *filp, unsigned int cmd, unsigned long arg);
+
+static struct file_operations gpio_lkm_ring_fops =
+{
+    .owner = THIS_MODULE,
+    .open = gpio_lkm_ring_open,
+    .release = gpio_lkm_ring_release,
+    .read = gpio_lkm_ring_read,
+    .poll = gpio_lkm_ring_poll,
+    .unlocked_ioctl = gpio_lkm_ring_ioctl,
 };
 
 /* declare prototypes of init and exit functions.
@@ -94,9 +1038,79 @@ static struct file_operations gpio_lkm_fops =
 static int gpio_lkm_init(void);
 static void gpio_lkm_exit(void);
 
+/* sleeping chips of managed pins. pins attach and detach at
+ * runtime in lazy mode, each under its own lock only, so list
+ * and users counts of chips are protected by gpio_lkm_chips_lock
+ */
+static LIST_HEAD(gpio_lkm_chips);
+static DEFINE_MUTEX(gpio_lkm_chips_lock);
+
+/* a pin is driven by one waveform at a time, of its own device or
+ * of a bus. the lock protects wave_owner of all pins, it is taken
+ * under lock of a waveform
+ */
+static DEFINE_MUTEX(gpio_lkm_waves_lock);
+
 /* declare an array of gpio_lkm_dev device structure objects
- * which represent each of our pins as a char device */
-struct gpio_lkm_dev *gpio_lkm_devp[USE_GPIOS_NUM];
+ * which represent each of our pins as a char device. array
+ * is dense and allocated for the number of pins in table */
+static struct gpio_lkm_dev **gpio_lkm_devp;
+static unsigned int gpio_lkm_npins;
+/* workers handling edges in threaded mode, one per bank. the
+ * lock serializes their creation with writes of bank_cpu
+ */
+static struct kthread_worker *gpio_lkm_bank_worker[GPIO_LKM_BANK_NUM];
+static DEFINE_MUTEX(gpio_lkm_bank_lock);
+/* resolved pin table, global GPIO numbers */
+static unsigned int gpio_lkm_table[GPIO_LKM_MAX_PINS];
+/* maps GPIO number to its device, for requests naming pins */
+static DEFINE_XARRAY(gpio_lkm_pin_map);
+/* array of bus devices, each may group several of pins above */
+static struct gpio_lkm_bus *gpio_lkm_busp[GPIO_LKM_BUS_NUM];
+/* control device and the state page shared with user space,
+ * page writers are serialized by the lock, readers use seq */
+static struct cdev gpio_lkm_ctl_cdev;
+static struct gpio_lkm_state_page *gpio_lkm_state;
+static DEFINE_SPINLOCK(gpio_lkm_state_lock);
+/* logic analyzer capture, only one may run at a time */
+static struct gpio_lkm_capture gpio_lkm_cap;
+/* edge counter device */
+static struct cdev gpio_lkm_count_cdev;
+/* per cpu event rings and their device. rings are filled only
+ * while the device is open
+ */
+static struct gpio_lkm_ring __percpu *gpio_lkm_rings;
+static atomic_t gpio_lkm_ring_users = ATOMIC_INIT(0);
+static struct cdev gpio_lkm_ring_cdev;
+/* timed script engine of control device */
+static struct gpio_lkm_script gpio_lkm_script;
+/* reflex rules. interrupt handlers read the table under the
+ * spinlock, requests changing it are serialized by the mutex
+ */
+static struct gpio_lkm_reflex_rule gpio_lkm_reflex[GPIO_LKM_REFLEX_MAX];
+static DEFINE_SPINLOCK(gpio_lkm_reflex_lock);
+static DEFINE_MUTEX(gpio_lkm_reflex_mutex);
+/* stepper axes */
+static struct gpio_lkm_stepper gpio_lkm_stepper[GPIO_LKM_STEPPER_NUM];
+/* quadrature decoders, binding requests are serialized by mutex */
+static struct gpio_lkm_quad_dec gpio_lkm_quad[GPIO_LKM_QUAD_NUM];
+static DEFINE_MUTEX(gpio_lkm_quad_mutex);
+/* matrix keypad */
+static struct gpio_lkm_keypad gpio_lkm_keypad;
+/* output transitions scheduled at absolute time */
+static struct gpio_lkm_at_queue gpio_lkm_at;
+
+/* step of quadrature decoder indexed by previous and current
+ * state (A << 1 | B) as prev << 2 | cur. A leading B counts up,
+ * 2 marks illegal transition where both levels changed
+ */
+static const s8 gpio_lkm_quad_table[16] =
+{
+     0, -1,  1,  2,
+     1,  0,  2, -1,
+    -1,  2,  0,  1,
+     2,  1, -1,  0,
+};
 /* */
 static dev_t first;
 /* declare pointer to our device class. this will
@@ -123,196 +1137,6402 @@ static unsigned int which_command(const char * com)
     return na;
 }
 
-/* comprehensive reading about read/write/open/release char device methods
-*  https://www.oreilly.com/library/view/linux-device-drivers/0596005903/ch03.html
-*/
-
 /*
-* gpio_lkm_open - Open GPIO device
-* this is implementation of previously declared function
-* open from our file_operations structure.
-* this function will be called each time device recives
-* open file operation applied to its name in /dev
-* open method call creates struct file instance
+* gpio_lkm_find_pin - find per pin device structure by GPIO number.
+* returns NULL if requested GPIO is not managed by this driver
 */
-static int gpio_lkm_open (struct inode *inode, struct file *filp)
+static struct gpio_lkm_dev *gpio_lkm_find_pin(unsigned int gpio)
 {
-    struct gpio_lkm_dev *gpio_lkm_devp;
-    unsigned int gpio;
-
-    /* call include/linux/fs.h api to get minor 
-     * number from input inode struct */
-    gpio = iminor(inode);
-    /* print obtained number to system journal */
-    printk(KERN_INFO "[GPIO-LKM] - GPIO[%d] opened\n", gpio);
-    /* this macro basically tells kernel to match name cdev
-     * of type struct gpio_lkm_dev to where first argument points to
-     * see struct inode definition in fs.h line 679 and more 
-     * info about macro here
-     * https://radek.io/2012/11/10/magical-container_of-macro/
-     *  */
-    gpio_lkm_devp = container_of(inode->i_cdev, struct gpio_lkm_dev, cdev);
-    /* assign a pointer to struct representing our 
-     * device to its corresponding file object */
-    filp->private_data = gpio_lkm_devp;
-    
-    /* zero returns stand for success in kernel programming */
-    return 0;
+    return xa_load(&gpio_lkm_pin_map, gpio);
 }
 
 /*
-* gpio_lkm_release - Release GPIO device
-* this function is called whenever kernel tries to remove driver
-* module from system. here all 
+* gpio_lkm_state_update - publish direction and level of a pin
+* in the shared state page. seq is made odd for the time of
+* update, so user space readers can detect torn snapshots.
+* may be called from interrupt context
 */
-static int gpio_lkm_release (struct inode *inode, struct file *filp)
+static void gpio_lkm_state_update(struct gpio_lkm_dev *dev)
 {
-    unsigned int gpio;
-    
-    gpio = iminor(inode);
+    unsigned int word = dev->index / 64;
+    __u64 bit = 1ULL << (dev->index % 64);
+    unsigned long flags;
+    __u64 dir, level;
 
-    /* remove pointer our device data, that was assigned in open 
-     * if any resources was allocated they should be dealocated
-     * here before return
-    */
-    filp->private_data = NULL;
-    /* print debug message to system journal - good practice */
-    printk(KERN_INFO "[GPIO-LKM] - Closing GPIO %d\n", gpio);
+    if (!gpio_lkm_state)
+        return;
 
-    return 0;
+    spin_lock_irqsave(&gpio_lkm_state_lock, flags);
+
+    dir = gpio_lkm_state->dir[word];
+    level = gpio_lkm_state->level[word];
+    dir = dev->dir == out ? dir | bit : dir & ~bit;
+    level = dev->state == high ? level | bit : level & ~bit;
+
+    WRITE_ONCE(gpio_lkm_state->seq, gpio_lkm_state->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(gpio_lkm_state->dir[word], dir);
+    WRITE_ONCE(gpio_lkm_state->level[word], level);
+    smp_wmb();
+    WRITE_ONCE(gpio_lkm_state->seq, gpio_lkm_state->seq + 1);
+
+    spin_unlock_irqrestore(&gpio_lkm_state_lock, flags);
 }
 
 /*
-* gpio_lkm_read - Read method implementation for GPIO device
-* this method will be called whenever read command is applied
-* to our device in /dev. data that should be provided to user
-* space 
+* gpio_lkm_chip_work - Apply writes queued to sleeping chip
+* pending levels are taken in batches and set with one array
+* call. gpiolib passes lines of one chip to its set_multiple
+* method, so expander gets a batch in one bus transfer. writes
+* queued while a batch is on the bus make the next batch
 */
-static ssize_t gpio_lkm_read ( struct file *filp, char *buf, size_t count, loff_t *f_pos)
+static void gpio_lkm_chip_work(struct work_struct *work)
 {
-    unsigned int gpio;
-    ssize_t retval;
-    char byte;
-
-    /* determine which device is read from inode sctructure.
-     * remember, we have 14 GPIOs at max and each is effectively
-     * separate device using same driver
-     */
-    gpio = iminor(filp->f_path.dentry->d_inode);
+    struct gpio_lkm_chip *chip = container_of(work, struct gpio_lkm_chip, work);
+    struct gpio_desc *descs[GPIO_LKM_CHIP_BATCH];
+    DECLARE_BITMAP(values, GPIO_LKM_CHIP_BATCH);
+    struct gpio_lkm_dev *dev;
+    unsigned int n;
+    int ret;
 
-    /* get count amount of values from GPIO device */
-    for (retval = 0; retval < count; ++retval)
+    do
     {
-        /* use kernel gpio API functions to get
-         * value of gpio by minor numer of device
-         */
-        byte = '0' + gpio_get_value(gpio);
+        n = 0;
+        spin_lock_irq(&chip->lock);
+        while (n < GPIO_LKM_CHIP_BATCH && !list_empty(&chip->pending))
+        {
+            dev = list_first_entry(&chip->pending, struct gpio_lkm_dev, chip_node);
+            list_del_init(&dev->chip_node);
+            descs[n] = dev->desc;
+            assign_bit(n, values, dev->chip_level == high);
+            n++;
+        }
+        spin_unlock_irq(&chip->lock);
 
-        /* use special macro to copy data from kernel space
-         * co user space. API related to user space
-         * interactions are found in arm/asm/uaccess.h
-         */
-        if(put_user(byte, buf+retval))
+        if (!n)
             break;
-    }
-    
-    return retval;
+
+        ret = gpiod_set_raw_array_value_cansleep(n, descs, NULL, values);
+        if (ret)
+            printk_ratelimited(KERN_ERR "[GPIO_LKM] - Error %d writing %u pins of %s\n",
+                               ret, n, chip->gc->label);
+        chip->batches++;
+        chip->writes += n;
+    } while (n == GPIO_LKM_CHIP_BATCH);
 }
 
 /*
-* gpio_lkm_write - Write method implementation for GPIO device
-* this method will be called whenever write command is applied
-* to our device in /dev. data that should be provided to user
-* space 
+* gpio_lkm_chip_queue - Queue level write to pin of sleeping chip
+* pin written again before worker gets to it keeps its place in
+* queue and only its level is replaced, so worker never falls
+* behind a fast writer. called with pin lock held
 */
-static ssize_t gpio_lkm_write ( struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+static void gpio_lkm_chip_queue(struct gpio_lkm_dev *dev, enum state level)
 {
-    unsigned int gpio, len = 0;
-    char kbuf[BUF_SIZE];
-    struct gpio_lkm_dev *gpio_lkm_devp = filp->private_data;
+    struct gpio_lkm_chip *chip = dev->chip;
 
-    /* get gpio device minor number 
-    */
-    gpio = iminor(filp->f_path.dentry->d_inode);
+    spin_lock(&chip->lock);
+    dev->chip_level = level;
+    if (list_empty(&dev->chip_node))
+        list_add_tail(&dev->chip_node, &chip->pending);
+    spin_unlock(&chip->lock);
 
-    len = count < BUF_SIZE ? count-1 : BUF_SIZE-1;
+    queue_work(chip->wq, &chip->work);
+}
 
-    /* one more special kernel macro to copy data between
-     * user space memory and kernel space memory
-     */
-    if(raw_copy_from_user(kbuf, buf, len) != 0)
+/*
+* gpio_lkm_chip_flush - Wait for queued writes to sleeping chip
+* no-op for pins of fast chips
+*/
+static void gpio_lkm_chip_flush(struct gpio_lkm_dev *dev)
+{
+    if (dev->chip)
+        flush_work(&dev->chip->work);
+}
+
+/*
+* gpio_lkm_chip_get - Attach pin to worker of its sleeping chip
+* worker is created for first pin of the chip
+*/
+static int gpio_lkm_chip_get(struct gpio_lkm_dev *dev)
+{
+    struct gpio_chip *gc = gpiod_to_chip(dev->desc);
+    struct gpio_lkm_chip *chip;
+    int ret = 0;
+
+    mutex_lock(&gpio_lkm_chips_lock);
+    list_for_each_entry(chip, &gpio_lkm_chips, node)
+    {
+        if (chip->gc == gc)
+            goto found;
+    }
+
+    chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+    if (!chip)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* writes are latency sensitive, do not queue them behind
+     * ordinary work items
+     */
+    chip->wq = alloc_ordered_workqueue("gpio_lkm/%s", WQ_HIGHPRI, gc->label);
+    if (!chip->wq)
+    {
+        kfree(chip);
+        ret = -ENOMEM;
+        goto out;
+    }
+    chip->gc = gc;
+    INIT_WORK(&chip->work, gpio_lkm_chip_work);
+    spin_lock_init(&chip->lock);
+    INIT_LIST_HEAD(&chip->pending);
+    list_add_tail(&chip->node, &gpio_lkm_chips);
+
+found:
+    chip->users++;
+    dev->chip = chip;
+out:
+    mutex_unlock(&gpio_lkm_chips_lock);
+    return ret;
+}
+
+/*
+* gpio_lkm_chip_put - Detach pin from worker of its chip
+* queued write of the pin is applied first. worker is destroyed
+* with last pin of the chip
+*/
+static void gpio_lkm_chip_put(struct gpio_lkm_dev *dev)
+{
+    struct gpio_lkm_chip *chip = dev->chip;
+
+    if (!chip)
+        return;
+
+    flush_work(&chip->work);
+    dev->chip = NULL;
+
+    /* chip may be looked up by another pin until it is unlinked */
+    mutex_lock(&gpio_lkm_chips_lock);
+    if (--chip->users)
+    {
+        mutex_unlock(&gpio_lkm_chips_lock);
+        return;
+    }
+    list_del(&chip->node);
+    mutex_unlock(&gpio_lkm_chips_lock);
+
+    printk(KERN_INFO "[GPIO_LKM] - %s: %llu pin writes in %llu bus transfers\n",
+           chip->gc->label, (unsigned long long)chip->writes,
+           (unsigned long long)chip->batches);
+    destroy_workqueue(chip->wq);
+    kfree(chip);
+}
+
+/*
+* gpio_lkm_pin_write - Drive level of output pin
+* pins of fast chips are written right away, writes to pins
+* of sleeping chips are queued and caller does not wait for the
+* bus. called with pin lock held
+*/
+static void gpio_lkm_pin_write(struct gpio_lkm_dev *dev, enum state level)
+{
+    if (dev->can_sleep)
+        gpio_lkm_chip_queue(dev, level);
+    else
+        gpiod_set_raw_value(dev->desc, level);
+}
+
+/*
+* gpio_lkm_pin_get - Level of pin for read requests
+* output of sleeping chip may still have a write queued, so its
+* cached level is returned instead of asking the chip
+*/
+static int gpio_lkm_pin_get(struct gpio_lkm_dev *dev)
+{
+    if (!dev->can_sleep)
+        return gpiod_get_raw_value(dev->desc);
+    if (READ_ONCE(dev->dir) == out)
+        return READ_ONCE(dev->state) == high;
+    return gpiod_get_raw_value_cansleep(dev->desc);
+}
+
+/*
+* gpio_lkm_pin_level - Record level driven by array update
+* bus writes and waveforms set many pins with one call and
+* then refresh cached level of each. pin which became input
+* meanwhile keeps level sampled by direction change
+*/
+static void gpio_lkm_pin_level(struct gpio_lkm_dev *dev, enum state state)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    if (dev->dir == out)
+    {
+        dev->state = state;
+        gpio_lkm_state_update(dev);
+    }
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+}
+
+/*
+* gpio_lkm_measure_value - Account one value of measured quantity
+*/
+static void gpio_lkm_measure_value(struct gpio_lkm_measure_value *v, u64 x, bool first)
+{
+    v->last = x;
+    if (first)
+    {
+        v->min = x;
+        v->max = x;
+        v->ewma = x << GPIO_LKM_MEASURE_EWMA_SHIFT;
+        return;
+    }
+    v->min = min(v->min, x);
+    v->max = max(v->max, x);
+    /* avg += (x - avg) / 2^shift, with avg scaled by 2^shift */
+    v->ewma = v->ewma - (v->ewma >> GPIO_LKM_MEASURE_EWMA_SHIFT) + x;
+}
+
+/*
+* gpio_lkm_measure_edge - Update measurement with an edge
+* period ends on rising edge. it is counted only if falling
+* edge was seen inside, otherwise an edge was lost and high
+* time is unknown. called with pin_lock held
+*/
+static void gpio_lkm_measure_edge(struct gpio_lkm_dev *dev, __u32 edge, u64 ktime_ns)
+{
+    struct gpio_lkm_measure *m = &dev->measure_stats;
+    u64 period, high;
+    bool first;
+
+    m->edges++;
+    m->last_edge_ns = ktime_ns;
+
+    if (edge == GPIO_LKM_EDGE_FALLING)
+    {
+        dev->measure_fall = ktime_ns;
+        return;
+    }
+
+    if (dev->measure_rise && dev->measure_fall > dev->measure_rise)
+    {
+        period = ktime_ns - dev->measure_rise;
+        high = dev->measure_fall - dev->measure_rise;
+        first = !m->periods;
+
+        gpio_lkm_measure_value(&m->period_ns, period, first);
+        gpio_lkm_measure_value(&m->high_ns, high, first);
+        gpio_lkm_measure_value(&m->duty_ppm, div64_u64(high * 1000000, period), first);
+        m->periods++;
+    }
+    dev->measure_rise = ktime_ns;
+}
+
+/*
+* gpio_lkm_measure_get - Take snapshot of measurement for user
+* averages are unscaled and frequency is derived from period
+* here, so interrupt handler does not pay for it
+*/
+static void gpio_lkm_measure_get(struct gpio_lkm_dev *dev, struct gpio_lkm_measure *m)
+{
+    const u64 mhz_ns = 1000000000000ULL; /* millihertz times nanoseconds */
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    *m = dev->measure_stats;
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+    if (!m->periods)
+        return;
+
+    m->period_ns.ewma >>= GPIO_LKM_MEASURE_EWMA_SHIFT;
+    m->high_ns.ewma >>= GPIO_LKM_MEASURE_EWMA_SHIFT;
+    m->duty_ppm.ewma >>= GPIO_LKM_MEASURE_EWMA_SHIFT;
+
+    m->freq_mhz.last = div64_u64(mhz_ns, m->period_ns.last);
+    m->freq_mhz.min = div64_u64(mhz_ns, m->period_ns.max);
+    m->freq_mhz.max = div64_u64(mhz_ns, m->period_ns.min);
+    m->freq_mhz.ewma = div64_u64(mhz_ns, max_t(u64, m->period_ns.ewma, 1));
+}
+
+/*
+* gpio_lkm_measure_set - Enable or disable measurement of a pin
+* pin should be an input with edge interrupt. enabling
+* starts statistics from scratch
+*/
+static int gpio_lkm_measure_set(struct gpio_lkm_dev *dev, bool enable)
+{
+    unsigned long flags;
+    int ret = 0;
+
+    mutex_lock(&dev->dir_lock);
+
+    if (enable && dev->dir != in)
+        ret = -EPERM;
+    else if (enable && dev->irq < 0)
+        ret = -ENXIO;
+
+    if (!ret)
+    {
+        spin_lock_irqsave(&dev->pin_lock, flags);
+        if (enable)
+        {
+            memset(&dev->measure_stats, 0, sizeof(dev->measure_stats));
+            dev->measure_rise = 0;
+            dev->measure_fall = 0;
+        }
+        dev->measure = enable;
+        dev->measure_stats.enabled = enable;
+        spin_unlock_irqrestore(&dev->pin_lock, flags);
+    }
+
+    mutex_unlock(&dev->dir_lock);
+    return ret;
+}
+
+/*
+* gpio_lkm_reflex_fire - Execute action of reflex rule
+* called from interrupt handler or debounce timer with
+* gpio_lkm_reflex_lock held
+*/
+static void gpio_lkm_reflex_fire(struct gpio_lkm_reflex_rule *rule, u64 ktime_ns)
+{
+    struct gpio_lkm_dev *dst = rule->out;
+    enum state level;
+    u64 lat;
+
+    spin_lock(&dst->pin_lock);
+
+    /* output switched to input by user space is left alone */
+    if (dst->dir != out)
+    {
+        spin_unlock(&dst->pin_lock);
+        return;
+    }
+
+    switch (rule->action)
+    {
+    case GPIO_LKM_REFLEX_SET:
+        level = high;
+        break;
+    case GPIO_LKM_REFLEX_CLEAR:
+        level = low;
+        break;
+    case GPIO_LKM_REFLEX_PULSE:
+        /* edge during a pulse only makes it longer */
+        if (!rule->pulse_active)
+            rule->restore = dst->state;
+        level = rule->restore == high ? low : high;
+        break;
+    default:
+        level = dst->state == high ? low : high;
+        break;
+    }
+
+    gpiod_set_raw_value(dst->desc, level);
+    lat = ktime_get_ns() - ktime_ns;
+    dst->state = level;
+    gpio_lkm_state_update(dst);
+
+    spin_unlock(&dst->pin_lock);
+
+    if (rule->action == GPIO_LKM_REFLEX_PULSE)
+    {
+        rule->pulse_active = true;
+        hrtimer_start(&rule->pulse_timer, ns_to_ktime(rule->pulse_ns), HRTIMER_MODE_REL);
+    }
+
+    rule->lat_min = rule->hits ? min(rule->lat_min, lat) : lat;
+    rule->lat_max = max(rule->lat_max, lat);
+    rule->lat_last = lat;
+    rule->lat_sum += lat;
+    rule->hits++;
+}
+
+/*
+* gpio_lkm_reflex_run - Fire reflex rules watching an edge
+* rules run before anything else is done with the edge, so
+* output reacts without waiting for user space
+*/
+static void gpio_lkm_reflex_run(struct gpio_lkm_dev *dev, __u32 edge, u64 ktime_ns)
+{
+    struct gpio_lkm_reflex_rule *rule;
+    unsigned int i;
+
+    if (!READ_ONCE(dev->reflex))
+        return;
+
+    spin_lock(&gpio_lkm_reflex_lock);
+    for (i = 0; i < GPIO_LKM_REFLEX_MAX; i++)
+    {
+        rule = &gpio_lkm_reflex[i];
+        if (rule->used && rule->in == dev && (rule->edges & edge))
+            gpio_lkm_reflex_fire(rule, ktime_ns);
+    }
+    spin_unlock(&gpio_lkm_reflex_lock);
+}
+
+/*
+* gpio_lkm_reflex_pulse_finish - Restore output level after pulse
+*/
+static void gpio_lkm_reflex_pulse_finish(struct gpio_lkm_reflex_rule *rule)
+{
+    struct gpio_lkm_dev *dst = rule->out;
+    unsigned long flags;
+
+    spin_lock_irqsave(&gpio_lkm_reflex_lock, flags);
+    /* pulse restarted by an edge while timer was expiring
+     * is left to the restarted timer
+     */
+    if (rule->pulse_active && !hrtimer_is_queued(&rule->pulse_timer))
+    {
+        spin_lock(&dst->pin_lock);
+        if (dst->dir == out)
+        {
+            gpiod_set_raw_value(dst->desc, rule->restore);
+            dst->state = rule->restore;
+            gpio_lkm_state_update(dst);
+        }
+        spin_unlock(&dst->pin_lock);
+        rule->pulse_active = false;
+    }
+    spin_unlock_irqrestore(&gpio_lkm_reflex_lock, flags);
+}
+
+/*
+* gpio_lkm_reflex_pulse_end - Pulse timer callback of reflex rule
+*/
+static enum hrtimer_restart gpio_lkm_reflex_pulse_end(struct hrtimer *timer)
+{
+    gpio_lkm_reflex_pulse_finish(container_of(timer, struct gpio_lkm_reflex_rule, pulse_timer));
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+* gpio_lkm_filter_check - Check and adapt event filter program
+* called by BPF core after generic checks of classic program.
+* loads of packet data are turned into loads of filter data
+* structure, the same way seccomp does it for its data. all
+* other instructions which deal with packets are refused
+*/
+static int gpio_lkm_filter_check(struct sock_filter *filter, unsigned int flen)
+{
+    struct sock_filter *insn;
+    unsigned int pc;
+
+    for (pc = 0; pc < flen; pc++)
+    {
+        insn = &filter[pc];
+
+        switch (insn->code)
+        {
+        case BPF_LD | BPF_W | BPF_ABS:
+            if (insn->k >= sizeof(struct gpio_lkm_filter_data) || (insn->k & 3))
+                return -EINVAL;
+            insn->code = BPF_LDX | BPF_W | BPF_ABS;
+            continue;
+        case BPF_LD | BPF_W | BPF_LEN:
+            insn->code = BPF_LD | BPF_IMM;
+            insn->k = sizeof(struct gpio_lkm_filter_data);
+            continue;
+        case BPF_LDX | BPF_W | BPF_LEN:
+            insn->code = BPF_LDX | BPF_IMM;
+            insn->k = sizeof(struct gpio_lkm_filter_data);
+            continue;
+        case BPF_RET | BPF_K:
+        case BPF_RET | BPF_A:
+        case BPF_ALU | BPF_ADD | BPF_K:
+        case BPF_ALU | BPF_ADD | BPF_X:
+        case BPF_ALU | BPF_SUB | BPF_K:
+        case BPF_ALU | BPF_SUB | BPF_X:
+        case BPF_ALU | BPF_MUL | BPF_K:
+        case BPF_ALU | BPF_MUL | BPF_X:
+        case BPF_ALU | BPF_DIV | BPF_K:
+        case BPF_ALU | BPF_DIV | BPF_X:
+        case BPF_ALU | BPF_AND | BPF_K:
+        case BPF_ALU | BPF_AND | BPF_X:
+        case BPF_ALU | BPF_OR | BPF_K:
+        case BPF_ALU | BPF_OR | BPF_X:
+        case BPF_ALU | BPF_XOR | BPF_K:
+        case BPF_ALU | BPF_XOR | BPF_X:
+        case BPF_ALU | BPF_LSH | BPF_K:
+        case BPF_ALU | BPF_LSH | BPF_X:
+        case BPF_ALU | BPF_RSH | BPF_K:
+        case BPF_ALU | BPF_RSH | BPF_X:
+        case BPF_ALU | BPF_NEG:
+        case BPF_LD | BPF_IMM:
+        case BPF_LDX | BPF_IMM:
+        case BPF_MISC | BPF_TAX:
+        case BPF_MISC | BPF_TXA:
+        case BPF_LD | BPF_MEM:
+        case BPF_LDX | BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+        case BPF_JMP | BPF_JA:
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_X:
+            continue;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+* gpio_lkm_filter_set - Attach event filter program to open file
+* program is built before the lock is taken, old one is freed
+* after it, when handler cannot run it any more
+*/
+static int gpio_lkm_filter_set(struct gpio_lkm_file *file, const struct gpio_lkm_filter __user *arg)
+{
+    struct bpf_prog *prog = NULL, *old;
+    struct gpio_lkm_filter cfg;
+    struct sock_fprog fprog;
+    unsigned long flags;
+    int ret;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
         return -EFAULT;
+    if (cfg.len > BPF_MAXINSNS || cfg.reserved)
+        return -EINVAL;
+
+    if (cfg.len)
+    {
+        fprog.len = cfg.len;
+        fprog.filter = u64_to_user_ptr(cfg.insns);
+        if ((ret = bpf_prog_create_from_user(&prog, &fprog, gpio_lkm_filter_check, false)))
+            return ret;
+    }
+
+    spin_lock_irqsave(&file->dev->lock, flags);
+    old = file->filter;
+    file->filter = prog;
+    file->filter_accepted = 0;
+    file->filter_rejected = 0;
+    spin_unlock_irqrestore(&file->dev->lock, flags);
+
+    if (old)
+        bpf_prog_destroy(old);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_filter_gap - Time between two events for filter data
+*/
+static __u32 gpio_lkm_filter_gap(u64 from, u64 to)
+{
+    if (!from || to < from)
+        return U32_MAX;
+    return min_t(u64, to - from, U32_MAX);
+}
+
+/*
+* gpio_lkm_ring_put - Queue edge record to ring of this cpu
+* called with interrupts off, this cpu is the only producer
+*/
+static void gpio_lkm_ring_put(const struct gpio_lkm_event *event)
+{
+    struct gpio_lkm_ring *ring = this_cpu_ptr(gpio_lkm_rings);
+    bool queued = kfifo_put(&ring->events, *event);
+
+    u64_stats_update_begin(&ring->syncp);
+    if (queued)
+        ring->queued++;
+    else
+        ring->dropped++;
+    u64_stats_update_end(&ring->syncp);
+
+    /* waking nobody should not cost a lock of wait queue */
+    if (queued && wq_has_sleeper(&ring->wait))
+        wake_up_interruptible_poll(&ring->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/*
+* gpio_lkm_batch_flush - Queue pending edges to subscribed files
+* called with lock of the pin held. file subscribed to batch records
+* gets one record covering all pending edges, other files get record
+* of the latest pending edge they subscribed to, so in coalesced mode
+* they see gaps in sequence numbers
+*/
+static void gpio_lkm_batch_flush(struct gpio_lkm_dev *dev)
+{
+    struct gpio_lkm_batch *batch = &dev->batch;
+    struct gpio_lkm_event_batch rec;
+    struct gpio_lkm_filter_data data;
+    struct gpio_lkm_event event;
+    struct gpio_lkm_file *file;
+    unsigned int covered = 0, edges, last, i;
+    bool queued;
+
+    if (batch->edges[0])
+        covered |= GPIO_LKM_EDGE_RISING;
+    if (batch->edges[1])
+        covered |= GPIO_LKM_EDGE_FALLING;
+    if (!covered)
+        return;
+    last = batch->edge == GPIO_LKM_EDGE_RISING ? 0 : 1;
+
+    rec.pin = dev->pin.gpio;
+    rec.level = !last;
+    rec.rising = batch->edges[0];
+    rec.falling = batch->edges[1];
+    rec.coalesced = dev->coalesced;
+    rec.word = dev->index / 64;
+    rec.first_ns = batch->first_ns;
+    rec.last_ns = batch->last_ns[last];
+    rec.seq = batch->seq[last];
+    rec.levels = gpio_lkm_state ? READ_ONCE(gpio_lkm_state->level[rec.word]) : 0;
+
+    event.pin = dev->pin.gpio;
+    data.pin = event.pin;
+    data.gap_ns = batch->gap_ns;
+
+    /* deliver record to every open file subscribed to these edges,
+     * a full queue does not block handler, record is counted lost
+     */
+    list_for_each_entry(file, &dev->readers, node)
+    {
+        edges = file->edges & covered;
+        if (!edges)
+            continue;
+
+        i = edges == GPIO_LKM_EDGE_BOTH ? last : edges == GPIO_LKM_EDGE_FALLING;
+        event.edge = i ? GPIO_LKM_EDGE_FALLING : GPIO_LKM_EDGE_RISING;
+        event.ktime_ns = batch->last_ns[i];
+        event.seq = batch->seq[i];
+
+        /* filter drops records before they cost a copy and a wakeup */
+        if (file->filter)
+        {
+            data.edge = event.edge;
+            data.seq = (__u32)event.seq;
+            data.ktime_lo = (__u32)event.ktime_ns;
+            data.ktime_hi = (__u32)(event.ktime_ns >> 32);
+            data.idle_ns = gpio_lkm_filter_gap(file->last_accept, event.ktime_ns);
+            if (!BPF_PROG_RUN(file->filter, &data))
+            {
+                file->filter_rejected++;
+                continue;
+            }
+            file->filter_accepted++;
+        }
+        file->last_accept = event.ktime_ns;
+
+        if (file->edges & GPIO_LKM_EDGE_BATCH)
+            queued = kfifo_put(&file->batches, rec);
+        else
+            queued = kfifo_put(&file->events, event);
+
+        if (queued)
+        {
+            file->queued++;
+            wake_up_interruptible_poll(&file->wait, EPOLLIN | EPOLLRDNORM);
+        }
+        else
+        {
+            file->dropped++;
+        }
+    }
+
+    memset(batch, 0, sizeof(*batch));
+}
+
+/*
+* gpio_lkm_coalesce_check - Count edge and switch to coalesced mode
+* when rate of edges crosses threshold. called with lock of the pin held
+*/
+static void gpio_lkm_coalesce_check(struct gpio_lkm_dev *dev, u64 ktime_ns)
+{
+    /* edges are counted in fixed intervals, the first edge
+     * after a quiet time opens a new one
+     */
+    if (ktime_ns < dev->coalesce_start || ktime_ns - dev->coalesce_start >= dev->coalesce_ns)
+    {
+        dev->coalesce_start = ktime_ns;
+        dev->coalesce_count = 0;
+    }
+    if (++dev->coalesce_count < dev->coalesce_edges)
+        return;
+
+    dev->coalesced = true;
+    dev->coalesce_switches++;
+    hrtimer_start(&dev->coalesce_timer, ns_to_ktime(dev->coalesce_ns), HRTIMER_MODE_REL);
+}
+
+/*
+* gpio_lkm_coalesce_tick - End coalescing interval
+* pending edges are flushed as one record. pin goes back to edge
+* mode when interval had less than half of the threshold edges, so
+* rate near threshold does not flip mode on every interval
+*/
+static enum hrtimer_restart gpio_lkm_coalesce_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_dev *dev = container_of(timer, struct gpio_lkm_dev, coalesce_timer);
+    unsigned int edges;
+
+    spin_lock(&dev->lock);
+
+    edges = dev->batch.edges[0] + dev->batch.edges[1];
+    gpio_lkm_batch_flush(dev);
+
+    if (dev->coalesce_hz && edges * 2 >= dev->coalesce_edges)
+    {
+        hrtimer_forward_now(timer, ns_to_ktime(dev->coalesce_ns));
+        spin_unlock(&dev->lock);
+        return HRTIMER_RESTART;
+    }
+
+    dev->coalesced = false;
+    dev->coalesce_switches++;
+    dev->coalesce_start = 0;
+    dev->coalesce_count = 0;
+
+    spin_unlock(&dev->lock);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+* gpio_lkm_coalesce_stop - Leave coalesced mode at once
+* called when pin stops reporting edges, pending ones are flushed
+*/
+static void gpio_lkm_coalesce_stop(struct gpio_lkm_dev *dev)
+{
+    unsigned long flags;
+
+    hrtimer_cancel(&dev->coalesce_timer);
+
+    spin_lock_irqsave(&dev->lock, flags);
+    gpio_lkm_batch_flush(dev);
+    if (dev->coalesced)
+    {
+        dev->coalesced = false;
+        dev->coalesce_switches++;
+    }
+    dev->coalesce_start = 0;
+    dev->coalesce_count = 0;
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/*
+* gpio_lkm_coalesce_set - Change coalescing threshold and interval
+* zero rate disables coalescing, pin in coalesced mode goes
+* back to edge mode at the end of current interval
+*/
+static int gpio_lkm_coalesce_set(struct gpio_lkm_dev *dev, unsigned int hz, u64 interval_ns)
+{
+    unsigned long flags;
+    u64 edges;
+
+    if (hz > GPIO_LKM_COALESCE_MAX_HZ || interval_ns < GPIO_LKM_COALESCE_MIN_NS ||
+        interval_ns > GPIO_LKM_COALESCE_MAX_NS)
+        return -EINVAL;
+
+    /* a record per edge is never worse than a record per interval
+     * with less than two edges in it
+     */
+    edges = div_u64((u64)hz * interval_ns, NSEC_PER_SEC);
+
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->coalesce_hz = hz;
+    dev->coalesce_ns = interval_ns;
+    dev->coalesce_edges = max_t(u64, edges, 2);
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_event_deliver - Queue edge record to subscribed files
+* called from interrupt handler and debounce timer. in coalesced
+* mode edge is only added to pending batch
+*/
+static void gpio_lkm_event_deliver(struct gpio_lkm_dev *dev, __u32 edge, u64 ktime_ns)
+{
+    struct gpio_lkm_pcpu_count *count;
+    struct gpio_lkm_batch *batch = &dev->batch;
+    unsigned int i = edge == GPIO_LKM_EDGE_RISING ? 0 : 1;
+    struct gpio_lkm_event event;
+
+    gpio_lkm_reflex_run(dev, edge, ktime_ns);
+
+    /* counters of this cpu are written only here, with interrupts
+     * off, so no lock is needed and readers never stall the handler
+     */
+    count = this_cpu_ptr(dev->count);
+    u64_stats_update_begin(&count->syncp);
+    if (edge == GPIO_LKM_EDGE_RISING)
+        count->rising++;
+    else
+        count->falling++;
+    u64_stats_update_end(&count->syncp);
+
+    spin_lock(&dev->lock);
+
+    if (dev->coalesce_hz && !dev->coalesced)
+        gpio_lkm_coalesce_check(dev, ktime_ns);
+
+    if (!batch->edges[0] && !batch->edges[1])
+        batch->first_ns = ktime_ns;
+    batch->edges[i]++;
+    batch->last_ns[i] = ktime_ns;
+    batch->seq[i] = event.seq = ++dev->seq;
+    batch->edge = edge;
+    batch->gap_ns = gpio_lkm_filter_gap(dev->prev_edge, ktime_ns);
+    dev->prev_edge = ktime_ns;
+
+    /* in edge mode every edge is a batch of its own */
+    if (!dev->coalesced)
+        gpio_lkm_batch_flush(dev);
+
+    spin_unlock(&dev->lock);
+
+    /* rings get every edge, they are read by bound consumers */
+    if (atomic_read(&gpio_lkm_ring_users))
+    {
+        event.pin = dev->pin.gpio;
+        event.edge = edge;
+        event.ktime_ns = ktime_ns;
+        gpio_lkm_ring_put(&event);
+    }
+}
+
+/*
+* gpio_lkm_quad_publish - Copy decoder state to state page
+* called with decoder lock held
+*/
+static void gpio_lkm_quad_publish(struct gpio_lkm_quad_dec *q)
+{
+    struct gpio_lkm_quad_state *slot;
+
+    if (!gpio_lkm_state)
+        return;
+    slot = &gpio_lkm_state->quad[q - gpio_lkm_quad];
+
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(slot->enabled, q->a != NULL);
+    WRITE_ONCE(slot->position, q->position);
+    WRITE_ONCE(slot->velocity, q->velocity);
+    WRITE_ONCE(slot->transitions, q->transitions);
+    WRITE_ONCE(slot->errors, q->errors);
+    WRITE_ONCE(slot->ktime_ns, q->last);
+    smp_wmb();
+    WRITE_ONCE(slot->seq, slot->seq + 1);
+}
+
+/*
+* gpio_lkm_quad_state_now - Sample levels of both decoder pins
+*/
+static unsigned int gpio_lkm_quad_state_now(struct gpio_lkm_quad_dec *q)
+{
+    return (gpiod_get_raw_value(q->a->desc) ? 2 : 0) | (gpiod_get_raw_value(q->b->desc) ? 1 : 0);
+}
+
+/*
+* gpio_lkm_quad_edge - Decode transition on edge of A or B
+* both pins are sampled, so an edge whose interrupt was
+* merged with the previous one is seen as a zero step, and
+* a lost edge as illegal transition
+*/
+static void gpio_lkm_quad_edge(struct gpio_lkm_quad_dec *q, u64 ktime_ns)
+{
+    unsigned int cur;
+    s8 step;
+
+    spin_lock(&q->lock);
+
+    /* decoder may be unbound while handler was entered */
+    if (!q->a)
+    {
+        spin_unlock(&q->lock);
+        return;
+    }
+
+    cur = gpio_lkm_quad_state_now(q);
+    step = gpio_lkm_quad_table[q->prev << 2 | cur];
+    q->prev = cur;
+    if (!step)
+    {
+        spin_unlock(&q->lock);
+        return;
+    }
+
+    if (step == 2)
+    {
+        q->errors++;
+    }
+    else
+    {
+        q->position += step;
+        q->transitions++;
+    }
+    q->last = ktime_ns;
+
+    if (ktime_ns - q->win_start >= GPIO_LKM_QUAD_WINDOW_NS)
+    {
+        q->velocity = div64_s64((q->position - q->win_pos) * NSEC_PER_SEC,
+                                ktime_ns - q->win_start);
+        q->win_start = ktime_ns;
+        q->win_pos = q->position;
+    }
+
+    gpio_lkm_quad_publish(q);
+    spin_unlock(&q->lock);
+}
+
+/*
+* gpio_lkm_keypad_row - Drive row of keypad low or let it float
+* rows are dedicated to keypad, their cached direction stays
+* input, so level writes to them are refused. direction calls
+* may sleep in pinctrl, so it is called from scanner thread,
+* or from binding with scanner stopped
+*/
+static void gpio_lkm_keypad_row(struct gpio_lkm_keypad *kp, unsigned int row, bool active)
+{
+    struct gpio_desc *desc = kp->rows[row]->desc;
+
+    /* floating rows instead of high ones keep two keys of the
+     * same column from shorting driven rows together
+     */
+    if (active)
+        gpiod_direction_output_raw(desc, low);
+    else
+        gpiod_direction_input(desc);
+}
+
+/*
+* gpio_lkm_keypad_columns - Read columns of keypad
+* returns mask of columns pulled low by pressed keys
+*/
+static unsigned int gpio_lkm_keypad_columns(struct gpio_lkm_keypad *kp)
+{
+    unsigned int c, mask = 0;
+
+    for (c = 0; c < kp->ncols; c++)
+    {
+        if (!gpiod_get_raw_value(kp->cols[c]->desc))
+            mask |= BIT(c);
+    }
+
+    return mask;
+}
+
+/*
+* gpio_lkm_keypad_start - Switch idle keypad to scanning
+* masks column interrupts, as driving rows one by one makes
+* columns of pressed keys toggle, and wakes scanner thread.
+* called with keypad lock held
+*/
+static void gpio_lkm_keypad_start(struct gpio_lkm_keypad *kp)
+{
+    unsigned int i;
+
+    for (i = 0; i < kp->ncols; i++)
+        disable_irq_nosync(kp->cols[i]->irq);
+
+    kp->scanning = true;
+    kp->row = 0;
+    kp->idle = 0;
+    kp->busy = false;
+    kp->wakeups++;
+    wake_up_process(kp->thread);
+}
+
+/*
+* gpio_lkm_keypad_wake - Start scanning on edge of a column
+* called from interrupt handler of column. edges replayed
+* when interrupts are unmasked find columns high and are ignored
+*/
+static void gpio_lkm_keypad_wake(struct gpio_lkm_keypad *kp)
+{
+    spin_lock(&kp->lock);
+    if (kp->nrows && !kp->scanning && gpio_lkm_keypad_columns(kp))
+        gpio_lkm_keypad_start(kp);
+    spin_unlock(&kp->lock);
+}
+
+/*
+* gpio_lkm_keypad_key - Debounce one key with its latest sample
+* integrator counts up while key is seen down and down while it
+* is seen up. press is accepted when it reaches @debounce and
+* release when it gets back to 0, so a bounce only delays the
+* change. returns true if event was queued
+*/
+static bool gpio_lkm_keypad_key(struct gpio_lkm_keypad *kp, unsigned int row,
+                                unsigned int col, bool down, u64 ktime_ns)
+{
+    unsigned int key = row * GPIO_LKM_KEYPAD_MAX_COLS + col;
+    bool pressed = kp->pressed & BIT_ULL(key);
+    struct gpio_lkm_key_event ev;
+
+    if (down && kp->count[key] < kp->debounce)
+        kp->count[key]++;
+    else if (!down && kp->count[key])
+        kp->count[key]--;
+
+    if (kp->count[key])
+        kp->busy = true;
+
+    if (pressed ? kp->count[key] != 0 : kp->count[key] != kp->debounce)
+        return false;
+
+    kp->pressed ^= BIT_ULL(key);
+
+    ev.row = row;
+    ev.col = col;
+    ev.pressed = !pressed;
+    ev.reserved = 0;
+    ev.ktime_ns = ktime_ns;
+    if (!kfifo_put(&kp->events, ev))
+    {
+        kp->dropped++;
+        return false;
+    }
+    kp->queued++;
+    return true;
+}
+
+/*
+* gpio_lkm_keypad_tick - Scan next row of keypad
+* row driven on previous tick had whole tick to settle, its
+* columns are read now. returns true when keypad was all keys
+* up for a while and should go idle
+*/
+static bool gpio_lkm_keypad_tick(struct gpio_lkm_keypad *kp, unsigned int *row)
+{
+    u64 ktime_ns = ktime_get_ns();
+    bool queued = false, idle;
+    unsigned int c, cols;
+
+    spin_lock_irq(&kp->lock);
+
+    cols = gpio_lkm_keypad_columns(kp);
+    for (c = 0; c < kp->ncols; c++)
+        queued |= gpio_lkm_keypad_key(kp, kp->row, c, cols & BIT(c), ktime_ns);
+
+    *row = kp->row;
+    if (++kp->row == kp->nrows)
+    {
+        kp->row = 0;
+        kp->scans++;
+        kp->idle = kp->busy ? 0 : kp->idle + 1;
+        kp->busy = false;
+    }
+    idle = kp->idle >= GPIO_LKM_KEYPAD_IDLE_SCANS;
+
+    spin_unlock_irq(&kp->lock);
+
+    if (queued)
+        wake_up_interruptible(&kp->wait);
+
+    return idle;
+}
+
+/*
+* gpio_lkm_keypad_thread - Scanner of keypad
+* rows are switched in process context, as direction calls may
+* sleep. thread sleeps while keypad is idle with all rows
+* driven and is woken by column interrupt. it runs while keypad
+* is bound, rows and columns do not change meanwhile
+*/
+static int gpio_lkm_keypad_thread(void *data)
+{
+    struct gpio_lkm_keypad *kp = data;
+    unsigned int i, row, nrows = kp->nrows;
+    ktime_t next;
+
+    while (!kthread_should_stop())
+    {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!READ_ONCE(kp->scanning))
+        {
+            schedule();
+            continue;
+        }
+        __set_current_state(TASK_RUNNING);
+
+        /* only first row stays driven */
+        for (i = 1; i < nrows; i++)
+            gpio_lkm_keypad_row(kp, i, false);
+
+        next = ktime_get();
+        for (;;)
+        {
+            next = ktime_add_ns(next, kp->tick_ns);
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+            if (kthread_should_stop())
+                return 0;
+
+            if (gpio_lkm_keypad_tick(kp, &row))
+                break;
+            gpio_lkm_keypad_row(kp, row, false);
+            gpio_lkm_keypad_row(kp, row + 1 < nrows ? row + 1 : 0, true);
+        }
+
+        /* all keys up, rows are driven, so any key pulls its
+         * column low and wakes scanner by interrupt. key pressed
+         * before interrupts are back makes no edge, so columns
+         * are checked once more and scanning goes on if some is low
+         */
+        for (i = 0; i < nrows; i++)
+            gpio_lkm_keypad_row(kp, i, true);
+        spin_lock_irq(&kp->lock);
+        for (i = 0; i < kp->ncols; i++)
+            enable_irq(kp->cols[i]->irq);
+        kp->scanning = false;
+        if (gpio_lkm_keypad_columns(kp))
+            gpio_lkm_keypad_start(kp);
+        spin_unlock_irq(&kp->lock);
+    }
+
+    return 0;
+}
+
+/*
+* gpio_lkm_irq_edge - Handle edge of input pin
+* level of input pin changes without any write request, so
+* the handler samples it and refreshes the state page.
+* if debounce is enabled, interrupt is masked and the level
+* is left to debounce timer, so bounces of a mechanical
+* contact cost neither interrupts nor reader wakeups.
+* called with interrupts off
+*/
+static irqreturn_t gpio_lkm_irq_edge(struct gpio_lkm_dev *dev, int irq, u64 ktime_ns)
+{
+    struct gpio_lkm_quad_dec *quad;
+    struct gpio_lkm_keypad *keypad;
+    __u32 edge;
+
+    /* pins of quadrature decoder are dedicated to it, edges
+     * come too fast to be debounced or reported one by one
+     */
+    quad = READ_ONCE(dev->quad);
+    if (quad)
+    {
+        gpio_lkm_quad_edge(quad, ktime_ns);
+        return IRQ_HANDLED;
+    }
+
+    /* column of idle keypad, the edge only means some key was
+     * pressed. scanner finds out which one
+     */
+    keypad = READ_ONCE(dev->keypad);
+    if (keypad)
+    {
+        gpio_lkm_keypad_wake(keypad);
+        return IRQ_HANDLED;
+    }
+
+    spin_lock(&dev->pin_lock);
+    if (dev->debounce_ns && dev->dir == in)
+    {
+        disable_irq_nosync(irq);
+        dev->debounce_active = true;
+        dev->debounce_start = ktime_ns;
+        dev->debounce_last = dev->state;
+        dev->debounce_stable = 0;
+        hrtimer_start(&dev->debounce_timer, ns_to_ktime(dev->debounce_period),
+                      HRTIMER_MODE_REL);
+        spin_unlock(&dev->pin_lock);
+        return IRQ_HANDLED;
+    }
+
+    edge = gpiod_get_raw_value(dev->desc) ? GPIO_LKM_EDGE_RISING : GPIO_LKM_EDGE_FALLING;
+    /* interrupt may race with switch to output, which frees it */
+    if (dev->dir == in)
+    {
+        dev->state = edge == GPIO_LKM_EDGE_RISING ? high : low;
+        gpio_lkm_state_update(dev);
+        if (dev->measure)
+            gpio_lkm_measure_edge(dev, edge, ktime_ns);
+    }
+    spin_unlock(&dev->pin_lock);
+
+    gpio_lkm_event_deliver(dev, edge, ktime_ns);
+
+    return IRQ_HANDLED;
+}
+
+/*
+* gpio_lkm_irq_handler - Edge interrupt handler of input pins
+*/
+static irqreturn_t gpio_lkm_irq_handler(int irq, void *data)
+{
+    /* take timestamp first, before any other work */
+    u64 ktime_ns = ktime_get_ns();
+
+    return gpio_lkm_irq_edge(data, irq, ktime_ns);
+}
+
+/*
+* gpio_lkm_irq_quick - Hard interrupt handler of threaded mode
+* only takes timestamp and hands edge to worker of the bank,
+* interrupt stays masked until worker is done
+*/
+static irqreturn_t gpio_lkm_irq_quick(int irq, void *data)
+{
+    struct gpio_lkm_dev *dev = data;
+
+    dev->irq_ns = ktime_get_ns();
+    disable_irq_nosync(irq);
+    kthread_queue_work(gpio_lkm_bank_worker[dev->bank], &dev->edge_work);
+
+    return IRQ_HANDLED;
+}
+
+/*
+* gpio_lkm_irq_work - Handle edge in worker of threaded mode
+* gpio interrupts are often demultiplexed from one interrupt
+* per bank which cannot be steered per pin, so running the work
+* in a worker of the bank is the only way to spread it. edge is
+* then handled as in hard handler, with interrupts off, so locks
+* shared with timers stay the same
+*/
+static void gpio_lkm_irq_work(struct kthread_work *work)
+{
+    struct gpio_lkm_dev *dev = container_of(work, struct gpio_lkm_dev, edge_work);
+    unsigned long flags;
+
+    local_irq_save(flags);
+    gpio_lkm_irq_edge(dev, dev->irq, dev->irq_ns);
+    local_irq_restore(flags);
+
+    enable_irq(dev->irq);
+}
+
+/*
+* gpio_lkm_debounce_tick - Sample level of input being debounced
+* window ends when enough equal samples in a row are taken. new
+* level is reported with time of the edge which opened window
+*/
+static enum hrtimer_restart gpio_lkm_debounce_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_dev *dev = container_of(timer, struct gpio_lkm_dev, debounce_timer);
+    enum state level = gpiod_get_raw_value(dev->desc) ? high : low;
+    bool changed;
+    u64 start;
+
+    spin_lock(&dev->pin_lock);
+
+    if (level == dev->debounce_last)
+    {
+        dev->debounce_stable++;
+    }
+    else
+    {
+        dev->debounce_last = level;
+        dev->debounce_stable = 1;
+    }
+
+    if (dev->debounce_stable < dev->debounce_samples)
+    {
+        hrtimer_forward_now(timer, ns_to_ktime(dev->debounce_period));
+        spin_unlock(&dev->pin_lock);
+        return HRTIMER_RESTART;
+    }
+
+    /* level settled, count the window and unmask interrupt */
+    changed = level != dev->state;
+    if (changed)
+    {
+        dev->state = level;
+        dev->debounce_accepted++;
+        gpio_lkm_state_update(dev);
+        if (dev->measure)
+            gpio_lkm_measure_edge(dev, level == high ? GPIO_LKM_EDGE_RISING : GPIO_LKM_EDGE_FALLING,
+                                  dev->debounce_start);
+    }
+    else
+    {
+        dev->debounce_rejected++;
+    }
+    start = dev->debounce_start;
+    dev->debounce_active = false;
+    enable_irq(dev->irq);
+
+    spin_unlock(&dev->pin_lock);
+
+    if (changed)
+        gpio_lkm_event_deliver(dev, level == high ? GPIO_LKM_EDGE_RISING : GPIO_LKM_EDGE_FALLING,
+                               start);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+* gpio_lkm_debounce_set - Change debounce window of a pin
+* zero window disables debounce. window in progress ends
+* with the settings it was started with
+*/
+static int gpio_lkm_debounce_set(struct gpio_lkm_dev *dev, u64 window_ns, unsigned int samples)
+{
+    unsigned long flags;
+
+    if (!samples || samples > GPIO_LKM_DEBOUNCE_MAX_SAMPLES)
+        return -EINVAL;
+    if (window_ns && (window_ns > GPIO_LKM_DEBOUNCE_MAX_NS ||
+                      div_u64(window_ns, samples) < GPIO_LKM_DEBOUNCE_MIN_TICK_NS))
+        return -EINVAL;
+
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    dev->debounce_ns = window_ns;
+    dev->debounce_samples = samples;
+    dev->debounce_period = div_u64(window_ns, samples);
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_irq_request - Start tracking edges of an input pin
+* failure is not fatal, pin stays usable but its level
+* in state page is refreshed only on write requests
+*/
+static void gpio_lkm_irq_request(struct gpio_lkm_dev *dev)
+{
+    int irq, ret = 0;
+
+    /* interrupts of sleeping chips are threaded, handler below
+     * samples the pin in hard interrupt context
+     */
+    if (dev->irq >= 0 || dev->can_sleep)
+        return;
+
+    irq = gpio_to_irq(dev->pin.gpio);
+    if (irq >= 0 && threaded)
+    {
+        ret = request_irq(irq, gpio_lkm_irq_quick,
+                          IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, DEVICE_NAME, dev);
+    }
+    else if (irq >= 0)
+    {
+        ret = request_irq(irq, gpio_lkm_irq_handler,
+                          IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, DEVICE_NAME, dev);
+    }
+    if (irq < 0 || ret)
+    {
+        printk(KERN_WARNING "[GPIO_LKM] - No edge interrupt for GPIO %d\n", dev->pin.gpio);
+        return;
+    }
+
+    dev->irq = irq;
+}
+
+/*
+* gpio_lkm_readers_revoke - Drop edge subscriptions of a pin
+* events will not come any more, so sleeping readers and
+* pollers are woken to get an error instead of waiting forever
+*/
+static void gpio_lkm_readers_revoke(struct gpio_lkm_dev *dev)
+{
+    struct gpio_lkm_file *file, *tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    list_for_each_entry_safe(file, tmp, &dev->readers, node)
+    {
+        list_del_init(&file->node);
+        WRITE_ONCE(file->revoked, true);
+        wake_up_interruptible(&file->wait);
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+}
+
+/*
+* gpio_lkm_irq_release - Stop tracking edges of a pin
+*/
+static void gpio_lkm_irq_release(struct gpio_lkm_dev *dev)
+{
+    unsigned long flags;
+
+    if (dev->irq < 0)
+        return;
+
+    /* handler cannot open a new debounce window after this,
+     * the one in progress is dropped and its mask undone
+     */
+    disable_irq(dev->irq);
+    /* edge still queued to worker leaves its mask behind */
+    if (kthread_cancel_work_sync(&dev->edge_work))
+        enable_irq(dev->irq);
+    hrtimer_cancel(&dev->debounce_timer);
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    if (dev->debounce_active)
+    {
+        dev->debounce_active = false;
+        enable_irq(dev->irq);
+    }
+    /* edges will be missed until interrupt is back, so
+     * measurement should not join periods across the gap
+     */
+    dev->measure_rise = 0;
+    dev->measure_fall = 0;
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+    free_irq(dev->irq, dev);
+    dev->irq = -1;
+
+    gpio_lkm_coalesce_stop(dev);
+    gpio_lkm_readers_revoke(dev);
+}
+
+/*
+* gpio_lkm_capture_rate - Refresh average sampling rate achieved
+* by capture. called occasionally, as it needs 64 bit division
+*/
+static void gpio_lkm_capture_rate(struct gpio_lkm_capture *cap)
+{
+    u64 elapsed = cap->stats.last_ns - cap->stats.start_ns;
+
+    if (cap->stats.samples && elapsed)
+        cap->stats.achieved_hz = div64_u64(cap->stats.samples * NSEC_PER_SEC, elapsed);
+}
+
+/*
+* gpio_lkm_capture_used - Samples in ring not consumed yet
+* tail comes from user space, it may be anything. a value which
+* is not within the ring counts as full ring
+*/
+static __u32 gpio_lkm_capture_used(struct gpio_lkm_capture *cap, __u32 head)
+{
+    __u32 used = head - READ_ONCE(cap->ring->tail);
+
+    return min(used, cap->nsamples);
+}
+
+/*
+* gpio_lkm_wave_tick - Step timer callback of waveform playback
+* applies the next step to all pins with one array call and
+* schedules the following one relative to the planned time of
+* this step, so timer latency does not accumulate over cycles
+*/
+static enum hrtimer_restart gpio_lkm_wave_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_wave *wave = container_of(timer, struct gpio_lkm_wave, timer);
+    struct gpio_lkm_wave_kstep *step = &wave->steps[wave->pos];
+    ktime_t now = ktime_get();
+    s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    u64 period;
+    unsigned int i;
+
+    spin_lock(&wave->stats_lock);
+
+    if (wave->pos == 0)
+    {
+        /* cycle boundary: measure the cycle which just ended */
+        if (wave->applied)
+        {
+            period = ktime_to_ns(ktime_sub(now, wave->cycle_start));
+            wave->period_min = min(wave->period_min, period);
+            wave->period_max = max(wave->period_max, period);
+            wave->period_sum += period;
+            wave->cycles++;
+        }
+        wave->cycle_start = now;
+
+        if (wave->repeat && wave->cycles == wave->repeat)
+        {
+            wave->running = false;
+            spin_unlock(&wave->stats_lock);
+            return HRTIMER_NORESTART;
+        }
+    }
+
+    wave->late_min = min(wave->late_min, late);
+    wave->late_max = max(wave->late_max, late);
+    wave->late_sum += late;
+    wave->applied++;
+
+    spin_unlock(&wave->stats_lock);
+
+    gpiod_set_raw_array_value(wave->npins, wave->descs, NULL, step->bits);
+    for (i = 0; i < wave->npins; i++)
+        gpio_lkm_pin_level(wave->pins[i], test_bit(i, step->bits) ? high : low);
+
+    wave->pos = wave->pos + 1 < wave->nsteps ? wave->pos + 1 : 0;
+    hrtimer_add_expires_ns(timer, step->delta_ns);
+
+    return HRTIMER_RESTART;
+}
+
+/*
+* gpio_lkm_wave_stop - Stop playback and release pattern
+* should be called with wave->lock held
+*/
+static void gpio_lkm_wave_stop(struct gpio_lkm_wave *wave)
+{
+    unsigned int i;
+
+    hrtimer_cancel(&wave->timer);
+    wave->running = false;
+
+    /* pins may be driven by other waveforms now */
+    mutex_lock(&gpio_lkm_waves_lock);
+    for (i = 0; i < wave->npins; i++)
+    {
+        if (wave->pins[i]->wave_owner == wave)
+            wave->pins[i]->wave_owner = NULL;
+    }
+    mutex_unlock(&gpio_lkm_waves_lock);
+    wave->npins = 0;
+
+    kfree(wave->steps);
+    kfree(wave->descs);
+    kfree(wave->pins);
+    wave->steps = NULL;
+    wave->descs = NULL;
+    wave->pins = NULL;
+}
+
+/*
+* gpio_lkm_wave_load - Convert user pattern to prepared steps
+* PWM periods become two steps each: high for duty time and
+* low for the rest. returns number of steps or error
+*/
+static int gpio_lkm_wave_load(struct gpio_lkm_wave *wave, struct gpio_lkm_wave_config *cfg,
+                              unsigned int npins)
+{
+    struct gpio_lkm_wave_step step;
+    struct gpio_lkm_wave_pwm pwm;
+    struct gpio_lkm_wave_kstep *steps;
+    void __user *data = u64_to_user_ptr(cfg->data);
+    u64 all = npins < 64 ? (1ULL << npins) - 1 : ~0ULL;
+    unsigned int i, n = 0;
+    u64 period = 0;
+
+    if (!cfg->count || cfg->reserved)
+        return -EINVAL;
+
+    if (cfg->type == GPIO_LKM_WAVE_STEPS && cfg->count > GPIO_LKM_WAVE_MAX_STEPS)
+        return -E2BIG;
+    if (cfg->type == GPIO_LKM_WAVE_PWM && cfg->count > GPIO_LKM_WAVE_MAX_STEPS / 2)
+        return -E2BIG;
+    if (cfg->type != GPIO_LKM_WAVE_STEPS && cfg->type != GPIO_LKM_WAVE_PWM)
+        return -EINVAL;
+
+    steps = kcalloc(cfg->type == GPIO_LKM_WAVE_PWM ? cfg->count * 2 : cfg->count,
+                    sizeof(*steps), GFP_KERNEL);
+    if (!steps)
+        return -ENOMEM;
+
+    for (i = 0; i < cfg->count; i++)
+    {
+        if (cfg->type == GPIO_LKM_WAVE_STEPS)
+        {
+            if (copy_from_user(&step, data + i * sizeof(step), sizeof(step)))
+                goto fault;
+            if (step.delta_ns < GPIO_LKM_WAVE_MIN_STEP_NS)
+                goto inval;
+
+            steps[n].delta_ns = step.delta_ns;
+            bitmap_from_u64(steps[n].bits, step.bits & all);
+            period += step.delta_ns;
+            n++;
+            continue;
+        }
+
+        if (copy_from_user(&pwm, data + i * sizeof(pwm), sizeof(pwm)))
+            goto fault;
+        if (pwm.duty_ns > pwm.period_ns || pwm.period_ns < GPIO_LKM_WAVE_MIN_STEP_NS)
+            goto inval;
+
+        /* 0% and 100% duty cycle need only one step, otherwise
+         * both parts should be long enough for the timer */
+        if (pwm.duty_ns == 0 || pwm.duty_ns == pwm.period_ns)
+        {
+            steps[n].delta_ns = pwm.period_ns;
+            bitmap_from_u64(steps[n].bits, pwm.duty_ns ? all : 0);
+            n++;
+        }
+        else
+        {
+            if (pwm.duty_ns < GPIO_LKM_WAVE_MIN_STEP_NS ||
+                pwm.period_ns - pwm.duty_ns < GPIO_LKM_WAVE_MIN_STEP_NS)
+                goto inval;
+
+            steps[n].delta_ns = pwm.duty_ns;
+            bitmap_from_u64(steps[n].bits, all);
+            steps[n + 1].delta_ns = pwm.period_ns - pwm.duty_ns;
+            bitmap_from_u64(steps[n + 1].bits, 0);
+            n += 2;
+        }
+        period += pwm.period_ns;
+    }
+
+    wave->steps = steps;
+    wave->nsteps = n;
+    wave->period_ns = period;
+    return n;
+
+fault:
+    kfree(steps);
+    return -EFAULT;
+inval:
+    kfree(steps);
+    return -EINVAL;
+}
+
+/*
+* gpio_lkm_wave_start - Start playback of user pattern on pins
+* pins and descriptors are copied, so playback is not affected
+* if bus is reconfigured while it runs
+*/
+static int gpio_lkm_wave_start(struct gpio_lkm_wave *wave, void __user *arg,
+                               unsigned int npins, struct gpio_desc **descs,
+                               struct gpio_lkm_dev **pins)
+{
+    struct gpio_lkm_wave_config cfg;
+    unsigned int i;
+    int ret;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+
+    if (!npins)
+        return -ENXIO;
+
+    for (i = 0; i < npins; i++)
+    {
+        if (READ_ONCE(pins[i]->dir) == in)
+            return -EPERM;
+        /* steps are applied from timer */
+        if (pins[i]->can_sleep)
+            return -EOPNOTSUPP;
+    }
+
+    gpio_lkm_wave_stop(wave);
+
+    wave->descs = kmemdup(descs, npins * sizeof(*descs), GFP_KERNEL);
+    wave->pins = kmemdup(pins, npins * sizeof(*pins), GFP_KERNEL);
+    if (!wave->descs || !wave->pins)
+    {
+        gpio_lkm_wave_stop(wave);
+        return -ENOMEM;
+    }
+    wave->npins = npins;
+
+    ret = gpio_lkm_wave_load(wave, &cfg, npins);
+    if (ret < 0)
+    {
+        gpio_lkm_wave_stop(wave);
+        return ret;
+    }
+
+    wave->pos = 0;
+    wave->repeat = cfg.repeat;
+    wave->cycles = 0;
+    wave->applied = 0;
+    wave->period_min = U64_MAX;
+    wave->period_max = 0;
+    wave->period_sum = 0;
+    wave->late_min = S64_MAX;
+    wave->late_max = 0;
+    wave->late_sum = 0;
+
+    /* take pins over only if no other running waveform drives
+     * them. direction is checked again, as set_in stops owner
+     * of pin after it switched direction
+     */
+    ret = 0;
+    mutex_lock(&gpio_lkm_waves_lock);
+    for (i = 0; i < npins; i++)
+    {
+        struct gpio_lkm_wave *owner = pins[i]->wave_owner;
+
+        if (READ_ONCE(pins[i]->dir) == in)
+            ret = -EPERM;
+        else if (owner && owner != wave && owner->running)
+            ret = -EBUSY;
+        if (ret)
+        {
+            mutex_unlock(&gpio_lkm_waves_lock);
+            gpio_lkm_wave_stop(wave);
+            return ret;
+        }
+    }
+    for (i = 0; i < npins; i++)
+        pins[i]->wave_owner = wave;
+    wave->running = true;
+
+    /* first step is applied right away */
+    hrtimer_start(&wave->timer, ktime_get(), HRTIMER_MODE_ABS);
+    mutex_unlock(&gpio_lkm_waves_lock);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_wave_release - Stop waveforms driving a pin
+* own waveform of the pin and waveform of a bus the pin is
+* driven by. should be called with dir_lock of the pin held
+*/
+static void gpio_lkm_wave_release(struct gpio_lkm_dev *dev)
+{
+    struct gpio_lkm_wave *owner;
+
+    mutex_lock(&dev->wave.lock);
+    gpio_lkm_wave_stop(&dev->wave);
+    mutex_unlock(&dev->wave.lock);
+
+    mutex_lock(&gpio_lkm_waves_lock);
+    owner = dev->wave_owner;
+    mutex_unlock(&gpio_lkm_waves_lock);
+    if (!owner)
+        return;
+
+    /* owner is cleared only by stop under lock of the waveform */
+    mutex_lock(&owner->lock);
+    if (READ_ONCE(dev->wave_owner) == owner)
+        gpio_lkm_wave_stop(owner);
+    mutex_unlock(&owner->lock);
+}
+
+/*
+* gpio_lkm_wave_driven - Pin is driven by a running waveform
+*/
+static bool gpio_lkm_wave_driven(struct gpio_lkm_dev *dev)
+{
+    struct gpio_lkm_wave *owner;
+    bool ret;
+
+    mutex_lock(&gpio_lkm_waves_lock);
+    owner = dev->wave_owner;
+    ret = owner && READ_ONCE(owner->running);
+    mutex_unlock(&gpio_lkm_waves_lock);
+
+    return ret;
+}
+
+/*
+* gpio_lkm_wave_get_stats - Fill statistics of playback for user
+*/
+static int gpio_lkm_wave_get_stats(struct gpio_lkm_wave *wave, void __user *arg)
+{
+    struct gpio_lkm_wave_stats stats;
+    unsigned long flags;
+
+    memset(&stats, 0, sizeof(stats));
+
+    spin_lock_irqsave(&wave->stats_lock, flags);
+    stats.cycles = wave->cycles;
+    stats.steps = wave->applied;
+    stats.period_ns = wave->period_ns;
+    stats.running = wave->running;
+    if (wave->cycles)
+    {
+        stats.period_min_ns = wave->period_min;
+        stats.period_max_ns = wave->period_max;
+        stats.period_mean_ns = div64_u64(wave->period_sum, wave->cycles);
+    }
+    if (wave->applied)
+    {
+        stats.jitter_min_ns = wave->late_min;
+        stats.jitter_max_ns = wave->late_max;
+        stats.jitter_mean_ns = div64_s64(wave->late_sum, wave->applied);
+    }
+    spin_unlock_irqrestore(&wave->stats_lock, flags);
+
+    if (copy_to_user(arg, &stats, sizeof(stats)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_wave_ioctl - Handle waveform requests of pin or bus device
+* returns -ENOTTY for requests not related to waveforms
+*/
+static long gpio_lkm_wave_ioctl(struct gpio_lkm_wave *wave, unsigned int cmd, unsigned long arg,
+                                unsigned int npins, struct gpio_desc **descs,
+                                struct gpio_lkm_dev **pins)
+{
+    long ret;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_WAVE_START:
+        mutex_lock(&wave->lock);
+        ret = gpio_lkm_wave_start(wave, (void __user *)arg, npins, descs, pins);
+        mutex_unlock(&wave->lock);
+        return ret;
+
+    case GPIO_LKM_IOC_WAVE_STOP:
+        mutex_lock(&wave->lock);
+        gpio_lkm_wave_stop(wave);
+        mutex_unlock(&wave->lock);
+        return 0;
+
+    case GPIO_LKM_IOC_WAVE_STATS:
+        return gpio_lkm_wave_get_stats(wave, (void __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+* gpio_lkm_wave_init - Prepare idle playback engine
+*/
+static void gpio_lkm_wave_init(struct gpio_lkm_wave *wave)
+{
+    memset(wave, 0, sizeof(*wave));
+    mutex_init(&wave->lock);
+    spin_lock_init(&wave->stats_lock);
+    hrtimer_init(&wave->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    wave->timer.function = gpio_lkm_wave_tick;
+}
+
+/* comprehensive reading about read/write/open/release char device methods
+*  https://www.oreilly.com/library/view/linux-device-drivers/0596005903/ch03.html
+*/
+
+/*
+* gpio_lkm_pin_request - Request pin from gpio subsystem
+* pin is switched to output with low level. called at load, or
+* on first use in lazy mode with direction lock held
+*/
+static int gpio_lkm_pin_request(struct gpio_lkm_dev *dev)
+{
+    unsigned int gpio = dev->pin.gpio;
+    unsigned long flags;
+    int ret;
+
+    /* call kernel gpio API to request one gpio, pass config flags
+     * here gpio requested will support In Out directions and initialized
+     * with low level
+     */
+    if ((ret = gpio_request_one(gpio, GPIOF_OUT_INIT_LOW, NULL)) < 0)
+    {
+        printk(KERN_ALERT "[GPIO_LKM] - Error requesting GPIO %u\n", gpio);
+        return ret;
+    }
+
+    /* descriptor is looked up once, hot paths use it directly
+     */
+    dev->desc = gpio_to_desc(gpio);
+    dev->can_sleep = gpiod_cansleep(dev->desc);
+    dev->bank = min_t(unsigned int, (gpio - gpiod_to_chip(dev->desc)->base) / GPIO_LKM_BANK_PINS,
+                      GPIO_LKM_BANK_NUM - 1);
+    if (dev->can_sleep && (ret = gpio_lkm_chip_get(dev)))
+    {
+        gpio_free(gpio);
+        return ret;
+    }
+
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    dev->dir = out;
+    dev->state = low;
+    gpio_lkm_state_update(dev);
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+    /* lockless users check the flag before descriptor */
+    smp_store_release(&dev->requested, true);
+    return 0;
+}
+
+/*
+* gpio_lkm_pin_free - Give pin back to gpio subsystem
+* pin is left as output with low level. called with direction
+* lock held, or at unload
+*/
+static void gpio_lkm_pin_free(struct gpio_lkm_dev *dev)
+{
+    unsigned long flags;
+
+    if (!dev->requested)
+        return;
+
+    /* stop edge interrupts of input pin and waveform,
+     * they refer to device structure
+     */
+    gpio_lkm_irq_release(dev);
+    gpio_lkm_wave_release(dev);
+
+    /* set default value on used gpio pin, after writes
+     * still queued to sleeping chip
+     */
+    gpio_lkm_chip_put(dev);
+    gpiod_direction_output_raw(dev->desc, low);
+    gpio_free(dev->pin.gpio);
+
+    WRITE_ONCE(dev->requested, false);
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    dev->dir = out;
+    dev->state = low;
+    gpio_lkm_state_update(dev);
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+}
+
+/*
+* gpio_lkm_pin_acquire - Make sure pin is requested before use
+* @sticky: keep pin requested until unload. pins used by control
+*   device, buses and bindings are sticky, pins used only through
+*   their own device are given back some time after it is closed
+*/
+static int gpio_lkm_pin_acquire(struct gpio_lkm_dev *dev, bool sticky)
+{
+    int ret = 0;
+
+    if (smp_load_acquire(&dev->requested) && (!sticky || READ_ONCE(dev->sticky)))
+        return 0;
+
+    mutex_lock(&dev->dir_lock);
+    if (!dev->requested)
+        ret = gpio_lkm_pin_request(dev);
+    if (!ret && sticky)
+        dev->sticky = true;
+    mutex_unlock(&dev->dir_lock);
+
+    return ret;
+}
+
+/*
+* gpio_lkm_use_pin - Find pin for a request which is going to use it
+* pin is requested first, if lazy mode left it free. returns NULL
+* if GPIO is not managed by this driver or cannot be requested
+*/
+static struct gpio_lkm_dev *gpio_lkm_use_pin(unsigned int gpio)
+{
+    struct gpio_lkm_dev *dev = gpio_lkm_find_pin(gpio);
+
+    if (!dev || gpio_lkm_pin_acquire(dev, true))
+        return NULL;
+
+    return dev;
+}
+
+/*
+* gpio_lkm_bind_pin - Find pin for a binding which is going to use it
+* pin is requested, if lazy mode left it free, but it is kept only
+* once binding is set up, see gpio_lkm_bind_done
+*/
+static struct gpio_lkm_dev *gpio_lkm_bind_pin(unsigned int gpio)
+{
+    struct gpio_lkm_dev *dev = gpio_lkm_find_pin(gpio);
+
+    if (!dev || gpio_lkm_pin_acquire(dev, false))
+        return NULL;
+
+    return dev;
+}
+
+/*
+* gpio_lkm_bind_done - Keep pins of binding or give them back
+* pins of binding which is set up stay requested until unload.
+* if binding failed, pins requested only for it are released
+* after idle timeout, as pins of closed devices are
+* @ret: result of binding, pins are kept if it is 0
+*/
+static void gpio_lkm_bind_done(struct gpio_lkm_dev **pins, unsigned int npins, int ret)
+{
+    unsigned int i;
+
+    for (i = 0; i < npins; i++)
+    {
+        if (!pins[i])
+            continue;
+        mutex_lock(&pins[i]->dir_lock);
+        if (!ret)
+            pins[i]->sticky = true;
+        else if (!pins[i]->users && !pins[i]->sticky && lazy_idle)
+            schedule_delayed_work(&pins[i]->idle_work, (unsigned long)lazy_idle * HZ);
+        mutex_unlock(&pins[i]->dir_lock);
+    }
+}
+
+/*
+* gpio_lkm_pin_idle - Release lazy pin nobody uses
+* waveform started from pin device or bus plays on after it is
+* closed, such pin is kept
+*/
+static void gpio_lkm_pin_idle(struct work_struct *work)
+{
+    struct gpio_lkm_dev *dev = container_of(to_delayed_work(work), struct gpio_lkm_dev, idle_work);
+
+    mutex_lock(&dev->dir_lock);
+    if (!dev->users && !dev->sticky && !gpio_lkm_wave_driven(dev))
+    {
+        gpio_lkm_pin_free(dev);
+        pr_debug("[GPIO_LKM] - GPIO %u released after idle timeout\n", dev->pin.gpio);
+    }
+    mutex_unlock(&dev->dir_lock);
+}
+
+/*
+* gpio_lkm_open - Open GPIO device
+* this is implementation of previously declared function
+* open from our file_operations structure.
+* this function will be called each time device recives
+* open file operation applied to its name in /dev
+* open method call creates struct file instance
+*/
+static int gpio_lkm_open (struct inode *inode, struct file *filp)
+{
+    struct gpio_lkm_dev *gpio_lkm_devp;
+    struct gpio_lkm_file *file;
+    int ret;
+
+    /* this macro basically tells kernel to match name cdev
+     * of type struct gpio_lkm_dev to where first argument points to
+     * see struct inode definition in fs.h line 679 and more 
+     * info about macro here
+     * https://radek.io/2012/11/10/magical-container_of-macro/
+     *  */
+    gpio_lkm_devp = container_of(inode->i_cdev, struct gpio_lkm_dev, cdev);
+    /* print pin number to system journal */
+    printk(KERN_INFO "[GPIO-LKM] - GPIO[%d] opened\n", gpio_lkm_devp->pin.gpio);
+
+    /* each open file gets its own data, as several processes
+     * may wait for events of the same pin independently */
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    /* in lazy mode first open requests the pin. open file keeps
+     * it requested, idle timer cannot take it away meanwhile
+     */
+    mutex_lock(&gpio_lkm_devp->dir_lock);
+    ret = gpio_lkm_devp->requested ? 0 : gpio_lkm_pin_request(gpio_lkm_devp);
+    if (!ret)
+        gpio_lkm_devp->users++;
+    mutex_unlock(&gpio_lkm_devp->dir_lock);
+    if (ret)
+    {
+        kfree(file);
+        return ret;
+    }
+    cancel_delayed_work(&gpio_lkm_devp->idle_work);
+
+    file->dev = gpio_lkm_devp;
+    INIT_LIST_HEAD(&file->node);
+    init_waitqueue_head(&file->wait);
+    mutex_init(&file->read_lock);
+
+    /* assign a pointer to struct representing our 
+     * open file to its corresponding file object */
+    filp->private_data = file;
+    
+    /* zero returns stand for success in kernel programming */
+    return 0;
+}
+
+/*
+* gpio_lkm_release - Release GPIO device
+* this function is called whenever kernel tries to remove driver
+* module from system. here all 
+*/
+static int gpio_lkm_release (struct inode *inode, struct file *filp)
+{
+    struct gpio_lkm_file *file = filp->private_data;
+    unsigned int gpio = file->dev->pin.gpio;
+    unsigned long flags;
+
+    /* stop receiving events before queue is freed */
+    spin_lock_irqsave(&file->dev->lock, flags);
+    list_del(&file->node);
+    spin_unlock_irqrestore(&file->dev->lock, flags);
+
+    if (file->filter)
+        bpf_prog_destroy(file->filter);
+    kfifo_free(&file->events);
+    kfifo_free(&file->batches);
+
+    /* lazy pin is given back if nobody opens it for a while */
+    mutex_lock(&file->dev->dir_lock);
+    if (!--file->dev->users && !file->dev->sticky && lazy_idle)
+        schedule_delayed_work(&file->dev->idle_work, (unsigned long)lazy_idle * HZ);
+    mutex_unlock(&file->dev->dir_lock);
+
+    kfree(file);
+
+    /* remove pointer our device data, that was assigned in open 
+     * if any resources was allocated they should be dealocated
+     * here before return
+    */
+    filp->private_data = NULL;
+    /* print debug message to system journal - good practice */
+    printk(KERN_INFO "[GPIO-LKM] - Closing GPIO %d\n", gpio);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_fsync - Wait until writes reach the pin
+* writes to pins of sleeping chips return before they are on
+* the bus, fsync() waits for them. others are done already
+*/
+static int gpio_lkm_fsync (struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct gpio_lkm_file *file = filp->private_data;
+
+    gpio_lkm_chip_flush(file->dev);
+    return 0;
+}
+
+/*
+* gpio_lkm_events_empty - Queue of records file reads from is empty
+*/
+static bool gpio_lkm_events_empty(struct gpio_lkm_file *file)
+{
+    if (READ_ONCE(file->edges) & GPIO_LKM_EDGE_BATCH)
+        return kfifo_is_empty(&file->batches);
+    return kfifo_is_empty(&file->events);
+}
+
+/*
+* gpio_lkm_read_events - Read edge event records
+* only whole records are returned. reader sleeps until at
+* least one record is available, unless file is non-blocking.
+* once pin stops tracking edges, records left are returned
+* and then -EPERM, until file subscribes again
+*/
+static ssize_t gpio_lkm_read_events(struct gpio_lkm_file *file, struct file *filp,
+                                    char __user *buf, size_t count)
+{
+    unsigned int copied;
+    bool batch;
+    int ret;
+
+    if (mutex_lock_interruptible(&file->read_lock))
+        return -ERESTARTSYS;
+
+    while (gpio_lkm_events_empty(file))
+    {
+        mutex_unlock(&file->read_lock);
+
+        if (READ_ONCE(file->revoked))
+            return -EPERM;
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(file->wait, !gpio_lkm_events_empty(file) ||
+                                     READ_ONCE(file->revoked)))
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&file->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    /* format is changed under read lock, so it holds until copy ends */
+    batch = file->edges & GPIO_LKM_EDGE_BATCH;
+    if (count < (batch ? sizeof(struct gpio_lkm_event_batch) : sizeof(struct gpio_lkm_event)))
+    {
+        mutex_unlock(&file->read_lock);
+        return -EINVAL;
+    }
+
+    /* kfifo of records copies whole elements only */
+    if (batch)
+        ret = kfifo_to_user(&file->batches, buf, count, &copied);
+    else
+        ret = kfifo_to_user(&file->events, buf, count, &copied);
+    mutex_unlock(&file->read_lock);
+
+    return ret ? ret : copied;
+}
+
+/*
+* gpio_lkm_poll - Poll method implementation for GPIO device
+* file subscribed to edges is readable when it has queued
+* events, otherwise device is always ready as before
+*/
+static __poll_t gpio_lkm_poll (struct file *filp, poll_table *wait)
+{
+    struct gpio_lkm_file *file = filp->private_data;
+
+    if (!file->edges)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &file->wait, wait);
+
+    if (!gpio_lkm_events_empty(file))
+        return EPOLLIN | EPOLLRDNORM;
+
+    /* read would fail at once, do not let poller sleep */
+    if (READ_ONCE(file->revoked))
+        return EPOLLERR;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_set_edge - Subscribe open file to edges of input pin
+* queue is allocated on first subscription, so files used
+* only for text commands do not waste memory on it. records
+* queued in format the file switches from are dropped
+*/
+static int gpio_lkm_set_edge(struct gpio_lkm_file *file, unsigned int edges)
+{
+    struct gpio_lkm_dev *dev = file->dev;
+    unsigned long flags;
+    bool batch;
+    int ret;
+
+    if (edges & ~(GPIO_LKM_EDGE_BOTH | GPIO_LKM_EDGE_BATCH))
+        return -EINVAL;
+    /* format alone selects no edges */
+    if (edges == GPIO_LKM_EDGE_BATCH)
+        return -EINVAL;
+    batch = edges & GPIO_LKM_EDGE_BATCH;
+
+    if (edges && READ_ONCE(dev->dir) != in)
+        return -EPERM;
+
+    /* pin has no edge interrupt, events would never come */
+    if (edges && dev->irq < 0)
+        return -ENXIO;
+
+    mutex_lock(&file->read_lock);
+
+    if (edges && !batch && !kfifo_initialized(&file->events))
+    {
+        ret = kfifo_alloc(&file->events, event_fifo, GFP_KERNEL);
+        if (ret)
+        {
+            mutex_unlock(&file->read_lock);
+            return ret;
+        }
+    }
+    if (batch && !kfifo_initialized(&file->batches))
+    {
+        ret = kfifo_alloc(&file->batches, event_fifo, GFP_KERNEL);
+        if (ret)
+        {
+            mutex_unlock(&file->read_lock);
+            return ret;
+        }
+    }
+
+    spin_lock_irqsave(&dev->lock, flags);
+    /* pin may have become output since the check above, its
+     * readers are revoked under this lock after irq is cleared
+     */
+    if (edges && READ_ONCE(dev->irq) < 0)
+    {
+        spin_unlock_irqrestore(&dev->lock, flags);
+        mutex_unlock(&file->read_lock);
+        return -EPERM;
+    }
+    file->edges = edges;
+    file->revoked = false;
+    if (edges && list_empty(&file->node))
+        list_add_tail(&file->node, &dev->readers);
+    else if (!edges)
+        list_del_init(&file->node);
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    /* handler does not fill the other queue any more */
+    if (batch && kfifo_initialized(&file->events))
+        kfifo_reset_out(&file->events);
+    else if (!batch && kfifo_initialized(&file->batches))
+        kfifo_reset_out(&file->batches);
+
+    mutex_unlock(&file->read_lock);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_ioctl - Ioctl method implementation for GPIO device
+* used for requests which do not fit text command protocol
+*/
+static long gpio_lkm_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_lkm_file *file = filp->private_data;
+    struct gpio_lkm_event_stats stats;
+    struct gpio_lkm_measure measure;
+    unsigned long flags;
+    __u32 edges, mode, enable;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_SET_EDGE:
+        if (get_user(edges, (__u32 __user *)arg))
+            return -EFAULT;
+        return gpio_lkm_set_edge(file, edges);
+
+    case GPIO_LKM_IOC_GET_EVENT_STATS:
+        spin_lock_irqsave(&file->dev->lock, flags);
+        stats.queued = file->queued;
+        stats.dropped = file->dropped;
+        stats.filter_accepted = file->filter_accepted;
+        stats.filter_rejected = file->filter_rejected;
+        spin_unlock_irqrestore(&file->dev->lock, flags);
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+
+    case GPIO_LKM_IOC_SET_FILTER:
+        return gpio_lkm_filter_set(file, (const struct gpio_lkm_filter __user *)arg);
+
+    case GPIO_LKM_IOC_SET_MODE:
+        if (get_user(mode, (__u32 __user *)arg))
+            return -EFAULT;
+        if (mode != GPIO_LKM_MODE_TEXT && mode != GPIO_LKM_MODE_BINARY)
+            return -EINVAL;
+        file->mode = mode;
+        return 0;
+
+    case GPIO_LKM_IOC_SET_MEASURE:
+        if (get_user(enable, (__u32 __user *)arg))
+            return -EFAULT;
+        return gpio_lkm_measure_set(file->dev, enable);
+
+    case GPIO_LKM_IOC_GET_MEASURE:
+        gpio_lkm_measure_get(file->dev, &measure);
+        if (copy_to_user((void __user *)arg, &measure, sizeof(measure)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        /* waveform of a single pin */
+        return gpio_lkm_wave_ioctl(&file->dev->wave, cmd, arg, 1, &file->dev->desc, &file->dev);
+    }
+}
+
+/*
+* gpio_lkm_read - Read method implementation for GPIO device
+* this method will be called whenever read command is applied
+* to our device in /dev. data that should be provided to user
+* space 
+*/
+static ssize_t gpio_lkm_read ( struct file *filp, char *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_file *file = filp->private_data;
+    struct gpio_lkm_dev *dev;
+    ssize_t retval;
+    char byte;
+
+    /* file subscribed to edges gets event records instead of levels */
+    if (file->edges)
+        return gpio_lkm_read_events(file, filp, buf, count);
+
+    /* determine which pin is read from file data. each pin
+     * is effectively separate device using same driver
+     */
+    dev = file->dev;
+
+    /* get count amount of values from GPIO device */
+    for (retval = 0; retval < count; ++retval)
+    {
+        /* use kernel gpio API functions to get
+         * value of gpio by its descriptor
+         */
+        byte = '0' + gpio_lkm_pin_get(dev);
+
+        /* use special macro to copy data from kernel space
+         * co user space. API related to user space
+         * interactions are found in arm/asm/uaccess.h
+         */
+        if(put_user(byte, buf+retval))
+            break;
+    }
+    
+    return retval;
+}
+
+/*
+* gpio_lkm_lat_record - Account latency of one write request
+* called with interrupts disabled, so per cpu data is stable
+*/
+static void gpio_lkm_lat_record(u64 ns)
+{
+    struct gpio_lkm_lat_hist *hist = this_cpu_ptr(&gpio_lkm_lat);
+    unsigned int bucket = ns ? fls64(ns) - 1 : 0;
+
+    hist->count++;
+    hist->sum_ns += ns;
+    hist->max_ns = max(hist->max_ns, ns);
+    hist->buckets[min_t(unsigned int, bucket, GPIO_LKM_LAT_BUCKETS - 1)]++;
+}
+
+/*
+* gpio_lkm_command - Execute one command on a GPIO pin
+* shared by text and binary protocols. it is called for
+* every toggle, so only ratelimited debug output is allowed
+* here, otherwise kernel log becomes the bottleneck
+* @start: time write request entered driver, 0 if latency
+*   of this command should not be measured
+*/
+static int gpio_lkm_command(struct gpio_lkm_dev *gpio_lkm_devp, unsigned int command, u64 start)
+{
+    unsigned int gpio = gpio_lkm_devp->pin.gpio;
+    struct gpio_desc *desc = gpio_lkm_devp->desc;
+    unsigned long flags;
+    enum state level;
+    int ret = 0;
+
+    /* perform a switch on recieved command value
+     * to determine, what request is received
+     */
+    switch(command)
+    {
+    case set_in:
+    {
+        mutex_lock(&gpio_lkm_devp->dir_lock);
+        if (gpio_lkm_devp->dir != in)
+        {
+            pr_debug_ratelimited("[GPIO_LKM] - Set GPIO%d direction: input\n", gpio);
+            /* refuse new writes first, then stop waveforms
+             * driving the pin. waveform of a bus the pin is in
+             * is stopped as a whole, and cannot start again
+             * on the pin once it is an input
+             */
+            spin_lock_irqsave(&gpio_lkm_devp->pin_lock, flags);
+            gpio_lkm_devp->dir = in;
+            spin_unlock_irqrestore(&gpio_lkm_devp->pin_lock, flags);
+            gpio_lkm_wave_release(gpio_lkm_devp);
+            /* let queued writes reach sleeping chip before it
+             * stops driving
+             */
+            if (gpio_lkm_devp->can_sleep)
+                gpio_lkm_chip_flush(gpio_lkm_devp);
+
+            /* direction calls may sleep in pinctrl, so they are
+             * serialized by dir_lock only. pin_lock just publishes
+             * the result, writers are refused meanwhile
+             */
+            ret = gpiod_direction_input(desc);
+            spin_lock_irqsave(&gpio_lkm_devp->pin_lock, flags);
+            if (ret)
+                gpio_lkm_devp->dir = out;
+            spin_unlock_irqrestore(&gpio_lkm_devp->pin_lock, flags);
+            if (ret)
+            {
+                pr_debug_ratelimited("[GPIO_LKM] - Cannot set GPIO%d direction: input\n", gpio);
+                mutex_unlock(&gpio_lkm_devp->dir_lock);
+                break;
+            }
+
+            level = gpiod_get_raw_value_cansleep(desc) ? high : low;
+            spin_lock_irqsave(&gpio_lkm_devp->pin_lock, flags);
+            gpio_lkm_devp->state = level;
+            gpio_lkm_state_update(gpio_lkm_devp);
+            spin_unlock_irqrestore(&gpio_lkm_devp->pin_lock, flags);
+            /* follow level changes of input in state page */
+            gpio_lkm_irq_request(gpio_lkm_devp);
+        }
+        mutex_unlock(&gpio_lkm_devp->dir_lock);
+        break;
+    }
+    case set_out:
+    {
+        /* keypad switches its rows by itself and keeps column
+         * interrupts masked while scanning
+         */
+        if (READ_ONCE(gpio_lkm_devp->keypad))
+            return -EBUSY;
+        mutex_lock(&gpio_lkm_devp->dir_lock);
+        if (gpio_lkm_devp->dir != out)
+        {
+            pr_debug_ratelimited("[GPIO_LKM] - Set GPIO%d direction: output\n", gpio);
+            /* output level is known, edge interrupt is not needed */
+            gpio_lkm_irq_release(gpio_lkm_devp);
+            /* input has no writes in progress, so it is switched
+             * under dir_lock only, before writers see the new
+             * direction
+             */
+            ret = gpiod_direction_output_raw(desc, low);
+            if (ret)
+            {
+                pr_debug_ratelimited("[GPIO_LKM] - Cannot set GPIO%d direction: output\n", gpio);
+                /* pin stays input, keep tracking its edges */
+                gpio_lkm_irq_request(gpio_lkm_devp);
+                mutex_unlock(&gpio_lkm_devp->dir_lock);
+                break;
+            }
+            /* publish direction output and low level */
+            spin_lock_irqsave(&gpio_lkm_devp->pin_lock, flags);
+            gpio_lkm_devp->dir = out;
+            gpio_lkm_devp->state = low;
+            gpio_lkm_state_update(gpio_lkm_devp);
+            spin_unlock_irqrestore(&gpio_lkm_devp->pin_lock, flags);
+        }
+        mutex_unlock(&gpio_lkm_devp->dir_lock);
+        break;
+    }
+    case set_high:
+    case set_low:
+    {
+        /* direction check and level change are done under
+         * the same lock, so the pin cannot become input in
+         * between. writers of other pins are not blocked
+         */
+        spin_lock_irqsave(&gpio_lkm_devp->pin_lock, flags);
+        if (gpio_lkm_devp->dir == in)
+        {
+            ret = -EPERM;
+        }
+        else
+        {
+            gpio_lkm_pin_write(gpio_lkm_devp, command == set_high ? high : low);
+            if (start)
+                gpio_lkm_lat_record(ktime_get_ns() - start);
+            gpio_lkm_devp->state = command == set_high ? high : low;
+            gpio_lkm_state_update(gpio_lkm_devp);
+        }
+        spin_unlock_irqrestore(&gpio_lkm_devp->pin_lock, flags);
+
+        if (ret)
+            pr_debug_ratelimited("[GPIO_LKM] - Cannot set GPIO %d, direction: input\n", gpio);
+        break;
+    }
+    default:
+        pr_debug_ratelimited("[GPIO_LKM] - Invalid input value\n");
+        return -EINVAL;
+    }
+
+    return ret;
+}
+
+/*
+* gpio_lkm_write_binary - Execute array of binary commands
+* used by control device and by pin devices switched to
+* binary mode. records are copied in small chunks and run
+* in order. if some record fails, number of bytes of records
+* already executed is returned, or error if none was
+* @own: pin of pin device, whose records may address only it.
+*   NULL for control device, which drives any managed pin
+*/
+static ssize_t gpio_lkm_write_binary(const char __user *buf, size_t count, u64 start,
+                                     struct gpio_lkm_dev *own)
+{
+    struct gpio_lkm_cmd cmds[GPIO_LKM_CMD_CHUNK];
+    struct gpio_lkm_dev *dev;
+    size_t done = 0, n, i;
+    unsigned int command;
+    int ret = 0;
+
+    if (!count || count % sizeof(struct gpio_lkm_cmd))
+        return -EINVAL;
+
+    while (done < count && !ret)
+    {
+        n = min_t(size_t, (count - done) / sizeof(struct gpio_lkm_cmd), GPIO_LKM_CMD_CHUNK);
+
+        if (copy_from_user(cmds, buf + done, n * sizeof(struct gpio_lkm_cmd)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            /* access to one pin node gives no control of others */
+            if (own && cmds[i].pin != own->pin.gpio)
+            {
+                ret = -EPERM;
+                break;
+            }
+            dev = own ? own : gpio_lkm_use_pin(cmds[i].pin);
+            if (!dev)
+            {
+                ret = -ENODEV;
+                break;
+            }
+
+            switch (cmds[i].op)
+            {
+            case GPIO_LKM_OP_OUT:  command = set_out; break;
+            case GPIO_LKM_OP_IN:   command = set_in; break;
+            case GPIO_LKM_OP_LOW:  command = set_low; break;
+            case GPIO_LKM_OP_HIGH: command = set_high; break;
+            case GPIO_LKM_OP_SET:  command = cmds[i].value ? set_high : set_low; break;
+            default:               command = na; break;
+            }
+
+            /* latency is measured for the first record only */
+            ret = gpio_lkm_command(dev, command, done ? 0 : start);
+            if (ret)
+                break;
+
+            done += sizeof(struct gpio_lkm_cmd);
+        }
+    }
+
+    return done ? done : ret;
+}
+
+/*
+* gpio_lkm_write - Write method implementation for GPIO device
+* this method will be called whenever write command is applied
+* to our device in /dev. data that should be provided to user
+* space 
+*/
+static ssize_t gpio_lkm_write ( struct file *filp, const char *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_file *file = filp->private_data;
+    u64 start = READ_ONCE(latency) ? ktime_get_ns() : 0;
+    unsigned int len = 0;
+    char kbuf[BUF_SIZE];
+    ssize_t ret;
+
+    /* file switched to binary protocol gets array of records
+     */
+    if (file->mode == GPIO_LKM_MODE_BINARY)
+    {
+        ret = gpio_lkm_write_binary(buf, count, start, file->dev);
+        if (ret > 0)
+            *f_pos += ret;
+        return ret;
+    }
+
+    if (!count)
+        return 0;
+
+    len = count < BUF_SIZE ? count-1 : BUF_SIZE-1;
+
+    /* one more special kernel macro to copy data between
+     * user space memory and kernel space memory
+     */
+    if(raw_copy_from_user(kbuf, buf, len) != 0)
+        return -EFAULT;
+
+    kbuf[len] = '\0';
+
+    pr_debug_ratelimited("[GPIO_LKM] - Got request from user: %s\n", kbuf);
+
+    ret = gpio_lkm_command(file->dev, which_command(kbuf), start);
+    if (ret)
+        return ret;
+
+    *f_pos += count;
+    return count;
+}
+
+/*
+* gpio_lkm_ctl_write - Write method of control device
+* control device is not bound to a pin, so it accepts only
+* binary commands, each of them addresses a pin by number
+*/
+static ssize_t gpio_lkm_ctl_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    u64 start = READ_ONCE(latency) ? ktime_get_ns() : 0;
+    ssize_t ret = gpio_lkm_write_binary(buf, count, start, NULL);
+
+    if (ret > 0)
+        *f_pos += ret;
+    return ret;
+}
+
+/*
+* gpio_lkm_serial_build - Precompute edges of bit-banged frame
+* WS2812 bit is a high pulse, long for 1 and short for 0. SPI
+* mode 0 bit is data set while clock is low and sampled by the
+* slave on rising edge of clock. returns number of edges
+*/
+static int gpio_lkm_serial_build(struct gpio_lkm_serial *cfg, const u8 *data,
+                                 struct gpio_lkm_serial_edge *edges)
+{
+    bool ws2812 = cfg->protocol == GPIO_LKM_SERIAL_WS2812;
+    unsigned int i, n = 0;
+    u64 t = 0;
+    u8 bit;
+
+    for (i = 0; i < cfg->len * 8; i++)
+    {
+        bit = (data[i / 8] >> (7 - i % 8)) & 1;
+
+        if (ws2812)
+        {
+            edges[n++] = (struct gpio_lkm_serial_edge){ t, 0, high };
+            t += bit ? cfg->t1h_ns : cfg->t0h_ns;
+            edges[n++] = (struct gpio_lkm_serial_edge){ t, 0, low };
+            t += bit ? cfg->t1l_ns : cfg->t0l_ns;
+        }
+        else
+        {
+            edges[n++] = (struct gpio_lkm_serial_edge){ t, 0, bit };
+            t += cfg->half_period_ns;
+            edges[n++] = (struct gpio_lkm_serial_edge){ t, 1, high };
+            t += cfg->half_period_ns;
+            edges[n++] = (struct gpio_lkm_serial_edge){ t, 1, low };
+        }
+
+        if (t > GPIO_LKM_SERIAL_MAX_NS)
+            return -E2BIG;
+    }
+
+    return n;
+}
+
+/*
+* gpio_lkm_serial_xfer - Send a frame with bit-bang engine
+* edges are clocked out against precomputed deadlines in a
+* busy loop. WS2812 runs with interrupts disabled, as any
+* stretched pulse changes a bit, but only in chunks of
+* GPIO_LKM_SERIAL_IRQOFF_NS; SPI is clocked by master and only
+* needs preemption disabled to keep the rate
+*/
+static int gpio_lkm_serial_xfer(void __user *arg)
+{
+    struct gpio_lkm_serial cfg;
+    struct gpio_lkm_serial_edge *edges = NULL;
+    struct gpio_lkm_dev *pins[2], *lock[2];
+    struct gpio_desc *descs[2];
+    u64 begin, start, deadline, chunk = 0, now = 0, max_late = 0;
+    unsigned int nlines, n, i;
+    unsigned long flags;
+    bool ws2812;
+    u8 *data;
+    int ret;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+
+    if (!cfg.len || cfg.len > GPIO_LKM_SERIAL_MAX_BYTES)
+        return -EINVAL;
+
+    switch (cfg.protocol)
+    {
+    case GPIO_LKM_SERIAL_WS2812:
+        nlines = 1;
+        /* defaults are WS2812B datasheet values */
+        cfg.t0h_ns = cfg.t0h_ns ? : 400;
+        cfg.t0l_ns = cfg.t0l_ns ? : 850;
+        cfg.t1h_ns = cfg.t1h_ns ? : 800;
+        cfg.t1l_ns = cfg.t1l_ns ? : 450;
+        cfg.reset_ns = cfg.reset_ns ? : 50000;
+        break;
+    case GPIO_LKM_SERIAL_SPI0:
+        nlines = 2;
+        if (cfg.clock_pin == cfg.data_pin)
+            return -EINVAL;
+        break;
+    default:
+        return -EINVAL;
+    }
+    ws2812 = cfg.protocol == GPIO_LKM_SERIAL_WS2812;
+
+    pins[0] = gpio_lkm_use_pin(cfg.data_pin);
+    pins[1] = nlines > 1 ? gpio_lkm_use_pin(cfg.clock_pin) : NULL;
+    if (!pins[0] || (nlines > 1 && !pins[1]))
+        return -ENODEV;
+
+    data = memdup_user(u64_to_user_ptr(cfg.data), cfg.len);
+    if (IS_ERR(data))
+        return PTR_ERR(data);
+
+    edges = kvmalloc_array(cfg.len * 8 * 3, sizeof(*edges), GFP_KERNEL);
+    if (!edges)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = gpio_lkm_serial_build(&cfg, data, edges);
+    if (ret < 0)
+        goto out;
+    n = ret;
+
+    /* pins cannot change direction while frame is sent. locks
+     * are taken in pin table order, so two frames using the same
+     * pins in different roles do not deadlock
+     */
+    lock[0] = pins[0];
+    lock[1] = pins[1];
+    if (nlines > 1 && lock[1]->index < lock[0]->index)
+        swap(lock[0], lock[1]);
+    mutex_lock(&lock[0]->dir_lock);
+    if (nlines > 1)
+        mutex_lock_nested(&lock[1]->dir_lock, SINGLE_DEPTH_NESTING);
+
+    ret = 0;
+    for (i = 0; i < nlines; i++)
+    {
+        if (pins[i]->dir != out)
+            ret = -EPERM;
+        else if (pins[i]->can_sleep)
+            ret = -EOPNOTSUPP;
+        else if (gpio_lkm_wave_driven(pins[i]))
+            ret = -EBUSY;
+        descs[i] = pins[i]->desc;
+    }
+    if (ret)
+        goto unlock;
+
+    if (ws2812)
+        local_irq_save(flags);
+    else
+        preempt_disable();
+
+    if (nlines > 1)
+        gpiod_set_raw_value(descs[1], low);
+
+    begin = start = ktime_get_ns();
+    for (i = 0; i < n; i++)
+    {
+        /* let pending interrupts in between two WS2812 bits once
+         * chunk is used up. following edges are moved by the time
+         * it took, so only this low phase is stretched
+         */
+        if (ws2812 && edges[i].level == high &&
+            edges[i].t_ns - chunk >= GPIO_LKM_SERIAL_IRQOFF_NS)
+        {
+            local_irq_restore(flags);
+            local_irq_save(flags);
+            chunk = edges[i].t_ns;
+            now = ktime_get_ns();
+            if (now > start + edges[i].t_ns)
+            {
+                max_late = max(max_late, now - start - edges[i].t_ns);
+                start = now - edges[i].t_ns;
+            }
+        }
+        deadline = start + edges[i].t_ns;
+        while ((now = ktime_get_ns()) < deadline)
+            cpu_relax();
+        gpiod_set_raw_value(descs[edges[i].line], edges[i].level);
+        max_late = max(max_late, now - deadline);
+    }
+    now = ktime_get_ns();
+
+    if (ws2812)
+        local_irq_restore(flags);
+    else
+        preempt_enable();
+
+    /* data line ends low for WS2812 and with last bit for SPI,
+     * clock line always ends low
+     */
+    gpio_lkm_pin_level(pins[0], ws2812 ? low : edges[n - 3].level);
+    if (nlines > 1)
+        gpio_lkm_pin_level(pins[1], low);
+
+    cfg.bits = cfg.len * 8;
+    cfg.elapsed_ns = now - begin;
+    cfg.bit_rate = div64_u64(cfg.bits * NSEC_PER_SEC, max_t(u64, cfg.elapsed_ns, 1));
+    cfg.max_late_ns = max_late;
+
+unlock:
+    if (nlines > 1)
+        mutex_unlock(&lock[1]->dir_lock);
+    mutex_unlock(&lock[0]->dir_lock);
+
+    /* strip latches the frame after data line stays low */
+    if (!ret && ws2812)
+        usleep_range(DIV_ROUND_UP(cfg.reset_ns, 1000), DIV_ROUND_UP(cfg.reset_ns, 1000) + 10);
+
+    if (!ret && copy_to_user(arg, &cfg, sizeof(cfg)))
+        ret = -EFAULT;
+out:
+    kvfree(edges);
+    kfree(data);
+    return ret;
+}
+
+/*
+* gpio_lkm_ctl_open - Open control device
+* each open file keeps timing of its last script
+*/
+static int gpio_lkm_ctl_open (struct inode *inode, struct file *filp)
+{
+    struct gpio_lkm_ctl_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    mutex_init(&file->lock);
+    filp->private_data = file;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_ctl_release - Close control device
+*/
+static int gpio_lkm_ctl_release (struct inode *inode, struct file *filp)
+{
+    struct gpio_lkm_ctl_file *file = filp->private_data;
+
+    kfree(file->times);
+    kfree(file);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_ctl_read - Read timing of last script
+* returns whole struct gpio_lkm_step_time records, records
+* which are read are removed, 0 is returned when none is left
+*/
+static ssize_t gpio_lkm_ctl_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_ctl_file *file = filp->private_data;
+    size_t size = sizeof(struct gpio_lkm_step_time);
+    unsigned int n;
+    ssize_t ret;
+
+    mutex_lock(&file->lock);
+
+    n = min_t(size_t, count / size, file->ntimes);
+    if (!n)
+    {
+        ret = file->ntimes ? -EINVAL : 0;
+        goto out;
+    }
+
+    if (copy_to_user(buf, file->times, n * size))
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    file->ntimes -= n;
+    memmove(file->times, file->times + n, file->ntimes * size);
+    ret = n * size;
+
+out:
+    mutex_unlock(&file->lock);
+    return ret;
+}
+
+/*
+* gpio_lkm_script_tick - Execute script steps up to next delay
+* level commands are applied back to back, delay moves planned
+* time forward and the timer sleeps until it. planned time is
+* not affected by timer latency, so it does not accumulate
+*/
+static enum hrtimer_restart gpio_lkm_script_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_script *sc = container_of(timer, struct gpio_lkm_script, timer);
+    struct gpio_lkm_script_kstep *step;
+    struct gpio_lkm_dev *dev;
+    unsigned long flags;
+    enum state level;
+
+    while (sc->pos < sc->nsteps)
+    {
+        step = &sc->steps[sc->pos];
+        sc->times[sc->pos].planned_ns = ktime_to_ns(ktime_sub(sc->plan, sc->start));
+        sc->times[sc->pos].actual_ns = ktime_to_ns(ktime_sub(ktime_get(), sc->start));
+
+        if (step->op == GPIO_LKM_OP_DELAY)
+        {
+            sc->pos++;
+            sc->plan = ktime_add_ns(sc->plan, step->value);
+            hrtimer_set_expires(timer, sc->plan);
+            return HRTIMER_RESTART;
+        }
+
+        dev = step->dev;
+        level = step->op == GPIO_LKM_OP_HIGH ||
+                (step->op == GPIO_LKM_OP_SET && step->value) ? high : low;
+
+        spin_lock_irqsave(&dev->pin_lock, flags);
+        if (dev->dir == in)
+        {
+            sc->status = -EPERM;
+        }
+        else
+        {
+            gpiod_set_raw_value(dev->desc, level);
+            dev->state = level;
+            gpio_lkm_state_update(dev);
+        }
+        spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+        if (sc->status)
+            break;
+        sc->pos++;
+    }
+
+    complete(&sc->done);
+    return HRTIMER_NORESTART;
+}
+
+/*
+* gpio_lkm_ctl_write_iter - Execute a timed script
+* called for writev(). all records are checked before the first
+* one is executed, then script runs from timer interrupt, so
+* delays do not depend on scheduling of the writer. direction
+* commands may sleep and are not allowed in scripts, neither
+* are pins of sleeping gpiochips. if a step fails, number of
+* bytes of executed records is returned, or error if none was
+*/
+static ssize_t gpio_lkm_ctl_write_iter (struct kiocb *iocb, struct iov_iter *from)
+{
+    struct gpio_lkm_ctl_file *file = iocb->ki_filp->private_data;
+    struct gpio_lkm_script *sc = &gpio_lkm_script;
+    struct gpio_lkm_script_kstep *steps;
+    struct gpio_lkm_step_time *times;
+    size_t count = iov_iter_count(from);
+    struct gpio_lkm_cmd cmd;
+    unsigned int n, i, executed;
+    u64 total = 0;
+    int status;
+    ssize_t ret;
+
+    if (!count || count % sizeof(cmd))
+        return -EINVAL;
+
+    n = count / sizeof(cmd);
+    if (n > GPIO_LKM_SCRIPT_MAX_STEPS)
+        return -E2BIG;
+
+    steps = kcalloc(n, sizeof(*steps), GFP_KERNEL);
+    times = kcalloc(n, sizeof(*times), GFP_KERNEL);
+    if (!steps || !times)
+    {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (copy_from_iter(&cmd, sizeof(cmd), from) != sizeof(cmd))
+        {
+            ret = -EFAULT;
+            goto fail;
+        }
+
+        steps[i].op = cmd.op;
+        steps[i].value = cmd.value;
+
+        switch (cmd.op)
+        {
+        case GPIO_LKM_OP_DELAY:
+            total += cmd.value;
+            break;
+        case GPIO_LKM_OP_LOW:
+        case GPIO_LKM_OP_HIGH:
+        case GPIO_LKM_OP_SET:
+            steps[i].dev = gpio_lkm_use_pin(cmd.pin);
+            if (!steps[i].dev)
+            {
+                ret = -ENODEV;
+                goto fail;
+            }
+            if (steps[i].dev->can_sleep)
+            {
+                ret = -EINVAL;
+                goto fail;
+            }
+            break;
+        default:
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    if (total > GPIO_LKM_SCRIPT_MAX_NS)
+    {
+        ret = -E2BIG;
+        goto fail;
+    }
+
+    mutex_lock(&sc->lock);
+
+    sc->steps = steps;
+    sc->times = times;
+    sc->nsteps = n;
+    sc->pos = 0;
+    sc->status = 0;
+    reinit_completion(&sc->done);
+    sc->start = ktime_get();
+    sc->plan = sc->start;
+    hrtimer_start(&sc->timer, sc->start, HRTIMER_MODE_ABS);
+
+    /* killed writer stops the script where it is */
+    if (wait_for_completion_killable(&sc->done))
+    {
+        hrtimer_cancel(&sc->timer);
+        sc->status = -EINTR;
+    }
+
+    executed = sc->pos;
+    status = sc->status;
+    sc->steps = NULL;
+    sc->times = NULL;
+
+    mutex_unlock(&sc->lock);
+
+    /* keep timing of executed steps for read() */
+    mutex_lock(&file->lock);
+    kfree(file->times);
+    file->times = times;
+    file->ntimes = executed;
+    mutex_unlock(&file->lock);
+
+    kfree(steps);
+
+    if (status && !executed)
+        return status;
+    return executed * sizeof(cmd);
+
+fail:
+    kfree(steps);
+    kfree(times);
+    return ret;
+}
+
+/*
+* gpio_lkm_reflex_add - Add reflex rule to driver table
+* rule starts firing when its input pin is an input with
+* edge interrupt, output pin should be an output then
+*/
+static int gpio_lkm_reflex_add(struct gpio_lkm_reflex __user *arg)
+{
+    struct gpio_lkm_reflex_rule *rule = NULL;
+    struct gpio_lkm_dev *pins[2];
+    struct gpio_lkm_dev *src, *dst;
+    struct gpio_lkm_reflex cfg;
+    unsigned long flags;
+    unsigned int i;
+    int ret = 0;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+
+    if (cfg.action > GPIO_LKM_REFLEX_PULSE || !cfg.edges || (cfg.edges & ~GPIO_LKM_EDGE_BOTH))
+        return -EINVAL;
+    if (cfg.action == GPIO_LKM_REFLEX_PULSE &&
+        (!cfg.pulse_ns || cfg.pulse_ns > GPIO_LKM_REFLEX_MAX_PULSE_NS))
+        return -EINVAL;
+
+    pins[0] = src = gpio_lkm_bind_pin(cfg.in_pin);
+    pins[1] = dst = gpio_lkm_bind_pin(cfg.out_pin);
+    if (!src || !dst || src == dst)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    /* output is driven from interrupt handler */
+    if (dst->can_sleep)
+    {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    mutex_lock(&gpio_lkm_reflex_mutex);
+
+    for (i = 0; i < GPIO_LKM_REFLEX_MAX; i++)
+    {
+        if (!gpio_lkm_reflex[i].used)
+        {
+            rule = &gpio_lkm_reflex[i];
+            break;
+        }
+    }
+    if (!rule)
+    {
+        mutex_unlock(&gpio_lkm_reflex_mutex);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    spin_lock_irqsave(&gpio_lkm_reflex_lock, flags);
+    rule->in = src;
+    rule->out = dst;
+    rule->edges = cfg.edges;
+    rule->action = cfg.action;
+    rule->pulse_ns = cfg.pulse_ns;
+    rule->pulse_active = false;
+    rule->hits = 0;
+    rule->lat_last = 0;
+    rule->lat_min = 0;
+    rule->lat_max = 0;
+    rule->lat_sum = 0;
+    rule->used = true;
+    src->reflex++;
+    spin_unlock_irqrestore(&gpio_lkm_reflex_lock, flags);
+
+    mutex_unlock(&gpio_lkm_reflex_mutex);
+
+    cfg.id = i;
+    if (put_user(cfg.id, &arg->id))
+        ret = -EFAULT;
+
+out:
+    /* rule stays in table even if its id could not be returned */
+    gpio_lkm_bind_done(pins, 2, rule ? 0 : ret);
+    return ret;
+}
+
+/*
+* gpio_lkm_reflex_del - Delete reflex rule from driver table
+* should be called with gpio_lkm_reflex_mutex held
+*/
+static int gpio_lkm_reflex_del(unsigned int id)
+{
+    struct gpio_lkm_reflex_rule *rule;
+    unsigned long flags;
+
+    if (id >= GPIO_LKM_REFLEX_MAX || !gpio_lkm_reflex[id].used)
+        return -ENOENT;
+    rule = &gpio_lkm_reflex[id];
+
+    spin_lock_irqsave(&gpio_lkm_reflex_lock, flags);
+    rule->used = false;
+    rule->in->reflex--;
+    spin_unlock_irqrestore(&gpio_lkm_reflex_lock, flags);
+
+    /* rule cannot fire any more, finish pulse it started */
+    hrtimer_cancel(&rule->pulse_timer);
+    gpio_lkm_reflex_pulse_finish(rule);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_reflex_get - Copy reflex rule and its statistics to user
+*/
+static int gpio_lkm_reflex_get(struct gpio_lkm_reflex __user *arg)
+{
+    struct gpio_lkm_reflex_rule *rule;
+    struct gpio_lkm_reflex cfg;
+    unsigned long flags;
+    int ret = 0;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+
+    mutex_lock(&gpio_lkm_reflex_mutex);
+
+    if (cfg.id >= GPIO_LKM_REFLEX_MAX || !gpio_lkm_reflex[cfg.id].used)
+    {
+        mutex_unlock(&gpio_lkm_reflex_mutex);
+        return -ENOENT;
+    }
+    rule = &gpio_lkm_reflex[cfg.id];
+
+    spin_lock_irqsave(&gpio_lkm_reflex_lock, flags);
+    cfg.in_pin = rule->in->pin.gpio;
+    cfg.out_pin = rule->out->pin.gpio;
+    cfg.edges = rule->edges;
+    cfg.action = rule->action;
+    cfg.pulse_ns = rule->pulse_ns;
+    cfg.hits = rule->hits;
+    cfg.lat_last_ns = rule->lat_last;
+    cfg.lat_min_ns = rule->lat_min;
+    cfg.lat_max_ns = rule->lat_max;
+    cfg.lat_avg_ns = rule->hits ? div64_u64(rule->lat_sum, rule->hits) : 0;
+    spin_unlock_irqrestore(&gpio_lkm_reflex_lock, flags);
+
+    mutex_unlock(&gpio_lkm_reflex_mutex);
+
+    if (copy_to_user(arg, &cfg, sizeof(cfg)))
+        ret = -EFAULT;
+
+    return ret;
+}
+
+/*
+* gpio_lkm_reflex_clear - Delete all reflex rules
+* called before pins the rules refer to are removed
+*/
+static void gpio_lkm_reflex_clear(void)
+{
+    unsigned int i;
+
+    mutex_lock(&gpio_lkm_reflex_mutex);
+    for (i = 0; i < GPIO_LKM_REFLEX_MAX; i++)
+        gpio_lkm_reflex_del(i);
+    mutex_unlock(&gpio_lkm_reflex_mutex);
+}
+
+/*
+* gpio_lkm_quad_unbind - Release pins of quadrature decoder
+* should be called with gpio_lkm_quad_mutex held
+*/
+static void gpio_lkm_quad_unbind(struct gpio_lkm_quad_dec *q)
+{
+    unsigned long flags;
+
+    if (!q->a)
+        return;
+
+    WRITE_ONCE(q->a->quad, NULL);
+    WRITE_ONCE(q->b->quad, NULL);
+
+    spin_lock_irqsave(&q->lock, flags);
+    q->a = NULL;
+    q->b = NULL;
+    q->velocity = 0;
+    gpio_lkm_quad_publish(q);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/*
+* gpio_lkm_quad_set - Bind or unbind quadrature decoder
+* binding switches both pins to inputs with edge interrupts
+* and starts counting from zero
+*/
+static int gpio_lkm_quad_set(const struct gpio_lkm_quad_config __user *arg)
+{
+    struct gpio_lkm_quad_config cfg;
+    struct gpio_lkm_dev *pins[2] = { NULL, NULL };
+    struct gpio_lkm_dev *a, *b;
+    struct gpio_lkm_quad_dec *q;
+    unsigned long flags;
+    int ret = 0;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+    if (cfg.id >= GPIO_LKM_QUAD_NUM)
+        return -EINVAL;
+    q = &gpio_lkm_quad[cfg.id];
+
+    mutex_lock(&gpio_lkm_quad_mutex);
+
+    gpio_lkm_quad_unbind(q);
+    if (!cfg.enable)
+        goto out;
+
+    pins[0] = a = gpio_lkm_bind_pin(cfg.pin_a);
+    pins[1] = b = gpio_lkm_bind_pin(cfg.pin_b);
+    if (!a || !b || a == b)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (a->quad || b->quad)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+    /* pins are sampled from interrupt handler */
+    if (a->can_sleep || b->can_sleep)
+    {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    /* decoder was unbound above and stays so if pins fail */
+    if ((ret = gpio_lkm_command(a, set_in, 0)) || (ret = gpio_lkm_command(b, set_in, 0)))
+        goto out;
+    if (READ_ONCE(a->irq) < 0 || READ_ONCE(b->irq) < 0)
+    {
+        ret = -EIO;
+        goto out;
+    }
+
+    spin_lock_irqsave(&q->lock, flags);
+    q->a = a;
+    q->b = b;
+    q->prev = gpio_lkm_quad_state_now(q);
+    q->position = 0;
+    q->transitions = 0;
+    q->errors = 0;
+    q->last = ktime_get_ns();
+    q->win_start = q->last;
+    q->win_pos = 0;
+    q->velocity = 0;
+    gpio_lkm_quad_publish(q);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    WRITE_ONCE(a->quad, q);
+    WRITE_ONCE(b->quad, q);
+
+out:
+    mutex_unlock(&gpio_lkm_quad_mutex);
+    gpio_lkm_bind_done(pins, 2, ret);
+    return ret;
+}
+
+/*
+* gpio_lkm_quad_get - Copy state of quadrature decoder to user
+* velocity of a stopped encoder is not updated by interrupts,
+* so it is estimated here from the window which is still open
+*/
+static int gpio_lkm_quad_get(struct gpio_lkm_quad __user *arg)
+{
+    struct gpio_lkm_quad_dec *q;
+    struct gpio_lkm_quad st;
+    unsigned long flags;
+    u64 now;
+
+    if (copy_from_user(&st, arg, sizeof(st)))
+        return -EFAULT;
+    if (st.id >= GPIO_LKM_QUAD_NUM)
+        return -EINVAL;
+    q = &gpio_lkm_quad[st.id];
+
+    spin_lock_irqsave(&q->lock, flags);
+    now = ktime_get_ns();
+    st.enabled = q->a != NULL;
+    st.pin_a = q->a ? q->a->pin.gpio : 0;
+    st.pin_b = q->b ? q->b->pin.gpio : 0;
+    st.position = q->position;
+    st.velocity = q->velocity;
+    if (q->a && now - q->win_start >= 2 * GPIO_LKM_QUAD_WINDOW_NS)
+        st.velocity = div64_s64((q->position - q->win_pos) * NSEC_PER_SEC, now - q->win_start);
+    st.transitions = q->transitions;
+    st.errors = q->errors;
+    st.ktime_ns = q->last;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    if (copy_to_user(arg, &st, sizeof(st)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+* gpio_lkm_quad_clear - Unbind all quadrature decoders
+* called before pins are removed
+*/
+static void gpio_lkm_quad_clear(void)
+{
+    unsigned int i;
+
+    mutex_lock(&gpio_lkm_quad_mutex);
+    for (i = 0; i < GPIO_LKM_QUAD_NUM; i++)
+        gpio_lkm_quad_unbind(&gpio_lkm_quad[i]);
+    mutex_unlock(&gpio_lkm_quad_mutex);
+}
+
+/*
+* gpio_lkm_stepper_drive - Set level of stepper output pin
+* step pulses are not published in state page, step pin is
+* low between them. pin switched to input by user is left alone.
+* called with interrupts disabled
+*/
+static void gpio_lkm_stepper_drive(struct gpio_lkm_dev *dev, enum state level, bool publish)
+{
+    spin_lock(&dev->pin_lock);
+    if (dev->dir == out)
+    {
+        gpiod_set_raw_value(dev->desc, level);
+        if (publish)
+        {
+            dev->state = level;
+            gpio_lkm_state_update(dev);
+        }
+    }
+    spin_unlock(&dev->pin_lock);
+}
+
+/*
+* gpio_lkm_stepper_rate - Step rate of step n of current move
+* the lowest of cruise rate, rate reached accelerating from
+* move start and rate to decelerate from before move end.
+* rates are taken in the middle of the step, v^2 = v0^2 + 2as
+*/
+static u32 gpio_lkm_stepper_rate(struct gpio_lkm_stepper *st, u32 n)
+{
+    const struct gpio_lkm_stepper_kmove *m = &st->cur;
+    u64 acc, dec, v;
+
+    acc = (u64)st->v_start * st->v_start + (u64)m->accel * (2 * (u64)n + 1);
+    dec = (u64)st->v_end * st->v_end + (u64)m->accel * (2 * (u64)(m->steps - 1 - n) + 1);
+    v = min3((u64)m->vmax, (u64)int_sqrt64(acc), (u64)int_sqrt64(dec));
+
+    return max_t(u64, v, 1);
+}
+
+/*
+* gpio_lkm_stepper_interval - Time from previous step to step n
+*/
+static u64 gpio_lkm_stepper_interval(struct gpio_lkm_stepper *st, u32 n)
+{
+    st->velocity = gpio_lkm_stepper_rate(st, n);
+    return max_t(u64, NSEC_PER_SEC / st->velocity, 2 * st->pulse_ns);
+}
+
+/*
+* gpio_lkm_stepper_next_move - Start next queued move
+* if the move after it is already queued and goes the same
+* way, the junction rate is planned now, so axis does not stop
+* between them. returns false if queue is empty.
+* called with axis lock held
+*/
+static bool gpio_lkm_stepper_next_move(struct gpio_lkm_stepper *st, bool from_idle)
+{
+    struct gpio_lkm_stepper_kmove *m, *nx;
+    u32 v_start, v_end = 0;
+
+    if (!st->count)
+        return false;
+
+    m = &st->queue[st->head];
+    st->head = (st->head + 1) % GPIO_LKM_STEPPER_QUEUE;
+    st->count--;
+
+    v_start = !from_idle && m->dir == st->dir_level ? st->v_end : 0;
+    if (st->count)
+    {
+        nx = &st->queue[st->head];
+        if (nx->dir == m->dir)
+        {
+            /* junction rate should be reachable in this move and
+             * next move should still be able to stop from it
+             */
+            v_end = min(m->vmax, nx->vmax);
+            v_end = min_t(u64, v_end, int_sqrt64((u64)v_start * v_start + 2ULL * m->accel * m->steps));
+            v_end = min_t(u64, v_end, int_sqrt64(2ULL * nx->accel * nx->steps));
+        }
+    }
+
+    if (m->dir != st->dir_level)
+    {
+        gpio_lkm_stepper_drive(st->dir, m->dir, true);
+        st->dir_level = m->dir;
+    }
+
+    st->cur = *m;
+    st->n = 0;
+    st->v_start = v_start;
+    st->v_end = v_end;
+
+    /* first step from standstill waits only for direction setup */
+    if (from_idle)
+    {
+        gpio_lkm_stepper_interval(st, 0);
+        st->next = ktime_add_ns(ktime_get(), st->pulse_ns);
+    }
+    else
+    {
+        st->next = ktime_add_ns(st->next, gpio_lkm_stepper_interval(st, 0));
+    }
+
+    return true;
+}
+
+/*
+* gpio_lkm_stepper_tick - Step timer callback
+* rising edge is at planned time of the step, falling edge
+* pulse_ns later. plan of a step which cannot be met any more
+* is moved to now instead of bunching late steps together
+*/
+static enum hrtimer_restart gpio_lkm_stepper_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_stepper *st = container_of(timer, struct gpio_lkm_stepper, timer);
+    ktime_t now = ktime_get();
+    s64 late;
+
+    spin_lock(&st->lock);
+
+    if (!st->running)
+    {
+        spin_unlock(&st->lock);
+        return HRTIMER_NORESTART;
+    }
+
+    if (!st->pulse_high)
+    {
+        gpio_lkm_stepper_drive(st->step, high, false);
+        st->pulse_high = true;
+        st->position += st->dir_level == high ? 1 : -1;
+        late = ktime_to_ns(ktime_sub(now, st->next));
+        if (late > 0 && late > st->max_late)
+            st->max_late = late;
+        hrtimer_set_expires(timer, ktime_add_ns(now, st->pulse_ns));
+        spin_unlock(&st->lock);
+        return HRTIMER_RESTART;
+    }
+
+    gpio_lkm_stepper_drive(st->step, low, false);
+    st->pulse_high = false;
+
+    if (++st->n < st->cur.steps)
+    {
+        st->next = ktime_add_ns(st->next, gpio_lkm_stepper_interval(st, st->n));
+    }
+    else
+    {
+        st->moves++;
+        if (!gpio_lkm_stepper_next_move(st, false))
+        {
+            st->running = false;
+            st->velocity = 0;
+            spin_unlock(&st->lock);
+            return HRTIMER_NORESTART;
+        }
+    }
+
+    /* step pin should stay low for pulse_ns too */
+    if (ktime_before(st->next, ktime_add_ns(now, st->pulse_ns)))
+        st->next = ktime_add_ns(now, st->pulse_ns);
+    hrtimer_set_expires(timer, st->next);
+
+    spin_unlock(&st->lock);
+    return HRTIMER_RESTART;
+}
+
+/*
+* gpio_lkm_stepper_halt - Stop axis at once and drop its queue
+* should be called with axis mutex held
+*/
+static void gpio_lkm_stepper_halt(struct gpio_lkm_stepper *st)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&st->lock, flags);
+    st->count = 0;
+    st->running = false;
+    spin_unlock_irqrestore(&st->lock, flags);
+
+    hrtimer_cancel(&st->timer);
+
+    spin_lock_irqsave(&st->lock, flags);
+    if (st->pulse_high)
+        gpio_lkm_stepper_drive(st->step, low, false);
+    st->pulse_high = false;
+    st->velocity = 0;
+    spin_unlock_irqrestore(&st->lock, flags);
+}
+
+/*
+* gpio_lkm_stepper_set - Bind or unbind stepper axis
+*/
+static int gpio_lkm_stepper_set(const struct gpio_lkm_stepper_config __user *arg)
+{
+    struct gpio_lkm_stepper_config cfg;
+    struct gpio_lkm_dev *pins[2] = { NULL, NULL };
+    struct gpio_lkm_dev *step, *dir;
+    struct gpio_lkm_stepper *st;
+    unsigned long flags;
+    bool was_in[2];
+    int ret = 0;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+    if (cfg.id >= GPIO_LKM_STEPPER_NUM)
+        return -EINVAL;
+    if (!cfg.pulse_ns)
+        cfg.pulse_ns = 2000;
+    if (cfg.pulse_ns < GPIO_LKM_STEPPER_MIN_PULSE_NS || cfg.pulse_ns > GPIO_LKM_STEPPER_MAX_PULSE_NS)
+        return -EINVAL;
+    st = &gpio_lkm_stepper[cfg.id];
+
+    mutex_lock(&st->mutex);
+
+    gpio_lkm_stepper_halt(st);
+    spin_lock_irqsave(&st->lock, flags);
+    st->step = NULL;
+    st->dir = NULL;
+    spin_unlock_irqrestore(&st->lock, flags);
+    if (!cfg.enable)
+        goto out;
+
+    pins[0] = step = gpio_lkm_bind_pin(cfg.step_pin);
+    pins[1] = dir = gpio_lkm_bind_pin(cfg.dir_pin);
+    if (!step || !dir || step == dir)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+    /* pins are driven from timer */
+    if (step->can_sleep || dir->can_sleep)
+    {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    /* inputs switched here are given back if a pin fails,
+     * axis stays unbound then
+     */
+    was_in[0] = READ_ONCE(step->dir) == in;
+    was_in[1] = READ_ONCE(dir->dir) == in;
+    if ((ret = gpio_lkm_command(step, set_out, 0)) || (ret = gpio_lkm_command(dir, set_out, 0)) ||
+        (ret = gpio_lkm_command(step, set_low, 0)) || (ret = gpio_lkm_command(dir, set_low, 0)))
+    {
+        if (was_in[0])
+            gpio_lkm_command(step, set_in, 0);
+        if (was_in[1])
+            gpio_lkm_command(dir, set_in, 0);
+        goto out;
+    }
+
+    spin_lock_irqsave(&st->lock, flags);
+    st->step = step;
+    st->dir = dir;
+    st->pulse_ns = cfg.pulse_ns;
+    st->dir_level = low;
+    st->v_end = 0;
+    st->position = 0;
+    st->moves = 0;
+    st->max_late = 0;
+    spin_unlock_irqrestore(&st->lock, flags);
+
+out:
+    mutex_unlock(&st->mutex);
+    gpio_lkm_bind_done(pins, 2, ret);
+    return ret;
+}
+
+/*
+* gpio_lkm_stepper_move - Queue move to stepper axis
+* timer is started if axis is idle
+*/
+static int gpio_lkm_stepper_move(const struct gpio_lkm_stepper_move __user *arg)
+{
+    struct gpio_lkm_stepper_move mv;
+    struct gpio_lkm_stepper_kmove *m;
+    struct gpio_lkm_stepper *st;
+    unsigned long flags;
+    int ret = 0;
+
+    if (copy_from_user(&mv, arg, sizeof(mv)))
+        return -EFAULT;
+    if (mv.id >= GPIO_LKM_STEPPER_NUM || !mv.steps || mv.steps == S32_MIN ||
+        !mv.max_velocity || mv.max_velocity > GPIO_LKM_STEPPER_MAX_HZ ||
+        !mv.accel || mv.accel > GPIO_LKM_STEPPER_MAX_ACCEL)
+        return -EINVAL;
+    st = &gpio_lkm_stepper[mv.id];
+
+    mutex_lock(&st->mutex);
+    spin_lock_irqsave(&st->lock, flags);
+
+    if (!st->step)
+    {
+        ret = -ENODEV;
+    }
+    else if ((u64)mv.max_velocity * 2 * st->pulse_ns > NSEC_PER_SEC)
+    {
+        /* pulse and gap after it should fit step period */
+        ret = -EINVAL;
+    }
+    else if (st->count == GPIO_LKM_STEPPER_QUEUE)
+    {
+        ret = -EAGAIN;
+    }
+    else
+    {
+        m = &st->queue[(st->head + st->count) % GPIO_LKM_STEPPER_QUEUE];
+        m->steps = abs(mv.steps);
+        m->dir = mv.steps > 0 ? high : low;
+        m->vmax = mv.max_velocity;
+        m->accel = mv.accel;
+        st->count++;
+
+        if (!st->running)
+        {
+            gpio_lkm_stepper_next_move(st, true);
+            st->running = true;
+            st->pulse_high = false;
+            hrtimer_start(&st->timer, st->next, HRTIMER_MODE_ABS);
+        }
+    }
+
+    spin_unlock_irqrestore(&st->lock, flags);
+    mutex_unlock(&st->mutex);
+    return ret;
+}
+
+/*
+* gpio_lkm_stepper_stop - Stop axis selected by user
+*/
+static int gpio_lkm_stepper_stop(__u32 id)
+{
+    struct gpio_lkm_stepper *st;
+
+    if (id >= GPIO_LKM_STEPPER_NUM)
+        return -EINVAL;
+    st = &gpio_lkm_stepper[id];
+
+    mutex_lock(&st->mutex);
+    if (st->step)
+        gpio_lkm_stepper_halt(st);
+    mutex_unlock(&st->mutex);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_stepper_get - Copy state of stepper axis to user
+*/
+static int gpio_lkm_stepper_get(struct gpio_lkm_stepper_status __user *arg)
+{
+    struct gpio_lkm_stepper_status status;
+    struct gpio_lkm_stepper *st;
+    unsigned long flags;
+
+    if (copy_from_user(&status, arg, sizeof(status)))
+        return -EFAULT;
+    if (status.id >= GPIO_LKM_STEPPER_NUM)
+        return -EINVAL;
+    st = &gpio_lkm_stepper[status.id];
+
+    spin_lock_irqsave(&st->lock, flags);
+    status.queued = st->count;
+    status.running = st->running;
+    status.velocity = st->running ? st->velocity : 0;
+    status.position = st->position;
+    status.moves = st->moves;
+    status.max_late_ns = st->max_late;
+    spin_unlock_irqrestore(&st->lock, flags);
+
+    if (copy_to_user(arg, &status, sizeof(status)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+* gpio_lkm_stepper_clear - Stop and unbind all stepper axes
+* called before pins are removed
+*/
+static void gpio_lkm_stepper_clear(void)
+{
+    struct gpio_lkm_stepper *st;
+    unsigned int i;
+
+    for (i = 0; i < GPIO_LKM_STEPPER_NUM; i++)
+    {
+        st = &gpio_lkm_stepper[i];
+        mutex_lock(&st->mutex);
+        if (st->step)
+            gpio_lkm_stepper_halt(st);
+        st->step = NULL;
+        st->dir = NULL;
+        mutex_unlock(&st->mutex);
+    }
+}
+
+/*
+* gpio_lkm_keypad_unbind - Release pins of keypad
+* rows and columns are left inputs with edge interrupts, as
+* other inputs. should be called with keypad mutex held
+*/
+static void gpio_lkm_keypad_unbind(struct gpio_lkm_keypad *kp)
+{
+    struct gpio_lkm_dev *rows[GPIO_LKM_KEYPAD_MAX_ROWS];
+    unsigned int i, nrows, ncols;
+    unsigned long flags;
+    enum state level;
+
+    if (!kp->nrows)
+        return;
+
+    /* column interrupts stop waking scanner first */
+    spin_lock_irqsave(&kp->lock, flags);
+    nrows = kp->nrows;
+    ncols = kp->ncols;
+    memcpy(rows, kp->rows, sizeof(rows));
+    kp->nrows = 0;
+    spin_unlock_irqrestore(&kp->lock, flags);
+
+    /* binding may have failed before scanner was started */
+    if (kp->thread)
+        kthread_stop(kp->thread);
+    kp->thread = NULL;
+
+    spin_lock_irqsave(&kp->lock, flags);
+    if (kp->scanning)
+    {
+        for (i = 0; i < ncols; i++)
+            enable_irq(kp->cols[i]->irq);
+        kp->scanning = false;
+    }
+    spin_unlock_irqrestore(&kp->lock, flags);
+
+    for (i = 0; i < ncols; i++)
+        WRITE_ONCE(kp->cols[i]->keypad, NULL);
+
+    /* direction is switched under dir_lock only, pin_lock
+     * publishes level of the input. row which failed to become
+     * input while binding is left as it is
+     */
+    for (i = 0; i < nrows; i++)
+    {
+        WRITE_ONCE(rows[i]->keypad, NULL);
+        mutex_lock(&rows[i]->dir_lock);
+        if (rows[i]->dir != in)
+        {
+            mutex_unlock(&rows[i]->dir_lock);
+            continue;
+        }
+        gpiod_direction_input(rows[i]->desc);
+        level = gpiod_get_raw_value(rows[i]->desc) ? high : low;
+        spin_lock_irqsave(&rows[i]->pin_lock, flags);
+        rows[i]->state = level;
+        gpio_lkm_state_update(rows[i]);
+        spin_unlock_irqrestore(&rows[i]->pin_lock, flags);
+        gpio_lkm_irq_request(rows[i]);
+        mutex_unlock(&rows[i]->dir_lock);
+    }
+}
+
+/*
+* gpio_lkm_keypad_set - Bind or unbind matrix keypad
+* columns become inputs with edge interrupts, rows become inputs
+* without them and are then driven by keypad. keypad starts idle
+* with all rows driven low, waiting for a column edge
+*/
+static int gpio_lkm_keypad_set(const struct gpio_lkm_keypad_config __user *arg)
+{
+    struct gpio_lkm_dev *pins[GPIO_LKM_KEYPAD_MAX_ROWS + GPIO_LKM_KEYPAD_MAX_COLS] = { NULL };
+    struct gpio_lkm_keypad *kp = &gpio_lkm_keypad;
+    struct gpio_lkm_keypad_config cfg;
+    unsigned int i, j, npins = 0;
+    unsigned long flags;
+    int ret = 0;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+    if (cfg.nrows > GPIO_LKM_KEYPAD_MAX_ROWS || cfg.ncols > GPIO_LKM_KEYPAD_MAX_COLS ||
+        (cfg.nrows && !cfg.ncols) || cfg.scan_ns > GPIO_LKM_KEYPAD_MAX_SCAN_NS ||
+        cfg.debounce > GPIO_LKM_KEYPAD_MAX_DEBOUNCE)
+        return -EINVAL;
+    if (!cfg.scan_ns)
+        cfg.scan_ns = GPIO_LKM_KEYPAD_SCAN_NS;
+    if (!cfg.debounce)
+        cfg.debounce = GPIO_LKM_KEYPAD_DEBOUNCE;
+    if (cfg.nrows && cfg.scan_ns / cfg.nrows < GPIO_LKM_KEYPAD_MIN_TICK_NS)
+        return -EINVAL;
+
+    mutex_lock(&kp->mutex);
+
+    gpio_lkm_keypad_unbind(kp);
+    if (!cfg.nrows)
+        goto out;
+
+    /* rows first, then columns */
+    npins = cfg.nrows + cfg.ncols;
+    for (i = 0; i < npins; i++)
+    {
+        pins[i] = gpio_lkm_bind_pin(i < cfg.nrows ? cfg.rows[i] : cfg.cols[i - cfg.nrows]);
+        if (!pins[i])
+        {
+            ret = -EINVAL;
+            goto out;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if (pins[j] == pins[i])
+            {
+                ret = -EINVAL;
+                goto out;
+            }
+        }
+        if (pins[i]->quad || pins[i]->keypad)
+        {
+            ret = -EBUSY;
+            goto out;
+        }
+        /* columns are sampled with interrupts off */
+        if (pins[i]->can_sleep)
+        {
+            ret = -EOPNOTSUPP;
+            goto out;
+        }
+    }
+
+    /* keypad is filled in before pins are switched, so a failure
+     * below is undone by unbinding it. column interrupts do not
+     * reach keypad until binding is complete
+     */
+    spin_lock_irqsave(&kp->lock, flags);
+    kp->nrows = cfg.nrows;
+    memcpy(kp->rows, pins, cfg.nrows * sizeof(pins[0]));
+    memcpy(kp->cols, pins + cfg.nrows, cfg.ncols * sizeof(pins[0]));
+    kp->ncols = cfg.ncols;
+    kp->tick_ns = cfg.scan_ns / cfg.nrows;
+    kp->debounce = cfg.debounce;
+    kp->scanning = false;
+    kp->pressed = 0;
+    memset(kp->count, 0, sizeof(kp->count));
+    kp->scans = 0;
+    kp->wakeups = 0;
+    kp->queued = 0;
+    kp->dropped = 0;
+    spin_unlock_irqrestore(&kp->lock, flags);
+
+    for (i = cfg.nrows; i < npins; i++)
+    {
+        if ((ret = gpio_lkm_command(pins[i], set_in, 0)))
+            goto unbind;
+        if (READ_ONCE(pins[i]->irq) < 0)
+        {
+            ret = -EIO;
+            goto unbind;
+        }
+    }
+    /* driving rows makes edges nobody needs */
+    for (i = 0; i < cfg.nrows; i++)
+    {
+        if ((ret = gpio_lkm_command(pins[i], set_in, 0)))
+            goto unbind;
+        mutex_lock(&pins[i]->dir_lock);
+        gpio_lkm_irq_release(pins[i]);
+        mutex_unlock(&pins[i]->dir_lock);
+    }
+
+    /* idle keypad drives all rows. scanner is not running yet,
+     * so rows are switched here
+     */
+    for (i = 0; i < cfg.nrows; i++)
+        gpio_lkm_keypad_row(kp, i, true);
+    kp->thread = kthread_run(gpio_lkm_keypad_thread, kp, "gpio_lkm_keypad");
+    if (IS_ERR(kp->thread))
+    {
+        ret = PTR_ERR(kp->thread);
+        kp->thread = NULL;
+        goto unbind;
+    }
+
+    /* edges of columns go to keypad from now on */
+    for (i = 0; i < npins; i++)
+        WRITE_ONCE(pins[i]->keypad, kp);
+
+    /* key held while keypad is bound made its edge already */
+    spin_lock_irqsave(&kp->lock, flags);
+    if (gpio_lkm_keypad_columns(kp))
+        gpio_lkm_keypad_start(kp);
+    spin_unlock_irqrestore(&kp->lock, flags);
+    mutex_unlock(&kp->mutex);
+    gpio_lkm_bind_done(pins, npins, 0);
+    return 0;
+
+unbind:
+    gpio_lkm_keypad_unbind(kp);
+out:
+    mutex_unlock(&kp->mutex);
+    gpio_lkm_bind_done(pins, npins, ret);
+    return ret;
+}
+
+/*
+* gpio_lkm_keypad_clear - Unbind keypad
+* called before pins are removed
+*/
+static void gpio_lkm_keypad_clear(void)
+{
+    mutex_lock(&gpio_lkm_keypad.mutex);
+    gpio_lkm_keypad_unbind(&gpio_lkm_keypad);
+    mutex_unlock(&gpio_lkm_keypad.mutex);
+}
+
+/*
+* gpio_lkm_keypad_read - Read key events
+* blocks until some event is queued, unless file is non blocking
+*/
+static ssize_t gpio_lkm_keypad_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_keypad *kp = &gpio_lkm_keypad;
+    unsigned int copied;
+    int ret;
+
+    if (count < sizeof(struct gpio_lkm_key_event))
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&kp->read_lock))
+        return -ERESTARTSYS;
+
+    while (kfifo_is_empty(&kp->events))
+    {
+        mutex_unlock(&kp->read_lock);
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(kp->wait, !kfifo_is_empty(&kp->events)))
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&kp->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    ret = kfifo_to_user(&kp->events, buf, count, &copied);
+    mutex_unlock(&kp->read_lock);
+
+    return ret ? ret : copied;
+}
+
+/*
+* gpio_lkm_keypad_poll - Keypad device is readable with queued events
+*/
+static __poll_t gpio_lkm_keypad_poll (struct file *filp, poll_table *wait)
+{
+    poll_wait(filp, &gpio_lkm_keypad.wait, wait);
+
+    if (!kfifo_is_empty(&gpio_lkm_keypad.events))
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_keypad_ioctl - Bind keypad and get its counters
+*/
+static long gpio_lkm_keypad_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_lkm_keypad *kp = &gpio_lkm_keypad;
+    struct gpio_lkm_keypad_stats st;
+    unsigned long flags;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_KEYPAD_SET:
+        return gpio_lkm_keypad_set((const struct gpio_lkm_keypad_config __user *)arg);
+    case GPIO_LKM_IOC_KEYPAD_STATS:
+        spin_lock_irqsave(&kp->lock, flags);
+        st.bound = kp->nrows != 0;
+        st.scanning = kp->scanning;
+        st.scans = kp->scans;
+        st.wakeups = kp->wakeups;
+        st.events = kp->queued;
+        st.dropped = kp->dropped;
+        spin_unlock_irqrestore(&kp->lock, flags);
+        if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+* gpio_lkm_at_tick - Fire scheduled transitions which are due
+* transitions are taken in order of time until the first one in
+* the future, timer is then moved to it. timer may have been armed
+* meanwhile by a transition added ahead of all others
+*/
+static enum hrtimer_restart gpio_lkm_at_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_at_queue *at = container_of(timer, struct gpio_lkm_at_queue, timer);
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    struct gpio_lkm_at_result res;
+    struct timerqueue_node *next;
+    struct gpio_lkm_at_cmd *cmd;
+    struct gpio_lkm_dev *dev;
+    unsigned long flags;
+    ktime_t fired;
+
+    spin_lock(&at->lock);
+
+    while ((next = timerqueue_getnext(&at->head)) &&
+           !ktime_after(next->expires, ktime_get_real()))
+    {
+        cmd = container_of(next, struct gpio_lkm_at_cmd, node);
+        dev = cmd->dev;
+        timerqueue_del(&at->head, next);
+        at->pending--;
+
+        spin_lock_irqsave(&dev->pin_lock, flags);
+        if (dev->dir != out)
+        {
+            res.status = -EPERM;
+        }
+        else
+        {
+            gpiod_set_raw_value(dev->desc, cmd->level);
+            dev->state = cmd->level;
+            gpio_lkm_state_update(dev);
+            res.status = 0;
+        }
+        fired = ktime_get_real();
+        spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+        res.id = cmd->id;
+        res.pin = dev->pin.gpio;
+        res.value = cmd->level == high;
+        res.reserved = 0;
+        res.time_ns = ktime_to_ns(next->expires);
+        res.fired_ns = ktime_to_ns(fired);
+        res.late_ns = ktime_to_ns(ktime_sub(fired, next->expires));
+        cmd->dev = NULL;
+
+        if (res.status)
+        {
+            at->failed++;
+        }
+        else
+        {
+            if (!at->fired || res.late_ns < at->late_min)
+                at->late_min = res.late_ns;
+            if (!at->fired || res.late_ns > at->late_max)
+                at->late_max = res.late_ns;
+            at->late_sum += res.late_ns;
+            at->fired++;
+        }
+
+        if (!kfifo_put(&at->results, res))
+            at->lost++;
+    }
+
+    if (next && !hrtimer_is_queued(timer))
+    {
+        hrtimer_set_expires(timer, next->expires);
+        restart = HRTIMER_RESTART;
+    }
+
+    spin_unlock(&at->lock);
+
+    return restart;
+}
+
+/*
+* gpio_lkm_at_add - Schedule output transition
+* pin is checked now and once more when transition fires
+*/
+static int gpio_lkm_at_add(struct gpio_lkm_at __user *arg)
+{
+    struct gpio_lkm_at_queue *at = &gpio_lkm_at;
+    struct gpio_lkm_at_cmd *cmd = NULL;
+    struct gpio_lkm_dev *dev;
+    struct gpio_lkm_at cfg;
+    unsigned long flags;
+    unsigned int i;
+
+    if (copy_from_user(&cfg, arg, sizeof(cfg)))
+        return -EFAULT;
+
+    if (cfg.value > 1 || cfg.time_ns > KTIME_MAX)
+        return -EINVAL;
+
+    dev = gpio_lkm_use_pin(cfg.pin);
+    if (!dev)
+        return -ENODEV;
+    /* transitions are fired from timer interrupt */
+    if (dev->can_sleep)
+        return -EINVAL;
+    if (READ_ONCE(dev->dir) != out)
+        return -EPERM;
+
+    spin_lock_irqsave(&at->lock, flags);
+
+    for (i = 0; i < GPIO_LKM_AT_MAX; i++)
+    {
+        if (!at->cmds[i].dev)
+        {
+            cmd = &at->cmds[i];
+            break;
+        }
+    }
+    if (!cmd)
+    {
+        spin_unlock_irqrestore(&at->lock, flags);
+        return -ENOSPC;
+    }
+
+    cmd->dev = dev;
+    cmd->level = cfg.value ? high : low;
+    cmd->id = ++at->seq;
+    cmd->node.expires = ns_to_ktime(cfg.time_ns);
+    at->pending++;
+    at->queued++;
+    cfg.id = cmd->id;
+
+    /* timer is moved only when the new transition is the earliest */
+    if (timerqueue_add(&at->head, &cmd->node))
+        hrtimer_start(&at->timer, cmd->node.expires, HRTIMER_MODE_ABS);
+
+    spin_unlock_irqrestore(&at->lock, flags);
+
+    if (copy_to_user(arg, &cfg, sizeof(cfg)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_at_cancel - Cancel scheduled transition
+* @id: id of transition, 0 cancels all. timer is left armed,
+*   it finds nothing due and moves on to the next transition
+*/
+static int gpio_lkm_at_cancel(u64 id)
+{
+    struct gpio_lkm_at_queue *at = &gpio_lkm_at;
+    unsigned long flags;
+    unsigned int i, n = 0;
+
+    spin_lock_irqsave(&at->lock, flags);
+    for (i = 0; i < GPIO_LKM_AT_MAX; i++)
+    {
+        if (!at->cmds[i].dev || (id && at->cmds[i].id != id))
+            continue;
+        timerqueue_del(&at->head, &at->cmds[i].node);
+        at->cmds[i].dev = NULL;
+        at->pending--;
+        at->cancelled++;
+        n++;
+    }
+    spin_unlock_irqrestore(&at->lock, flags);
+
+    return n || !id ? 0 : -ENOENT;
+}
+
+/*
+* gpio_lkm_at_result - Take result of oldest fired transition
+*/
+static int gpio_lkm_at_result(struct gpio_lkm_at_result __user *arg)
+{
+    struct gpio_lkm_at_queue *at = &gpio_lkm_at;
+    struct gpio_lkm_at_result res;
+    unsigned long flags;
+    bool found;
+
+    spin_lock_irqsave(&at->lock, flags);
+    found = kfifo_get(&at->results, &res);
+    spin_unlock_irqrestore(&at->lock, flags);
+
+    if (!found)
+        return -EAGAIN;
+    if (copy_to_user(arg, &res, sizeof(res)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_at_stats - Get counters of scheduled transitions
+*/
+static int gpio_lkm_at_stats(struct gpio_lkm_at_stats __user *arg)
+{
+    struct gpio_lkm_at_queue *at = &gpio_lkm_at;
+    struct gpio_lkm_at_stats st;
+    unsigned long flags;
+
+    memset(&st, 0, sizeof(st));
+
+    spin_lock_irqsave(&at->lock, flags);
+    st.pending = at->pending;
+    st.queued = at->queued;
+    st.fired = at->fired;
+    st.failed = at->failed;
+    st.cancelled = at->cancelled;
+    st.lost = at->lost;
+    st.late_min_ns = at->late_min;
+    st.late_max_ns = at->late_max;
+    st.late_avg_ns = at->fired ? div64_s64(at->late_sum, at->fired) : 0;
+    spin_unlock_irqrestore(&at->lock, flags);
+
+    if (copy_to_user(arg, &st, sizeof(st)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_at_clear - Cancel all scheduled transitions
+* called before pins they refer to are removed
+*/
+static void gpio_lkm_at_clear(void)
+{
+    hrtimer_cancel(&gpio_lkm_at.timer);
+    gpio_lkm_at_cancel(0);
+}
+
+/*
+* gpio_lkm_ctl_ioctl - Driver wide requests of control device
+* scheduled transitions, stepper axes, quadrature decoders, reflex
+* rules, bit-bang frames and latency histogram. per cpu latency histograms are summed up
+* on read. reset is not synchronized with writers, it is meant
+* to be done between benchmark runs
+*/
+static long gpio_lkm_ctl_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_lkm_lat_hist *sum, *hist;
+    unsigned int cpu, i;
+    long ret = 0;
+    __u64 at_id;
+    __u32 id;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_LAT_HIST:
+        sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+        if (!sum)
+            return -ENOMEM;
+
+        for_each_possible_cpu(cpu)
+        {
+            hist = per_cpu_ptr(&gpio_lkm_lat, cpu);
+            sum->count += hist->count;
+            sum->sum_ns += hist->sum_ns;
+            sum->max_ns = max(sum->max_ns, hist->max_ns);
+            for (i = 0; i < GPIO_LKM_LAT_BUCKETS; i++)
+                sum->buckets[i] += hist->buckets[i];
+        }
+
+        if (copy_to_user((void __user *)arg, sum, sizeof(*sum)))
+            ret = -EFAULT;
+        kfree(sum);
+        return ret;
+
+    case GPIO_LKM_IOC_LAT_RESET:
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(&gpio_lkm_lat, cpu), 0, sizeof(struct gpio_lkm_lat_hist));
+        return 0;
+
+    case GPIO_LKM_IOC_SERIAL_XFER:
+        return gpio_lkm_serial_xfer((void __user *)arg);
+
+    case GPIO_LKM_IOC_REFLEX_ADD:
+        return gpio_lkm_reflex_add((void __user *)arg);
+
+    case GPIO_LKM_IOC_REFLEX_DEL:
+        if (get_user(id, (__u32 __user *)arg))
+            return -EFAULT;
+        mutex_lock(&gpio_lkm_reflex_mutex);
+        ret = gpio_lkm_reflex_del(id);
+        mutex_unlock(&gpio_lkm_reflex_mutex);
+        return ret;
+
+    case GPIO_LKM_IOC_REFLEX_GET:
+        return gpio_lkm_reflex_get((void __user *)arg);
+
+    case GPIO_LKM_IOC_QUAD_SET:
+        return gpio_lkm_quad_set((const struct gpio_lkm_quad_config __user *)arg);
+
+    case GPIO_LKM_IOC_QUAD_GET:
+        return gpio_lkm_quad_get((struct gpio_lkm_quad __user *)arg);
+
+    case GPIO_LKM_IOC_STEPPER_SET:
+        return gpio_lkm_stepper_set((const struct gpio_lkm_stepper_config __user *)arg);
+
+    case GPIO_LKM_IOC_STEPPER_MOVE:
+        return gpio_lkm_stepper_move((const struct gpio_lkm_stepper_move __user *)arg);
+
+    case GPIO_LKM_IOC_STEPPER_STOP:
+        if (get_user(id, (__u32 __user *)arg))
+            return -EFAULT;
+        return gpio_lkm_stepper_stop(id);
+
+    case GPIO_LKM_IOC_STEPPER_GET:
+        return gpio_lkm_stepper_get((struct gpio_lkm_stepper_status __user *)arg);
+
+    case GPIO_LKM_IOC_AT_ADD:
+        return gpio_lkm_at_add((struct gpio_lkm_at __user *)arg);
+
+    case GPIO_LKM_IOC_AT_CANCEL:
+        if (get_user(at_id, (__u64 __user *)arg))
+            return -EFAULT;
+        return gpio_lkm_at_cancel(at_id);
+
+    case GPIO_LKM_IOC_AT_RESULT:
+        return gpio_lkm_at_result((struct gpio_lkm_at_result __user *)arg);
+
+    case GPIO_LKM_IOC_AT_STATS:
+        return gpio_lkm_at_stats((struct gpio_lkm_at_stats __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+* gpio_lkm_bus_open - Open bus device
+* find bus structure by cdev embedded in it, same as
+* it is done for per pin devices
+*/
+static int gpio_lkm_bus_open (struct inode *inode, struct file *filp)
+{
+    filp->private_data = container_of(inode->i_cdev, struct gpio_lkm_bus, cdev);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_bus_read - Read current levels of bus pins
+* one u64 word is returned per call, bit n holds level of pins[n].
+* all pins are sampled with a single array call
+*/
+static ssize_t gpio_lkm_bus_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_bus *bus = filp->private_data;
+    DECLARE_BITMAP(values, GPIO_LKM_BUS_MAX_PINS);
+    unsigned int i;
+    __u64 word = 0;
+    int ret;
+
+    if (count < sizeof(word))
+        return -EINVAL;
+
+    mutex_lock(&bus->lock);
+
+    if (!bus->npins)
+    {
+        mutex_unlock(&bus->lock);
+        return -ENXIO;
+    }
+
+    ret = gpiod_get_raw_array_value_cansleep(bus->npins, bus->descs, NULL, values);
+    if (!ret)
+    {
+        for (i = 0; i < bus->npins; i++)
+        {
+            if (test_bit(i, values))
+                word |= 1ULL << i;
+        }
+    }
+
+    mutex_unlock(&bus->lock);
+
+    if (ret)
+        return ret;
+
+    if (copy_to_user(buf, &word, sizeof(word)))
+        return -EFAULT;
+
+    return sizeof(word);
+}
+
+/*
+* gpio_lkm_bus_write - Write one or more value/mask words to bus
+* each struct gpio_lkm_bus_word is applied by a single call of
+* gpiod_set_raw_array_value_cansleep() for all pins selected by mask, so
+* they are updated together instead of pin by pin
+*/
+static ssize_t gpio_lkm_bus_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_bus *bus = filp->private_data;
+    struct gpio_lkm_bus_word word;
+    DECLARE_BITMAP(values, GPIO_LKM_BUS_MAX_PINS);
+    unsigned int i, n;
+    size_t done;
+    int ret = 0;
+
+    if (!count || count % sizeof(word))
+        return -EINVAL;
+
+    mutex_lock(&bus->lock);
+
+    if (!bus->npins)
+    {
+        ret = -ENXIO;
+        goto out;
+    }
+
+    for (done = 0; done < count; done += sizeof(word))
+    {
+        if (copy_from_user(&word, buf + done, sizeof(word)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        /* collect descriptors of pins selected by mask, bus is
+         * refused entirely if any of them is configured as input.
+         * check is done without pin locks: pin switched to input
+         * right after it only gets its output latch written, and
+         * its cached level is not touched by gpio_lkm_pin_level()
+         */
+        for (i = 0, n = 0; i < bus->npins; i++)
+        {
+            if (!(word.mask & (1ULL << i)))
+                continue;
+
+            if (READ_ONCE(bus->pins[i]->dir) == in)
+            {
+                pr_debug_ratelimited("[GPIO_LKM] - Cannot set GPIO %d, direction: input\n",
+                                     bus->pins[i]->pin.gpio);
+                ret = -EPERM;
+                goto out;
+            }
+
+            /* writes queued to the pin before must not land
+             * after this one
+             */
+            gpio_lkm_chip_flush(bus->pins[i]);
+            bus->sel[n] = bus->descs[i];
+            assign_bit(n, values, word.value & (1ULL << i));
+            n++;
+        }
+
+        if (!n)
+            continue;
+
+        /* bus writes are done in process context, so buses may
+         * include pins of sleeping chips as well
+         */
+        ret = gpiod_set_raw_array_value_cansleep(n, bus->sel, NULL, values);
+        if (ret)
+            break;
+
+        /* keep cached state of per pin devices in sync */
+        for (i = 0; i < bus->npins; i++)
+        {
+            if (word.mask & (1ULL << i))
+                gpio_lkm_pin_level(bus->pins[i], (word.value & (1ULL << i)) ? high : low);
+        }
+    }
+
+out:
+    mutex_unlock(&bus->lock);
+
+    /* report partial success if some words were already applied */
+    if (ret && !done)
+        return ret;
+
+    *f_pos += done;
+    return done;
+}
+
+/*
+* gpio_lkm_bus_ioctl - Configure pin list of bus device
+* pins should be managed by this driver, each pin may
+* appear in a bus only once
+*/
+static long gpio_lkm_bus_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_lkm_bus *bus = filp->private_data;
+    struct gpio_lkm_bus_config *cfg;
+    struct gpio_lkm_dev *dev;
+    unsigned int i, j;
+    long ret = 0;
+
+    /* config structure is too big to be placed on kernel stack */
+    cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+        return -ENOMEM;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_BUS_SET_PINS:
+    {
+        if (copy_from_user(cfg, (void __user *)arg, sizeof(*cfg)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        if (cfg->npins > GPIO_LKM_BUS_MAX_PINS)
+        {
+            ret = -EINVAL;
+            break;
+        }
+
+        for (i = 0; i < cfg->npins; i++)
+        {
+            for (j = 0; j < i; j++)
+            {
+                if (cfg->pins[j] == cfg->pins[i])
+                    ret = -EINVAL;
+            }
+
+            if (!gpio_lkm_bind_pin(cfg->pins[i]))
+                ret = -ENODEV;
+        }
+
+        if (!ret)
+        {
+            mutex_lock(&bus->lock);
+            for (i = 0; i < cfg->npins; i++)
+            {
+                dev = gpio_lkm_find_pin(cfg->pins[i]);
+                bus->pins[i] = dev;
+                bus->descs[i] = dev->desc;
+            }
+            bus->npins = cfg->npins;
+            mutex_unlock(&bus->lock);
+        }
+
+        /* pins are kept only if bus was configured */
+        for (i = 0; i < cfg->npins; i++)
+        {
+            dev = gpio_lkm_find_pin(cfg->pins[i]);
+            if (dev)
+                gpio_lkm_bind_done(&dev, 1, ret);
+        }
+        break;
+    }
+    case GPIO_LKM_IOC_BUS_GET_PINS:
+    {
+        mutex_lock(&bus->lock);
+        cfg->npins = bus->npins;
+        for (i = 0; i < bus->npins; i++)
+            cfg->pins[i] = bus->pins[i]->pin.gpio;
+        mutex_unlock(&bus->lock);
+
+        if (copy_to_user((void __user *)arg, cfg, sizeof(*cfg)))
+            ret = -EFAULT;
+        break;
+    }
+    default:
+        /* waveform driving all bus pins together */
+        mutex_lock(&bus->lock);
+        ret = gpio_lkm_wave_ioctl(&bus->wave, cmd, arg, bus->npins, bus->descs, bus->pins);
+        mutex_unlock(&bus->lock);
+        break;
+    }
+
+    kfree(cfg);
+    return ret;
+}
+
+/*
+* gpio_lkm_buses_remove - Destroy bus devices
+* used on module unload and on initialization failure,
+* so it should handle partially created set of buses
+*/
+static void gpio_lkm_buses_remove(void)
+{
+    int n;
+
+    for (n = 0; n < GPIO_LKM_BUS_NUM; n++)
+    {
+        if (!gpio_lkm_busp[n])
+            continue;
+
+        mutex_lock(&gpio_lkm_busp[n]->wave.lock);
+        gpio_lkm_wave_stop(&gpio_lkm_busp[n]->wave);
+        mutex_unlock(&gpio_lkm_busp[n]->wave.lock);
+
+        device_destroy(gpio_lkm_class, MKDEV(MAJOR(first), BUS_MINOR(n)));
+        cdev_del(&gpio_lkm_busp[n]->cdev);
+        kfree(gpio_lkm_busp[n]);
+        gpio_lkm_busp[n] = NULL;
+    }
+}
+
+/*
+* gpio_lkm_buses_create - Create bus devices /dev/gpio_lkm_busN
+* buses are created empty, pins are assigned later with
+* GPIO_LKM_IOC_BUS_SET_PINS request
+*/
+static int gpio_lkm_buses_create(void)
+{
+    struct gpio_lkm_bus *bus;
+    int n, ret;
+
+    for (n = 0; n < GPIO_LKM_BUS_NUM; n++)
+    {
+        bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+        if (!bus)
+        {
+            ret = -ENOMEM;
+            goto fail;
+        }
+
+        mutex_init(&bus->lock);
+        gpio_lkm_wave_init(&bus->wave);
+        cdev_init(&bus->cdev, &gpio_lkm_bus_fops);
+        bus->cdev.owner = THIS_MODULE;
+
+        if ((ret = cdev_add(&bus->cdev, MKDEV(MAJOR(first), BUS_MINOR(n)), 1)))
+        {
+            kfree(bus);
+            goto fail;
+        }
+        gpio_lkm_busp[n] = bus;
+
+        if (IS_ERR(device_create(gpio_lkm_class, NULL,
+                                 MKDEV(MAJOR(first), BUS_MINOR(n)),
+                                 NULL, "gpio_lkm_bus%d", n)))
+        {
+            /* device node was not created, do not destroy it later */
+            cdev_del(&bus->cdev);
+            kfree(bus);
+            gpio_lkm_busp[n] = NULL;
+            ret = -ENODEV;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    printk(KERN_ALERT "[GPIO_LKM] - Error %d creating bus device %d\n", ret, n);
+    gpio_lkm_buses_remove();
+    return ret;
+}
+
+/*
+* gpio_lkm_ctl_mmap - Map state page to user space
+* only one page is exposed and only for reading, writable
+* mappings are refused so user space cannot corrupt seq
+*/
+static int gpio_lkm_ctl_mmap (struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    /* forbid mprotect() to make mapping writable later */
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(gpio_lkm_state));
+}
+
+/*
+* gpio_lkm_ctl_create - Create control device /dev/gpio_lkm
+* and allocate state page it exposes
+*/
+static int gpio_lkm_ctl_create(void)
+{
+    unsigned int i;
+    int ret;
+
+    BUILD_BUG_ON(sizeof(struct gpio_lkm_state_page) > PAGE_SIZE);
+    gpio_lkm_state = (struct gpio_lkm_state_page *)get_zeroed_page(GFP_KERNEL);
+    if (!gpio_lkm_state)
+        return -ENOMEM;
+
+    mutex_init(&gpio_lkm_script.lock);
+    init_completion(&gpio_lkm_script.done);
+    hrtimer_init(&gpio_lkm_script.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    gpio_lkm_script.timer.function = gpio_lkm_script_tick;
+    for (i = 0; i < GPIO_LKM_REFLEX_MAX; i++)
+    {
+        hrtimer_init(&gpio_lkm_reflex[i].pulse_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        gpio_lkm_reflex[i].pulse_timer.function = gpio_lkm_reflex_pulse_end;
+    }
+    for (i = 0; i < GPIO_LKM_QUAD_NUM; i++)
+        spin_lock_init(&gpio_lkm_quad[i].lock);
+    for (i = 0; i < GPIO_LKM_STEPPER_NUM; i++)
+    {
+        mutex_init(&gpio_lkm_stepper[i].mutex);
+        spin_lock_init(&gpio_lkm_stepper[i].lock);
+        hrtimer_init(&gpio_lkm_stepper[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        gpio_lkm_stepper[i].timer.function = gpio_lkm_stepper_tick;
+    }
+    spin_lock_init(&gpio_lkm_at.lock);
+    timerqueue_init_head(&gpio_lkm_at.head);
+    for (i = 0; i < GPIO_LKM_AT_MAX; i++)
+        timerqueue_init(&gpio_lkm_at.cmds[i].node);
+    INIT_KFIFO(gpio_lkm_at.results);
+    hrtimer_init(&gpio_lkm_at.timer, CLOCK_REALTIME, HRTIMER_MODE_ABS);
+    gpio_lkm_at.timer.function = gpio_lkm_at_tick;
+
+    cdev_init(&gpio_lkm_ctl_cdev, &gpio_lkm_ctl_fops);
+    gpio_lkm_ctl_cdev.owner = THIS_MODULE;
+
+    if ((ret = cdev_add(&gpio_lkm_ctl_cdev, MKDEV(MAJOR(first), CTL_MINOR), 1)))
+        goto fail_page;
+
+    if (IS_ERR(device_create(gpio_lkm_class, NULL, MKDEV(MAJOR(first), CTL_MINOR),
+                             NULL, DEVICE_NAME)))
+    {
+        ret = -ENODEV;
+        goto fail_cdev;
+    }
+
+    return 0;
+
+fail_cdev:
+    cdev_del(&gpio_lkm_ctl_cdev);
+fail_page:
+    free_page((unsigned long)gpio_lkm_state);
+    gpio_lkm_state = NULL;
+    printk(KERN_ALERT "[GPIO_LKM] - Error %d creating control device\n", ret);
+    return ret;
+}
+
+/*
+* gpio_lkm_ctl_remove - Destroy control device
+* page is released only after its last mapping is gone,
+* since vm_insert_page() takes a reference on it
+*/
+static void gpio_lkm_ctl_remove(void)
+{
+    device_destroy(gpio_lkm_class, MKDEV(MAJOR(first), CTL_MINOR));
+    cdev_del(&gpio_lkm_ctl_cdev);
+    free_page((unsigned long)gpio_lkm_state);
+    gpio_lkm_state = NULL;
+}
+
+/*
+* gpio_lkm_capture_tick - Sampling timer callback of capture mode
+* runs in timer interrupt context: samples all pins with one
+* array call, stores sample to ring and advances its head
+*/
+static enum hrtimer_restart gpio_lkm_capture_tick(struct hrtimer *timer)
+{
+    struct gpio_lkm_capture *cap = container_of(timer, struct gpio_lkm_capture, timer);
+    struct gpio_lkm_capture_ring *ring = cap->ring;
+    struct gpio_lkm_capture_sample *sample;
+    unsigned int i;
+    u64 overrun, now;
+    __u32 head;
+
+    now = ktime_get_ns();
+
+    /* timer may fire late, forward it past now and account
+     * periods which passed without a sample */
+    overrun = hrtimer_forward_now(timer, ns_to_ktime(cap->period_ns));
+    if (overrun > 1)
+        cap->stats.missed_ticks += overrun - 1;
+
+    head = cap->head;
+
+    if (gpio_lkm_capture_used(cap, head) >= cap->nsamples)
+    {
+        cap->stats.overruns++;
+        ring->stats = cap->stats;
+        return HRTIMER_RESTART;
+    }
+
+    if (gpiod_get_raw_array_value(cap->npins, cap->descs, NULL, cap->values))
+        return HRTIMER_RESTART;
+
+    /* address depends only on fields user space cannot change */
+    sample = (void *)ring + cap->data_offset +
+             (head & (cap->nsamples - 1)) * cap->sample_size;
+    sample->ktime_ns = now;
+    memset(sample->bits, 0, cap->words * sizeof(__u64));
+    for_each_set_bit(i, cap->values, cap->npins)
+        sample->bits[i / 64] |= 1ULL << (i % 64);
+
+    cap->stats.samples++;
+    cap->stats.last_ns = now;
+    cap->head = head + 1;
+
+    if (cap->head - cap->wake_head >= cap->watermark)
+        gpio_lkm_capture_rate(cap);
+    ring->stats = cap->stats;
+
+    /* publish sample only after it is completely written */
+    smp_store_release(&ring->head, cap->head);
+
+    if (cap->head - cap->wake_head >= cap->watermark)
+    {
+        cap->wake_head = cap->head;
+        wake_up_interruptible(&cap->wait);
+    }
+
+    return HRTIMER_RESTART;
+}
+
+/*
+* gpio_lkm_capture_start - Reset ring and start sampling timer
+* should be called with cap->lock held
+*/
+static int gpio_lkm_capture_start(struct gpio_lkm_capture *cap,
+                                  struct gpio_lkm_capture_config *cfg)
+{
+    struct gpio_lkm_capture_ring *ring = cap->ring;
+    unsigned int i;
+    size_t nsamples;
+
+    if (cfg->rate_hz < GPIO_LKM_CAPTURE_MIN_HZ || cfg->rate_hz > GPIO_LKM_CAPTURE_MAX_HZ)
+        return -EINVAL;
+
+    if (cap->running)
+    {
+        hrtimer_cancel(&cap->timer);
+        cap->running = false;
+    }
+
+    /* sample all managed pins, in order of state page bitmaps.
+     * samples are taken from timer, which cannot wait for a bus
+     */
+    cap->npins = 0;
+    for (i = 0; i < gpio_lkm_npins; i++)
+    {
+        if (gpio_lkm_pin_acquire(gpio_lkm_devp[i], true))
+            return -EBUSY;
+        if (gpio_lkm_devp[i]->can_sleep)
+            return -EOPNOTSUPP;
+        cap->descs[cap->npins++] = gpio_lkm_devp[i]->desc;
+    }
+    if (!cap->npins)
+        return -ENODEV;
+
+    cap->words = DIV_ROUND_UP(cap->npins, 64);
+    cap->period_ns = div_u64(NSEC_PER_SEC, cfg->rate_hz);
+
+    /* layout is kept by driver and only published in header */
+    cap->head = 0;
+    cap->data_offset = PAGE_SIZE;
+    cap->sample_size = sizeof(struct gpio_lkm_capture_sample) + cap->words * sizeof(__u64);
+    nsamples = (cap->size - PAGE_SIZE) / cap->sample_size;
+    cap->nsamples = rounddown_pow_of_two(nsamples);
+    memset(&cap->stats, 0, sizeof(cap->stats));
+    cap->stats.rate_hz = cfg->rate_hz;
+    cap->stats.start_ns = ktime_get_ns();
+
+    memset(ring, 0, sizeof(*ring));
+    ring->npins = cap->npins;
+    ring->data_offset = cap->data_offset;
+    ring->sample_size = cap->sample_size;
+    ring->nsamples = cap->nsamples;
+    ring->stats = cap->stats;
+
+    cap->watermark = cfg->watermark ? min(cfg->watermark, cap->nsamples) : cap->nsamples / 4;
+    cap->wake_head = 0;
+    cap->running = true;
+
+    hrtimer_start(&cap->timer, ns_to_ktime(cap->stats.start_ns + cap->period_ns),
+                  HRTIMER_MODE_ABS);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_capture_stop - Stop sampling timer
+* should be called with cap->lock held
+*/
+static void gpio_lkm_capture_stop(struct gpio_lkm_capture *cap)
+{
+    if (!cap->running)
+        return;
+
+    hrtimer_cancel(&cap->timer);
+    cap->running = false;
+    gpio_lkm_capture_rate(cap);
+    cap->ring->stats = cap->stats;
+    /* let readers waiting for watermark see remaining samples */
+    wake_up_interruptible(&cap->wait);
+}
+
+/*
+* gpio_lkm_capture_ioctl - Start, stop and query capture
+*/
+static long gpio_lkm_capture_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_lkm_capture *cap = &gpio_lkm_cap;
+    struct gpio_lkm_capture_config cfg;
+    struct gpio_lkm_capture_stats stats;
+    long ret = 0;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_CAPTURE_START:
+        if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+            return -EFAULT;
+
+        mutex_lock(&cap->lock);
+        ret = gpio_lkm_capture_start(cap, &cfg);
+        mutex_unlock(&cap->lock);
+        break;
+
+    case GPIO_LKM_IOC_CAPTURE_STOP:
+        mutex_lock(&cap->lock);
+        gpio_lkm_capture_stop(cap);
+        mutex_unlock(&cap->lock);
+        break;
+
+    case GPIO_LKM_IOC_CAPTURE_STATS:
+        /* timer updates counters without lock, copy is
+         * good enough for monitoring purposes */
+        mutex_lock(&cap->lock);
+        gpio_lkm_capture_rate(cap);
+        stats = cap->stats;
+        mutex_unlock(&cap->lock);
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            ret = -EFAULT;
+        break;
+
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+
+    return ret;
+}
+
+/*
+* gpio_lkm_capture_poll - Ring is readable when it has samples
+* which were not consumed yet
+*/
+static __poll_t gpio_lkm_capture_poll (struct file *filp, poll_table *wait)
+{
+    struct gpio_lkm_capture *cap = &gpio_lkm_cap;
+    __u32 used;
+
+    poll_wait(filp, &cap->wait, wait);
+
+    /* capture was never started */
+    if (!cap->nsamples)
+        return 0;
+
+    used = gpio_lkm_capture_used(cap, READ_ONCE(cap->head));
+    if (used >= cap->watermark || (!cap->running && used))
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_capture_mmap - Map ring buffer to user space
+* mapping is writable, as user space advances tail of ring.
+* driver never trusts anything else it finds in header page
+*/
+static int gpio_lkm_capture_mmap (struct file *filp, struct vm_area_struct *vma)
+{
+    struct gpio_lkm_capture *cap = &gpio_lkm_cap;
+
+    if (vma->vm_end - vma->vm_start > cap->size)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, cap->ring, vma->vm_pgoff);
+}
+
+/*
+* gpio_lkm_capture_create - Create /dev/gpio_lkm_la device
+* ring buffer is allocated once and lives as long as module,
+* so user space mappings stay valid across captures
+*/
+static int gpio_lkm_capture_create(void)
+{
+    struct gpio_lkm_capture *cap = &gpio_lkm_cap;
+    int ret;
+
+    /* header page and room for at least one sample */
+    cap->size = max(capture_pages, 2U) * PAGE_SIZE;
+    cap->ring = vmalloc_user(cap->size);
+    cap->descs = kcalloc(gpio_lkm_npins, sizeof(*cap->descs), GFP_KERNEL);
+    cap->values = bitmap_zalloc(gpio_lkm_npins, GFP_KERNEL);
+    if (!cap->ring || !cap->descs || !cap->values)
+    {
+        ret = -ENOMEM;
+        goto fail_ring;
+    }
+
+    mutex_init(&cap->lock);
+    init_waitqueue_head(&cap->wait);
+    hrtimer_init(&cap->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    cap->timer.function = gpio_lkm_capture_tick;
+
+    cdev_init(&cap->cdev, &gpio_lkm_capture_fops);
+    cap->cdev.owner = THIS_MODULE;
+
+    if ((ret = cdev_add(&cap->cdev, MKDEV(MAJOR(first), LA_MINOR), 1)))
+        goto fail_ring;
+
+    if (IS_ERR(device_create(gpio_lkm_class, NULL, MKDEV(MAJOR(first), LA_MINOR),
+                             NULL, DEVICE_NAME "_la")))
+    {
+        ret = -ENODEV;
+        goto fail_cdev;
+    }
+
+    return 0;
+
+fail_cdev:
+    cdev_del(&cap->cdev);
+fail_ring:
+    vfree(cap->ring);
+    kfree(cap->descs);
+    bitmap_free(cap->values);
+    cap->ring = NULL;
+    printk(KERN_ALERT "[GPIO_LKM] - Error %d creating capture device\n", ret);
+    return ret;
+}
+
+/*
+* gpio_lkm_capture_remove - Stop capture and destroy its device
+*/
+static void gpio_lkm_capture_remove(void)
+{
+    struct gpio_lkm_capture *cap = &gpio_lkm_cap;
+
+    mutex_lock(&cap->lock);
+    gpio_lkm_capture_stop(cap);
+    mutex_unlock(&cap->lock);
+
+    device_destroy(gpio_lkm_class, MKDEV(MAJOR(first), LA_MINOR));
+    cdev_del(&cap->cdev);
+    vfree(cap->ring);
+    kfree(cap->descs);
+    bitmap_free(cap->values);
+    cap->ring = NULL;
+}
+
+/*
+* gpio_lkm_count_create - Create edge counter device
+*/
+static int gpio_lkm_count_create(void)
+{
+    int ret;
+
+    cdev_init(&gpio_lkm_count_cdev, &gpio_lkm_count_fops);
+    gpio_lkm_count_cdev.owner = THIS_MODULE;
+
+    if ((ret = cdev_add(&gpio_lkm_count_cdev, MKDEV(MAJOR(first), COUNT_MINOR), 1)))
+        return ret;
+
+    if (IS_ERR(device_create(gpio_lkm_class, NULL, MKDEV(MAJOR(first), COUNT_MINOR),
+                             NULL, DEVICE_NAME "_count")))
+    {
+        cdev_del(&gpio_lkm_count_cdev);
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+/*
+* gpio_lkm_count_remove - Destroy edge counter device
+*/
+static void gpio_lkm_count_remove(void)
+{
+    device_destroy(gpio_lkm_class, MKDEV(MAJOR(first), COUNT_MINOR));
+    cdev_del(&gpio_lkm_count_cdev);
+}
+
+/*
+* gpio_lkm_ring_open - Open event device
+* file is not bound to any ring yet. interrupt handlers start
+* filling rings with the first open file
+*/
+static int gpio_lkm_ring_open (struct inode *inode, struct file *filp)
+{
+    /* ring of a bound file is kept in private data as cpu + 1 */
+    filp->private_data = NULL;
+    atomic_inc(&gpio_lkm_ring_users);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_ring_release - Close event device
+* records left in rings stay there for the next reader
+*/
+static int gpio_lkm_ring_release (struct inode *inode, struct file *filp)
+{
+    atomic_dec(&gpio_lkm_ring_users);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_ring_of - Ring an open file of event device is bound to
+*/
+static struct gpio_lkm_ring *gpio_lkm_ring_of(struct file *filp)
+{
+    unsigned long cpu = (unsigned long)READ_ONCE(filp->private_data);
+
+    return cpu ? per_cpu_ptr(gpio_lkm_rings, cpu - 1) : NULL;
+}
+
+/*
+* gpio_lkm_ring_read - Read edge records from ring of bound cpu
+* only whole records are returned. reader sleeps until at least
+* one record is available, unless file is non-blocking. readers
+* running on the cpu of the ring find records in local cache
+*/
+static ssize_t gpio_lkm_ring_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct gpio_lkm_ring *ring = gpio_lkm_ring_of(filp);
+    unsigned int copied;
+    int ret;
+
+    if (!ring || count < sizeof(struct gpio_lkm_event))
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&ring->read_lock))
+        return -ERESTARTSYS;
+
+    while (kfifo_is_empty(&ring->events))
+    {
+        mutex_unlock(&ring->read_lock);
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(ring->wait, !kfifo_is_empty(&ring->events)))
+            return -ERESTARTSYS;
+
+        if (mutex_lock_interruptible(&ring->read_lock))
+            return -ERESTARTSYS;
+    }
+
+    ret = kfifo_to_user(&ring->events, buf, count, &copied);
+    mutex_unlock(&ring->read_lock);
+
+    return ret ? ret : copied;
+}
+
+/*
+* gpio_lkm_ring_poll - Bound file is readable with records in its ring
+*/
+static __poll_t gpio_lkm_ring_poll (struct file *filp, poll_table *wait)
+{
+    struct gpio_lkm_ring *ring = gpio_lkm_ring_of(filp);
+
+    if (!ring)
+        return EPOLLERR;
+
+    poll_wait(filp, &ring->wait, wait);
+
+    if (!kfifo_is_empty(&ring->events))
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
+}
+
+/*
+* gpio_lkm_ring_ioctl - Bind file to ring and get ring counters
+*/
+static long gpio_lkm_ring_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_lkm_ring_stats st;
+    struct gpio_lkm_ring *ring;
+    unsigned int start;
+    __u32 cpu;
+
+    switch (cmd)
+    {
+    case GPIO_LKM_IOC_RING_BIND:
+        if (get_user(cpu, (__u32 __user *)arg))
+            return -EFAULT;
+        if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+            return -EINVAL;
+        WRITE_ONCE(filp->private_data, (void *)(unsigned long)(cpu + 1));
+        return 0;
+
+    case GPIO_LKM_IOC_RING_STATS:
+        if (copy_from_user(&st, (void __user *)arg, sizeof(st)))
+            return -EFAULT;
+        if (st.cpu >= nr_cpu_ids || !cpu_possible(st.cpu))
+            return -EINVAL;
+        ring = per_cpu_ptr(gpio_lkm_rings, st.cpu);
+        do
+        {
+            start = u64_stats_fetch_begin(&ring->syncp);
+            st.queued = ring->queued;
+            st.dropped = ring->dropped;
+        } while (u64_stats_fetch_retry(&ring->syncp, start));
+        st.depth = kfifo_len(&ring->events);
+        if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+* gpio_lkm_ring_create - Allocate per cpu rings and create event device
+* rings of all possible cpus are allocated, so a cpu coming
+* online later has its ring ready
+*/
+static int gpio_lkm_ring_create(void)
+{
+    struct gpio_lkm_ring *ring;
+    int ret, cpu;
+
+    gpio_lkm_rings = alloc_percpu(struct gpio_lkm_ring);
+    if (!gpio_lkm_rings)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu)
+    {
+        ring = per_cpu_ptr(gpio_lkm_rings, cpu);
+        mutex_init(&ring->read_lock);
+        init_waitqueue_head(&ring->wait);
+        u64_stats_init(&ring->syncp);
+        if ((ret = kfifo_alloc(&ring->events, event_ring, GFP_KERNEL)))
+            goto fail;
+    }
+
+    cdev_init(&gpio_lkm_ring_cdev, &gpio_lkm_ring_fops);
+    gpio_lkm_ring_cdev.owner = THIS_MODULE;
+
+    if ((ret = cdev_add(&gpio_lkm_ring_cdev, MKDEV(MAJOR(first), RING_MINOR), 1)))
+        goto fail;
+
+    if (IS_ERR(device_create(gpio_lkm_class, NULL, MKDEV(MAJOR(first), RING_MINOR),
+                             NULL, DEVICE_NAME "_events")))
+    {
+        cdev_del(&gpio_lkm_ring_cdev);
+        ret = -ENODEV;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    for_each_possible_cpu(cpu)
+        kfifo_free(&per_cpu_ptr(gpio_lkm_rings, cpu)->events);
+    free_percpu(gpio_lkm_rings);
+    gpio_lkm_rings = NULL;
+    return ret;
+}
+
+/*
+* gpio_lkm_ring_remove - Destroy event device and free rings
+* no file is open at unload, so handlers do not use rings any more
+*/
+static void gpio_lkm_ring_remove(void)
+{
+    int cpu;
+
+    device_destroy(gpio_lkm_class, MKDEV(MAJOR(first), RING_MINOR));
+    cdev_del(&gpio_lkm_ring_cdev);
+    for_each_possible_cpu(cpu)
+        kfifo_free(&per_cpu_ptr(gpio_lkm_rings, cpu)->events);
+    free_percpu(gpio_lkm_rings);
+    gpio_lkm_rings = NULL;
+}
+
+/*
+* gpio_lkm_keypad_create - Create keypad device
+* keypad is bound later by ioctl, device starts unbound
+*/
+static int gpio_lkm_keypad_create(void)
+{
+    struct gpio_lkm_keypad *kp = &gpio_lkm_keypad;
+    int ret;
+
+    mutex_init(&kp->mutex);
+    spin_lock_init(&kp->lock);
+    init_waitqueue_head(&kp->wait);
+    mutex_init(&kp->read_lock);
+    INIT_KFIFO(kp->events);
+
+    cdev_init(&kp->cdev, &gpio_lkm_keypad_fops);
+    kp->cdev.owner = THIS_MODULE;
+
+    if ((ret = cdev_add(&kp->cdev, MKDEV(MAJOR(first), KEYPAD_MINOR), 1)))
+        return ret;
+
+    if (IS_ERR(device_create(gpio_lkm_class, NULL, MKDEV(MAJOR(first), KEYPAD_MINOR),
+                             NULL, DEVICE_NAME "_keypad")))
+    {
+        cdev_del(&kp->cdev);
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+/*
+* gpio_lkm_keypad_remove - Unbind keypad and destroy its device
+*/
+static void gpio_lkm_keypad_remove(void)
+{
+    gpio_lkm_keypad_clear();
+    device_destroy(gpio_lkm_class, MKDEV(MAJOR(first), KEYPAD_MINOR));
+    cdev_del(&gpio_lkm_keypad.cdev);
+}
+
+/*
+* gpio_lkm_group_get - Create a group of managed pins
+* pins are switched to outputs with low level. returns
+* group or ERR_PTR() if some pin is not managed by this
+* driver, listed twice or belongs to a sleeping chip.
+* if switching some pin fails, pins switched before it
+* get their previous direction and level back
+*/
+struct gpio_lkm_group *gpio_lkm_group_get(const unsigned int *gpios, unsigned int npins)
+{
+    DECLARE_BITMAP(was_in, GPIO_LKM_BUS_MAX_PINS);
+    DECLARE_BITMAP(was_high, GPIO_LKM_BUS_MAX_PINS);
+    struct gpio_lkm_group *grp;
+    struct gpio_lkm_dev *dev;
+    unsigned int i, j;
+    int ret;
+
+    if (!npins || npins > GPIO_LKM_BUS_MAX_PINS)
+        return ERR_PTR(-EINVAL);
+
+    grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+    if (!grp)
+        return ERR_PTR(-ENOMEM);
+
+    for (i = 0; i < npins; i++)
+    {
+        dev = gpio_lkm_bind_pin(gpios[i]);
+        if (!dev)
+        {
+            ret = -ENODEV;
+            goto fail;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if (grp->pins[j] == dev)
+            {
+                ret = -EINVAL;
+                goto fail;
+            }
+        }
+        grp->pins[i] = dev;
+        grp->descs[i] = dev->desc;
+        if (dev->can_sleep)
+        {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+    grp->npins = npins;
+
+    for (i = 0; i < npins; i++)
+    {
+        dev = grp->pins[i];
+        __assign_bit(i, was_in, READ_ONCE(dev->dir) == in);
+        __assign_bit(i, was_high, READ_ONCE(dev->state) == high);
+        if ((ret = gpio_lkm_command(dev, set_out, 0)) ||
+            (ret = gpio_lkm_command(dev, set_low, 0)))
+            goto restore;
+    }
+
+    gpio_lkm_bind_done(grp->pins, npins, 0);
+    return grp;
+
+restore:
+    /* failed pin is included, it may have been switched
+     * to output before its level could be set
+     */
+    for (j = 0; j <= i; j++)
+    {
+        if (test_bit(j, was_in))
+            gpio_lkm_command(grp->pins[j], set_in, 0);
+        else if (test_bit(j, was_high))
+            gpio_lkm_command(grp->pins[j], set_high, 0);
+    }
+fail:
+    gpio_lkm_bind_done(grp->pins, npins, ret);
+    kfree(grp);
+    return ERR_PTR(ret);
+}
+EXPORT_SYMBOL(gpio_lkm_group_get);
+
+/*
+* gpio_lkm_group_set - Set levels of all pins of group at once
+* bit n of value drives pins[n]. fails with -EPERM if some pin
+* was switched to input by user space meanwhile. calls for one
+* group should be serialized by caller, may be called from timer
+*/
+int gpio_lkm_group_set(struct gpio_lkm_group *grp, u64 value)
+{
+    DECLARE_BITMAP(bits, GPIO_LKM_BUS_MAX_PINS);
+    struct gpio_lkm_dev *dev;
+    unsigned long flags;
+    enum state level;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < grp->npins; i++)
+    {
+        if (READ_ONCE(grp->pins[i]->dir) == in)
+            return -EPERM;
+    }
+
+    bitmap_from_u64(bits, value);
+    ret = gpiod_set_raw_array_value(grp->npins, grp->descs, NULL, bits);
+    if (ret)
+        return ret;
+
+    /* state page is updated only for pins which changed. cached
+     * state of the pin is compared, not last value of the group,
+     * as user space may write the pins between calls
+     */
+    for (i = 0; i < grp->npins; i++)
+    {
+        dev = grp->pins[i];
+        level = (value & (1ULL << i)) ? high : low;
+        spin_lock_irqsave(&dev->pin_lock, flags);
+        if (dev->dir == out && dev->state != level)
+        {
+            dev->state = level;
+            gpio_lkm_state_update(dev);
+        }
+        spin_unlock_irqrestore(&dev->pin_lock, flags);
+    }
+
+    return 0;
+}
+EXPORT_SYMBOL(gpio_lkm_group_set);
+
+/*
+* gpio_lkm_group_put - Release pin group
+* pins stay outputs with their last levels
+*/
+void gpio_lkm_group_put(struct gpio_lkm_group *grp)
+{
+    kfree(grp);
+}
+EXPORT_SYMBOL(gpio_lkm_group_put);
+
+/*
+* gpio_lkm_count_sum - Sum up per cpu edge counters of a pin
+* cost grows with number of possible cpus, but nothing is
+* written, so readers do not bounce cache lines of handler
+*/
+static void gpio_lkm_count_sum(struct gpio_lkm_dev *dev, struct gpio_lkm_count *sum)
+{
+    struct gpio_lkm_pcpu_count *count;
+    u64 rising, falling;
+    unsigned int start;
+    int cpu;
+
+    sum->pin = dev->pin.gpio;
+    sum->rising = 0;
+    sum->falling = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        count = per_cpu_ptr(dev->count, cpu);
+        do
+        {
+            start = u64_stats_fetch_begin_irq(&count->syncp);
+            rising = count->rising;
+            falling = count->falling;
+        } while (u64_stats_fetch_retry_irq(&count->syncp, start));
+
+        sum->rising += rising;
+        sum->falling += falling;
+    }
+}
+
+/*
+* gpio_lkm_count_read - Read edge counters of one managed pin
+* may be called from any context. counters only grow, callers
+* interested in recent activity should keep previous values
+*/
+int gpio_lkm_count_read(unsigned int gpio, struct gpio_lkm_count *count)
+{
+    struct gpio_lkm_dev *dev = gpio_lkm_find_pin(gpio);
+
+    if (!dev)
+        return -ENODEV;
+
+    gpio_lkm_count_sum(dev, count);
+    return 0;
+}
+EXPORT_SYMBOL(gpio_lkm_count_read);
+
+/*
+* gpio_lkm_count_snapshot - Read edge counters of all managed pins
+* fills at most n records in order of pin table and returns
+* number of records filled. counts of each pin are consistent,
+* pins are read one after another
+*/
+unsigned int gpio_lkm_count_snapshot(struct gpio_lkm_count *counts, unsigned int n)
+{
+    unsigned int i;
+
+    n = min(n, gpio_lkm_npins);
+    for (i = 0; i < n; i++)
+        gpio_lkm_count_sum(gpio_lkm_devp[i], &counts[i]);
+
+    return n;
+}
+EXPORT_SYMBOL(gpio_lkm_count_snapshot);
+
+/*
+* gpio_lkm_counts_read - Read edge counters of all pins as text
+* each line is "gpio rising falling". counters are read again
+* on every call, so whole file should be read at once
+*/
+static ssize_t gpio_lkm_counts_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    size_t size = gpio_lkm_npins * GPIO_LKM_COUNT_LINE;
+    struct gpio_lkm_count c;
+    size_t len = 0;
+    unsigned int i;
+    ssize_t ret;
+    char *text;
+
+    text = kmalloc(size + 1, GFP_KERNEL);
+    if (!text)
+        return -ENOMEM;
+
+    for (i = 0; i < gpio_lkm_npins; i++)
+    {
+        gpio_lkm_count_sum(gpio_lkm_devp[i], &c);
+        len += scnprintf(text + len, size + 1 - len, "%u %llu %llu\n", c.pin,
+                         (unsigned long long)c.rising, (unsigned long long)c.falling);
+    }
+
+    ret = simple_read_from_buffer(buf, count, f_pos, text, len);
+    kfree(text);
+    return ret;
+}
+
+/*
+* gpio_lkm_match_chip - Match gpiochip by its label
+*/
+static int gpio_lkm_match_chip(struct gpio_chip *gc, void *data)
+{
+    return gc->label && !strcmp(gc->label, data);
+}
+
+/*
+* gpio_lkm_table_init - Resolve table of pins to manage
+* pins come from module parameters, device tree or defaults,
+* in this order. lines of named chip are translated into global
+* GPIO numbers, so the rest of driver deals with numbers only
+*/
+static int gpio_lkm_table_init(void)
+{
+    const unsigned int *src = pins;
+    const char *label = chip;
+    struct device_node *np = NULL;
+    struct gpio_chip *gc = NULL;
+    unsigned int n = pins_num;
+    unsigned int i, j;
+    int ret = 0;
+
+    if (!n && !label)
+    {
+        /* no parameters, look for a node describing the table
+         */
+        np = of_find_compatible_node(NULL, NULL, "romanjoe,gpio-lkm");
+        if (np)
+        {
+            ret = of_property_count_u32_elems(np, "pins");
+            if (ret > GPIO_LKM_MAX_PINS)
+                ret = -E2BIG;
+            if (ret > 0)
+                ret = of_property_read_u32_array(np, "pins", pins, ret) ?: ret;
+            if (ret < 0 && ret != -EINVAL)
+            {
+                printk(KERN_ALERT "[GPIO_LKM] - Bad pins property %d\n", ret);
+                of_node_put(np);
+                return ret;
+            }
+            n = max(ret, 0);
+            of_property_read_string(np, "chip-label", &label);
+            ret = 0;
+        }
+        if (!n && !label)
+        {
+            src = gpio_lkm_default_pins;
+            n = ARRAY_SIZE(gpio_lkm_default_pins);
+        }
+    }
+
+    if (label)
+    {
+        gc = gpiochip_find((void *)label, gpio_lkm_match_chip);
+        if (!gc)
+        {
+            printk(KERN_ALERT "[GPIO_LKM] - No gpiochip %s\n", label);
+            ret = -ENODEV;
+            goto out;
+        }
+        /* take all lines of chip if offsets were not given
+         */
+        if (!n)
+        {
+            n = min_t(unsigned int, gc->ngpio, GPIO_LKM_MAX_PINS);
+            for (i = 0; i < n; i++)
+                pins[i] = i;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned int gpio = src[i];
+
+        if (gc)
+        {
+            if (gpio >= gc->ngpio)
+            {
+                printk(KERN_ALERT "[GPIO_LKM] - Line %u is out of %s\n", gpio, label);
+                ret = -EINVAL;
+                goto out;
+            }
+            gpio += gc->base;
+        }
+        if (!gpio_is_valid(gpio))
+        {
+            printk(KERN_ALERT "[GPIO_LKM] - Invalid GPIO %u\n", gpio);
+            ret = -EINVAL;
+            goto out;
+        }
+        /* table is small and checked once, quadratic scan is fine
+         */
+        for (j = 0; j < i; j++)
+        {
+            if (gpio_lkm_table[j] == gpio)
+            {
+                printk(KERN_ALERT "[GPIO_LKM] - GPIO %u listed twice\n", gpio);
+                ret = -EINVAL;
+                goto out;
+            }
+        }
+        gpio_lkm_table[i] = gpio;
+    }
+    gpio_lkm_npins = n;
+
+out:
+    of_node_put(np);
+    return ret;
+}
+
+/*
+* debounce_ns_show - sysfs attributes of pin devices
+* they live in /sys/class/gpio_lkm/GPIOn/ and give access to
+* debounce settings and counters of the pin
+*/
+static ssize_t debounce_ns_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+
+    return sprintf(buf, "%llu\n", (unsigned long long)READ_ONCE(dev->debounce_ns));
+}
+
+static ssize_t debounce_ns_store(struct device *d, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    u64 window_ns;
+    int ret;
+
+    if ((ret = kstrtou64(buf, 0, &window_ns)))
+        return ret;
+
+    ret = gpio_lkm_debounce_set(dev, window_ns, READ_ONCE(dev->debounce_samples));
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(debounce_ns);
+
+static ssize_t debounce_samples_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+
+    return sprintf(buf, "%u\n", READ_ONCE(dev->debounce_samples));
+}
+
+static ssize_t debounce_samples_store(struct device *d, struct device_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    unsigned int samples;
+    int ret;
+
+    if ((ret = kstrtouint(buf, 0, &samples)))
+        return ret;
+
+    ret = gpio_lkm_debounce_set(dev, READ_ONCE(dev->debounce_ns), samples);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(debounce_samples);
+
+static ssize_t debounce_accepted_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    unsigned long flags;
+    u64 val;
+
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    val = dev->debounce_accepted;
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
+
+    return sprintf(buf, "%llu\n", (unsigned long long)val);
+}
+static DEVICE_ATTR_RO(debounce_accepted);
+
+static ssize_t debounce_rejected_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    unsigned long flags;
+    u64 val;
 
-    kbuf[len] = '\0';
+    spin_lock_irqsave(&dev->pin_lock, flags);
+    val = dev->debounce_rejected;
+    spin_unlock_irqrestore(&dev->pin_lock, flags);
 
-    printk(KERN_INFO "[GPIO_LKM] - Got request from user: %s\n", kbuf);
+    return sprintf(buf, "%llu\n", (unsigned long long)val);
+}
+static DEVICE_ATTR_RO(debounce_rejected);
 
-    /* perform a switch on recieved command value
-     * to determine, what request is received
-     */
-    switch(which_command(kbuf))
-    {
-    case set_in:
+static struct attribute *gpio_lkm_pin_attrs[] =
+{
+    &dev_attr_debounce_ns.attr,
+    &dev_attr_debounce_samples.attr,
+    &dev_attr_debounce_accepted.attr,
+    &dev_attr_debounce_rejected.attr,
+    NULL,
+};
+
+static const struct attribute_group gpio_lkm_pin_group =
+{
+    .attrs = gpio_lkm_pin_attrs,
+};
+
+/*
+* measure_enable_show - sysfs attributes of measurement
+* they are grouped in /sys/class/gpio_lkm/GPIOn/measure/, one
+* file per field of struct gpio_lkm_measure
+*/
+static ssize_t measure_enable_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+
+    return sprintf(buf, "%d\n", READ_ONCE(dev->measure));
+}
+
+static ssize_t measure_enable_store(struct device *d, struct device_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    bool enable;
+    int ret;
+
+    if ((ret = kstrtobool(buf, &enable)))
+        return ret;
+
+    ret = gpio_lkm_measure_set(dev, enable);
+    return ret ? ret : count;
+}
+
+/* value attributes share one show method, they know
+ * offset of their field in struct gpio_lkm_measure
+ */
+struct gpio_lkm_measure_attr
+{
+    struct device_attribute attr;
+    size_t offset;
+};
+
+static ssize_t gpio_lkm_measure_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_measure_attr *mattr = container_of(attr, struct gpio_lkm_measure_attr, attr);
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    struct gpio_lkm_measure m;
+
+    gpio_lkm_measure_get(dev, &m);
+
+    return sprintf(buf, "%llu\n", (unsigned long long)*(__u64 *)((char *)&m + mattr->offset));
+}
+
+#define GPIO_LKM_MEASURE_ATTR(_name, _field)                                    \
+    static struct gpio_lkm_measure_attr measure_attr_##_name =                  \
+    {                                                                           \
+        .attr = __ATTR(_name, 0444, gpio_lkm_measure_show, NULL),               \
+        .offset = offsetof(struct gpio_lkm_measure, _field),                    \
+    }
+
+static struct device_attribute measure_attr_enable =
+    __ATTR(enable, 0644, measure_enable_show, measure_enable_store);
+GPIO_LKM_MEASURE_ATTR(edges, edges);
+GPIO_LKM_MEASURE_ATTR(periods, periods);
+GPIO_LKM_MEASURE_ATTR(last_edge_ns, last_edge_ns);
+GPIO_LKM_MEASURE_ATTR(period_ns, period_ns.ewma);
+GPIO_LKM_MEASURE_ATTR(period_last_ns, period_ns.last);
+GPIO_LKM_MEASURE_ATTR(period_min_ns, period_ns.min);
+GPIO_LKM_MEASURE_ATTR(period_max_ns, period_ns.max);
+GPIO_LKM_MEASURE_ATTR(high_ns, high_ns.ewma);
+GPIO_LKM_MEASURE_ATTR(high_last_ns, high_ns.last);
+GPIO_LKM_MEASURE_ATTR(high_min_ns, high_ns.min);
+GPIO_LKM_MEASURE_ATTR(high_max_ns, high_ns.max);
+GPIO_LKM_MEASURE_ATTR(duty_ppm, duty_ppm.ewma);
+GPIO_LKM_MEASURE_ATTR(duty_last_ppm, duty_ppm.last);
+GPIO_LKM_MEASURE_ATTR(duty_min_ppm, duty_ppm.min);
+GPIO_LKM_MEASURE_ATTR(duty_max_ppm, duty_ppm.max);
+GPIO_LKM_MEASURE_ATTR(freq_mhz, freq_mhz.ewma);
+GPIO_LKM_MEASURE_ATTR(freq_last_mhz, freq_mhz.last);
+GPIO_LKM_MEASURE_ATTR(freq_min_mhz, freq_mhz.min);
+GPIO_LKM_MEASURE_ATTR(freq_max_mhz, freq_mhz.max);
+
+static struct attribute *gpio_lkm_measure_attrs[] =
+{
+    &measure_attr_enable.attr,
+    &measure_attr_edges.attr.attr,
+    &measure_attr_periods.attr.attr,
+    &measure_attr_last_edge_ns.attr.attr,
+    &measure_attr_period_ns.attr.attr,
+    &measure_attr_period_last_ns.attr.attr,
+    &measure_attr_period_min_ns.attr.attr,
+    &measure_attr_period_max_ns.attr.attr,
+    &measure_attr_high_ns.attr.attr,
+    &measure_attr_high_last_ns.attr.attr,
+    &measure_attr_high_min_ns.attr.attr,
+    &measure_attr_high_max_ns.attr.attr,
+    &measure_attr_duty_ppm.attr.attr,
+    &measure_attr_duty_last_ppm.attr.attr,
+    &measure_attr_duty_min_ppm.attr.attr,
+    &measure_attr_duty_max_ppm.attr.attr,
+    &measure_attr_freq_mhz.attr.attr,
+    &measure_attr_freq_last_mhz.attr.attr,
+    &measure_attr_freq_min_mhz.attr.attr,
+    &measure_attr_freq_max_mhz.attr.attr,
+    NULL,
+};
+
+static const struct attribute_group gpio_lkm_measure_group =
+{
+    .name = "measure",
+    .attrs = gpio_lkm_measure_attrs,
+};
+
+/*
+* coalesce_hz_show - sysfs attributes of event coalescing
+* they are grouped in /sys/class/gpio_lkm/GPIOn/coalesce/
+*/
+static ssize_t coalesce_hz_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+
+    return sprintf(buf, "%u\n", READ_ONCE(dev->coalesce_hz));
+}
+
+static ssize_t coalesce_hz_store(struct device *d, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    unsigned int hz;
+    int ret;
+
+    if ((ret = kstrtouint(buf, 0, &hz)))
+        return ret;
+
+    ret = gpio_lkm_coalesce_set(dev, hz, READ_ONCE(dev->coalesce_ns));
+    return ret ? ret : count;
+}
+
+static ssize_t coalesce_interval_us_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+
+    return sprintf(buf, "%llu\n", (unsigned long long)div_u64(READ_ONCE(dev->coalesce_ns), NSEC_PER_USEC));
+}
+
+static ssize_t coalesce_interval_us_store(struct device *d, struct device_attribute *attr,
+                                          const char *buf, size_t count)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    u64 us;
+    int ret;
+
+    if ((ret = kstrtou64(buf, 0, &us)))
+        return ret;
+    if (us > div_u64(GPIO_LKM_COALESCE_MAX_NS, NSEC_PER_USEC))
+        return -EINVAL;
+
+    ret = gpio_lkm_coalesce_set(dev, READ_ONCE(dev->coalesce_hz), us * NSEC_PER_USEC);
+    return ret ? ret : count;
+}
+
+static ssize_t coalesce_mode_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+
+    return sprintf(buf, "%s\n", READ_ONCE(dev->coalesced) ? "batch" : "edge");
+}
+
+static ssize_t coalesce_switches_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpio_lkm_dev *dev = dev_get_drvdata(d);
+    unsigned long flags;
+    u64 val;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    val = dev->coalesce_switches;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    return sprintf(buf, "%llu\n", (unsigned long long)val);
+}
+
+static struct device_attribute coalesce_attr_hz =
+    __ATTR(hz, 0644, coalesce_hz_show, coalesce_hz_store);
+static struct device_attribute coalesce_attr_interval_us =
+    __ATTR(interval_us, 0644, coalesce_interval_us_show, coalesce_interval_us_store);
+static struct device_attribute coalesce_attr_mode =
+    __ATTR(mode, 0444, coalesce_mode_show, NULL);
+static struct device_attribute coalesce_attr_switches =
+    __ATTR(switches, 0444, coalesce_switches_show, NULL);
+
+static struct attribute *gpio_lkm_coalesce_attrs[] =
+{
+    &coalesce_attr_hz.attr,
+    &coalesce_attr_interval_us.attr,
+    &coalesce_attr_mode.attr,
+    &coalesce_attr_switches.attr,
+    NULL,
+};
+
+static const struct attribute_group gpio_lkm_coalesce_group =
+{
+    .name = "coalesce",
+    .attrs = gpio_lkm_coalesce_attrs,
+};
+
+static const struct attribute_group *gpio_lkm_pin_groups[] =
+{
+    &gpio_lkm_pin_group,
+    &gpio_lkm_measure_group,
+    &gpio_lkm_coalesce_group,
+    NULL,
+};
+
+/*
+* gpio_lkm_bank_affinity - Move worker of a bank to cpu set for it
+* called with gpio_lkm_bank_lock held
+*/
+static void gpio_lkm_bank_affinity(unsigned int bank)
+{
+    struct kthread_worker *worker = gpio_lkm_bank_worker[bank];
+    int cpu = bank_cpu[bank];
+    int ret;
+
+    if (!worker)
+        return;
+
+    if (cpu < 0)
+        ret = set_cpus_allowed_ptr(worker->task, cpu_possible_mask);
+    else
+        ret = set_cpus_allowed_ptr(worker->task, cpumask_of(cpu));
+    if (ret)
+        printk(KERN_WARNING "[GPIO_LKM] - Cannot move worker of bank %u to cpu %d\n", bank, cpu);
+}
+
+/*
+* gpio_lkm_bank_cpu_set - Store and apply bank_cpu
+* values are checked against cpus online now, a write naming
+* other cpu is refused and leaves previous values in place.
+* workers which exist are moved right away, others are moved
+* when they are created
+*/
+static int gpio_lkm_bank_cpu_set(const char *val, const struct kernel_param *kp)
+{
+    int old[GPIO_LKM_BANK_NUM];
+    unsigned int old_num, i;
+    int ret;
+
+    mutex_lock(&gpio_lkm_bank_lock);
+    memcpy(old, bank_cpu, sizeof(old));
+    old_num = bank_cpu_num;
+
+    if ((ret = param_array_ops.set(val, kp)))
+        goto out;
+
+    for (i = 0; i < GPIO_LKM_BANK_NUM; i++)
     {
-        if (gpio_lkm_devp->dir != in)
+        if (bank_cpu[i] < -1 || (bank_cpu[i] >= 0 &&
+            (bank_cpu[i] >= nr_cpu_ids || !cpu_online(bank_cpu[i]))))
         {
-            printk(KERN_INFO "[GPIO_LKM] - Set GPIO%d direction: input\n", gpio);
-            /* set direction input */
-            gpio_direction_input(gpio);
-            /* store state in device struct */
-            gpio_lkm_devp->dir = in;
+            memcpy(bank_cpu, old, sizeof(old));
+            bank_cpu_num = old_num;
+            ret = -EINVAL;
+            goto out;
         }
-        break;
     }
-    case set_out:
+
+    for (i = 0; i < GPIO_LKM_BANK_NUM; i++)
+        gpio_lkm_bank_affinity(i);
+
+out:
+    mutex_unlock(&gpio_lkm_bank_lock);
+    return ret;
+}
+
+/*
+* gpio_lkm_bank_cpu_get - Show bank_cpu
+*/
+static int gpio_lkm_bank_cpu_get(char *buffer, const struct kernel_param *kp)
+{
+    int ret;
+
+    mutex_lock(&gpio_lkm_bank_lock);
+    ret = param_array_ops.get(buffer, kp);
+    mutex_unlock(&gpio_lkm_bank_lock);
+
+    return ret;
+}
+
+/*
+* gpio_lkm_banks_remove - Destroy workers of threaded mode
+* called when no pin has its interrupt any more
+*/
+static void gpio_lkm_banks_remove(void)
+{
+    unsigned int i;
+
+    mutex_lock(&gpio_lkm_bank_lock);
+    for (i = 0; i < GPIO_LKM_BANK_NUM; i++)
     {
-        if (gpio_lkm_devp->dir != out)
-        {
-            printk(KERN_INFO " Set GPIO%d direction: ouput\n", gpio);
-            /* set direction output and low level */
-            gpio_direction_output(gpio, low);
-            /* store state in device struct */
-            gpio_lkm_devp->dir = out;
-            gpio_lkm_devp->state = low;
-        }
-        break;
+        if (gpio_lkm_bank_worker[i])
+            kthread_destroy_worker(gpio_lkm_bank_worker[i]);
+        gpio_lkm_bank_worker[i] = NULL;
     }
-    case set_high:
+    mutex_unlock(&gpio_lkm_bank_lock);
+}
+
+/*
+* gpio_lkm_banks_create - Start workers of threaded mode
+* workers run with realtime priority of interrupt threads
+*/
+static int gpio_lkm_banks_create(void)
+{
+    struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
+    struct kthread_worker *worker;
+    unsigned int i;
+
+    if (!threaded)
+        return 0;
+
+    mutex_lock(&gpio_lkm_bank_lock);
+    for (i = 0; i < GPIO_LKM_BANK_NUM; i++)
     {
-        if (gpio_lkm_devp->dir == in) 
-        {
-            printk("[GPIO_LKM] - Cannot set GPIO %d, direction: input\n", gpio);
-            return -EPERM;
-        }
-        else
+        worker = kthread_create_worker(0, "gpio_lkm/%u", i);
+        if (IS_ERR(worker))
         {
-            printk("[GPIO_LKM] - got to set_high\n");
-            gpio_set_value(gpio, high);
-            gpio_lkm_devp->state = high;
+            mutex_unlock(&gpio_lkm_bank_lock);
+            gpio_lkm_banks_remove();
+            return PTR_ERR(worker);
         }
-        break;
+        sched_setscheduler_nocheck(worker->task, SCHED_FIFO, &param);
+        gpio_lkm_bank_worker[i] = worker;
+        gpio_lkm_bank_affinity(i);
     }
-    case set_low:
-        if (gpio_lkm_devp->dir == in) 
-        {
-            printk("[GPIO_LKM] - Cannot set GPIO %d, direction: input\n", gpio);
-            return -EPERM;
-        }
-        else
-        {
-            gpio_set_value(gpio, low);
-            gpio_lkm_devp->state = low;
-        }
-        break;
-    default:
-            printk(KERN_ERR "[GPIO_LKM] - Invalid input value\n");
-            return -EINVAL;
-        break;
+    mutex_unlock(&gpio_lkm_bank_lock);
+
+    return 0;
+}
+
+/*
+* gpio_lkm_pin_create - Request a pin and create its device
+* in lazy mode only the device is created, pin is requested
+* when it is used
+* @index: position of pin in table, defines its minor number
+*/
+static int gpio_lkm_pin_create(unsigned int index)
+{
+    unsigned int gpio = gpio_lkm_table[index];
+    struct gpio_lkm_dev *dev;
+    dev_t devt = MKDEV(MAJOR(first), MINOR(first) + PIN_MINOR_BASE + index);
+    int ret, cpu;
 
+    /* allocate memory for sctucture to contain GPIO representation
+     */
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+    {
+        printk(KERN_DEBUG "[GPIO_LKM]Bad kmalloc\n");
+        return -ENOMEM;
     }
 
-    *f_pos += count;
-    return count;
+    /* store data in device scturture to reference somewhere in module
+     */
+    dev->pin.gpio = gpio;
+    dev->pin.flags = GPIOF_OUT_INIT_LOW;
+    dev->pin.label = NULL;
+    INIT_LIST_HEAD(&dev->chip_node);
+    INIT_DELAYED_WORK(&dev->idle_work, gpio_lkm_pin_idle);
+    kthread_init_work(&dev->edge_work, gpio_lkm_irq_work);
+    dev->dir = out;
+    dev->state = low;
+    dev->index = index;
+    dev->irq = -1;
+    spin_lock_init(&dev->pin_lock);
+    mutex_init(&dev->dir_lock);
+    /* debounce is off until window is written to sysfs */
+    dev->debounce_samples = GPIO_LKM_DEBOUNCE_DEFAULT_SAMPLES;
+    hrtimer_init(&dev->debounce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->debounce_timer.function = gpio_lkm_debounce_tick;
+    spin_lock_init(&dev->lock);
+    INIT_LIST_HEAD(&dev->readers);
+    dev->seq = 0;
+    /* coalescing is off until threshold is written to sysfs */
+    gpio_lkm_coalesce_set(dev, 0, GPIO_LKM_COALESCE_NS);
+    hrtimer_init(&dev->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->coalesce_timer.function = gpio_lkm_coalesce_tick;
+    gpio_lkm_wave_init(&dev->wave);
+
+    if (!lazy)
+    {
+        if ((ret = gpio_lkm_pin_request(dev)))
+            goto fail_request;
+        dev->sticky = true;
+    }
+
+    dev->count = alloc_percpu(struct gpio_lkm_pcpu_count);
+    if (!dev->count)
+    {
+        ret = -ENOMEM;
+        goto fail_count;
+    }
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(dev->count, cpu)->syncp);
+
+    if ((ret = xa_err(xa_store(&gpio_lkm_pin_map, gpio, dev, GFP_KERNEL))))
+        goto fail_map;
+    gpio_lkm_devp[index] = dev;
+
+    /* describe pin in state page shared with user space
+     */
+    gpio_lkm_state->gpio[index] = gpio;
+    gpio_lkm_state->npins = index + 1;
+    gpio_lkm_state_update(dev);
+
+    /* itialize cdev structure for our device and match it
+     * with file_operations defined for it
+     */
+    cdev_init(&dev->cdev, &gpio_lkm_fops);
+    /* owner should be set after cdev_init(), which clears the
+     * structure. it keeps module loaded while files are open
+     */
+    dev->cdev.owner = THIS_MODULE;
+
+    /* try to register a char device to the system
+     * all these cdev functions are implemented in fs/char_dev.c
+     */
+    if ((ret = cdev_add(&dev->cdev, devt, 1)))
+    {
+        printk(KERN_ALERT "[GPIO_LKM] - Error %d adding cdev\n", ret);
+        goto fail_cdev;
+    }
+
+    /* creates a device and registers it with sysfs
+     * all parameters passed shoud be familiar to this point
+     * more info - drivers/base/core.c:2672
+     */
+    if (IS_ERR(device_create_with_groups(gpio_lkm_class, NULL, devt, dev,
+                                         gpio_lkm_pin_groups, "GPIO%u", gpio)))
+    {
+        ret = -ENODEV;
+        goto fail_device;
+    }
+
+    return 0;
+
+fail_device:
+    cdev_del(&dev->cdev);
+fail_cdev:
+    gpio_lkm_devp[index] = NULL;
+    xa_erase(&gpio_lkm_pin_map, gpio);
+fail_map:
+    free_percpu(dev->count);
+fail_count:
+    gpio_lkm_pin_free(dev);
+fail_request:
+    kfree(dev);
+    return ret;
+}
+
+/*
+* gpio_lkm_pin_remove - Destroy pin device and release the pin
+* pin is left as output with low level
+*/
+static void gpio_lkm_pin_remove(struct gpio_lkm_dev *dev)
+{
+    unsigned int gpio = dev->pin.gpio;
+
+    /* idle timer of lazy pin refers to device structure
+     * freed below
+     */
+    cancel_delayed_work_sync(&dev->idle_work);
+
+    device_destroy(gpio_lkm_class,
+                   MKDEV(MAJOR(first), MINOR(first) + PIN_MINOR_BASE + dev->index));
+    cdev_del(&dev->cdev);
+
+    /* stop edge interrupts and waveform and give the pin
+     * back as output with low level
+     */
+    gpio_lkm_pin_free(dev);
+
+    gpio_lkm_devp[dev->index] = NULL;
+    xa_erase(&gpio_lkm_pin_map, gpio);
+    free_percpu(dev->count);
+    kfree(dev);
+}
+
+/*
+* gpio_lkm_pins_remove - Remove all pin devices which were created
+*/
+static void gpio_lkm_pins_remove(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < gpio_lkm_npins; i++)
+    {
+        if (gpio_lkm_devp[i])
+            gpio_lkm_pin_remove(gpio_lkm_devp[i]);
+    }
+    kfree(gpio_lkm_devp);
+    gpio_lkm_devp = NULL;
 }
 
 /*
@@ -321,6 +7541,7 @@ static ssize_t gpio_lkm_write ( struct file *filp, const char *buf, size_t count
 * modprobe or insmod it should implement all the
 * needed actions to prepare device to work
 * here is a list:
+* - resolve table of pins to manage
 * - dynamically register a character device major
 * - create "GPIO" class in /sysfs
 * - allocates resource for GPIO device
@@ -330,129 +7551,114 @@ static ssize_t gpio_lkm_write ( struct file *filp, const char *buf, size_t count
 */
 static int __init gpio_lkm_init(void)
 {
-    int i, ret, index = 0;
+    unsigned int i;
+    int ret;
+
+    if ((ret = gpio_lkm_table_init()))
+        return ret;
+
+    gpio_lkm_devp = kcalloc(gpio_lkm_npins, sizeof(*gpio_lkm_devp), GFP_KERNEL);
+    if (!gpio_lkm_devp && gpio_lkm_npins)
+        return -ENOMEM;
 
     /* register a range of char GPIO device numbers
-     * here we request to allocate certain minor numbers
-     * to correspondent GPIO devices pin numbers
+     * here we request to allocate minor numbers for
+     * special devices followed by one for each pin
      * more info in fs/char_dev.c:245
      */
-    if (alloc_chrdev_region(&first, 0, USE_GPIOS_NUM, DEVICE_NAME) < 0)
+    if ((ret = alloc_chrdev_region(&first, 0, GPIO_LKM_MINORS, DEVICE_NAME)) < 0)
     {
         printk(KERN_DEBUG "Cannot register device\n");
-        return -1;
+        goto fail_region;
     }
 
     /* call create_class to create a udev class to contain the device
      * folder in also created in /sys/class for this module with name
      * defined in DEVICE_NAME
      */
-    if ((gpio_lkm_class = class_create( THIS_MODULE, DEVICE_NAME)) == NULL)
+    gpio_lkm_class = class_create(THIS_MODULE, DEVICE_NAME);
+    if (IS_ERR(gpio_lkm_class))
     {
         printk(KERN_DEBUG "Cannot create class %s\n", DEVICE_NAME);
-        /* clean up what was done in case of faulure
-         */
-        unregister_chrdev_region(first, USE_GPIOS_NUM);
-
-        return -EINVAL;
+        ret = PTR_ERR(gpio_lkm_class);
+        goto fail_class;
     }
 
-    for (i = 0; i <= MAX_GPIO_NUMBER; i++)
-    {
-        if ( i == 4 || i == 17 || i == 18 || i == 27 ||
-            i == 22 || i == 23 || i == 24 || i == 25 ||
-            i == 5 || i == 6 || i == 13 || i == 12 || 
-            i == 16 || i == 26)
-        {
-            /* allocate memory for sctuctures to contain each GPIO representation
-            */
-            gpio_lkm_devp[index] = kmalloc(sizeof(struct gpio_lkm_dev), GFP_KERNEL);
+    /* create bus devices, they get pins assigned later by
+     * user space, so it is safe to do before pins are set up
+     */
+    if ((ret = gpio_lkm_buses_create()))
+        goto fail_buses;
 
-            if (!gpio_lkm_devp[index])
-            {
-                printk(KERN_DEBUG "[GPIO_LKM]Bad kmalloc\n");
-                return -ENOMEM;
-            }
+    /* create control device and state page before pins,
+     * as pins publish their state there right away
+     */
+    if ((ret = gpio_lkm_ctl_create()))
+        goto fail_ctl;
 
-            /* call kernel gpio API to request one gpio, pass config flags
-             * here gpio requested will support In Out directions and initialized
-             * with low level
-             */
-            if (gpio_request_one(i, GPIOF_OUT_INIT_LOW, NULL) < 0)
-            {
-                printk(KERN_ALERT "[GPIO_LKM] - Error requesting GPIO %d\n", i);
-                return -ENODEV;
-            }
+    /* capture device finds pins to sample only when it starts
+     */
+    if ((ret = gpio_lkm_capture_create()))
+        goto fail_capture;
 
-            /* store data in device scturture to reference somewhere in module
-            */
-            gpio_lkm_devp[index]->dir = out;
-            gpio_lkm_devp[index]->state = low;
-            gpio_lkm_devp[index]->cdev.owner = THIS_MODULE;
+    if ((ret = gpio_lkm_count_create()))
+        goto fail_count;
 
-            /* itialize cdev structure for our device and match it
-             * with file_operations defined for it
-             */
-            cdev_init(&gpio_lkm_devp[index]->cdev, &gpio_lkm_fops);
+    if ((ret = gpio_lkm_keypad_create()))
+        goto fail_keypad;
 
-            /* try to register a char device to the system 
-             * all these cdev functions are implemented in fs/char_dev.c
-             */
-            if ((ret = cdev_add( &gpio_lkm_devp[index]->cdev, (first + i), 1)))
-            {
-                printk (KERN_ALERT "[GPIO_LKM] - Error %d adding cdev\n", ret);
-
-                for (i = 0; i <= MAX_GPIO_NUMBER; i++)
-                {
-                        if ( i == 4 || i == 17 || i == 18 || i == 27 ||
-                            i == 22 || i == 23 || i == 24 || i == 25 ||
-                            i == 5 || i == 6 || i == 13 || i == 12 || 
-                            i == 16 || i == 26)
-                        {
-                            /* clean up on failure execution
-                             *
-                             */
-                            device_destroy (gpio_lkm_class,
-                            MKDEV(MAJOR(first),
-                            MINOR(first) + i));
-                        }
-
-                }
-                
-                /* clean up in opposite way from init
-                 */
-                class_destroy(gpio_lkm_class);
-                unregister_chrdev_region(first, USE_GPIOS_NUM);
-                return ret;
-            }
+    if ((ret = gpio_lkm_ring_create()))
+        goto fail_ring;
 
-            /* creates a device and registers it with sysfs
-             * all parameters passed shoud be familiar to this point
-             * more info - drivers/base/core.c:2672
-             */
-            if (device_create( gpio_lkm_class,
-                                NULL, MKDEV(MAJOR(first),
-                                MINOR(first)+i),
-                                NULL,
-                                "GPIO%d",
-                                i) == NULL)
-            {
-            
-                /* do not forget to clean in case of errors
-                 */
-                class_destroy(gpio_lkm_class);
-                unregister_chrdev_region(first, USE_GPIOS_NUM);
-            
-                return -1;
-            }
+    if ((ret = gpio_lkm_banks_create()))
+        goto fail_banks;
 
-            index++;
-        }
+    for (i = 0; i < gpio_lkm_npins; i++)
+    {
+        if ((ret = gpio_lkm_pin_create(i)))
+            goto fail_pins;
     }
 
-    printk("[GPIO_LKM] - Driver initialized\n");
-    
+    printk("[GPIO_LKM] - Driver initialized, %u pins\n", gpio_lkm_npins);
+
     return 0;
+
+    /* clean up in opposite way from init
+     */
+fail_pins:
+    gpio_lkm_ring_remove();
+    gpio_lkm_keypad_remove();
+    gpio_lkm_at_clear();
+    gpio_lkm_stepper_clear();
+    gpio_lkm_quad_clear();
+    gpio_lkm_reflex_clear();
+    gpio_lkm_count_remove();
+    gpio_lkm_capture_remove();
+    gpio_lkm_buses_remove();
+    gpio_lkm_pins_remove();
+    gpio_lkm_banks_remove();
+    gpio_lkm_ctl_remove();
+    goto fail_buses;
+fail_banks:
+    gpio_lkm_ring_remove();
+fail_ring:
+    gpio_lkm_keypad_remove();
+fail_keypad:
+    gpio_lkm_count_remove();
+fail_count:
+    gpio_lkm_capture_remove();
+fail_capture:
+    gpio_lkm_ctl_remove();
+fail_ctl:
+    gpio_lkm_buses_remove();
+fail_buses:
+    class_destroy(gpio_lkm_class);
+fail_class:
+    unregister_chrdev_region(first, GPIO_LKM_MINORS);
+fail_region:
+    kfree(gpio_lkm_devp);
+    gpio_lkm_devp = NULL;
+    return ret;
 }
 
 /*
@@ -462,42 +7668,51 @@ static int __init gpio_lkm_init(void)
 * initialization actions to deallocate resources
 * used by device, unregister it from system
 * here is a list:
-* - release major number
 * - release device nodes in /dev
-* - release per-device structure arrays
-* - detroy class in /sys
 * - set all GPIO pins to output, low level
+* - release per-device structures
+* - detroy class in /sys
+* - release major number
 */
 
 static void __exit gpio_lkm_exit(void)
 {
-    int i = 0;
-
-    unregister_chrdev_region(first, USE_GPIOS_NUM);
-    for (i = 0; i < USE_GPIOS_NUM; i++)
-        /* free up memory used by device structures
-         */
-        kfree(gpio_lkm_devp[i]);
-
-    for (i = 0; i <= MAX_GPIO_NUMBER; i++)
-    {
-        if ( i == 4 || i == 17 || i == 18 || i == 27 ||
-            i == 22 || i == 23 || i == 24 || i == 25 ||
-            i == 5 || i == 6 || i == 13 || i == 12 || 
-            i == 16 || i == 26)
-        {
-            /* set default values on used gpio pins
-             */
-            gpio_direction_output(i, 0);
-            /* destroy device
-             */
-            device_destroy ( gpio_lkm_class, MKDEV(MAJOR(first), MINOR(first) + i));
-            gpio_free(i);
-        }
-    }
+    /* counter device reads all pins, destroy it first
+     */
+    gpio_lkm_count_remove();
+    /* event rings are not used once their device is closed
+     */
+    gpio_lkm_ring_remove();
+    /* keypad drives its rows from timer, release them first
+     */
+    gpio_lkm_keypad_remove();
+    /* rules drive pins from interrupt handlers, delete them
+     * while pins are still there
+     */
+    gpio_lkm_reflex_clear();
+    gpio_lkm_quad_clear();
+    gpio_lkm_stepper_clear();
+    gpio_lkm_at_clear();
+    /* stop sampling before pins are released
+     */
+    gpio_lkm_capture_remove();
+    /* destroy bus devices and stop their waveforms while
+     * pins they refer to still exist
+     */
+    gpio_lkm_buses_remove();
+    /* destroy pin devices, release pins and free their structures
+     */
+    gpio_lkm_pins_remove();
+    /* pins gave their interrupts back, nothing queues to workers
+     */
+    gpio_lkm_banks_remove();
+    /* destroy control device and release state page
+     */
+    gpio_lkm_ctl_remove();
     /* destroy class
      */
     class_destroy(gpio_lkm_class);
+    unregister_chrdev_region(first, GPIO_LKM_MINORS);
     printk(KERN_INFO "[GPIO_LKM] - Raspberry Pi GPIO driver removed\n");
 }
 
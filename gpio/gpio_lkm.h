@@ -0,0 +1,965 @@
+/*
+* gpio_lkm.h - GPIO Loadable Kernel Module interface
+* Definitions shared between gpio_lkm driver and user space
+* applications: ioctl numbers and binary data formats
+* Author: Roman Okhrimenko <mrromanjoe@gmail.com>
+* License: GPL
+*/
+#ifndef GPIO_LKM_H
+#define GPIO_LKM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* magic number used to build ioctl request codes of this driver */
+#define GPIO_LKM_IOC_MAGIC 'g'
+
+/* number of bus (pin group) devices exposed as /dev/gpio_lkm_busN */
+#define GPIO_LKM_BUS_NUM 4
+/* maximum number of pins which may be grouped in one bus device,
+ * one bit of value/mask word is used per pin */
+#define GPIO_LKM_BUS_MAX_PINS 64
+
+/*
+* struct gpio_lkm_bus_config - Pin list of a bus device
+* @npins: number of valid entries in @pins
+* @pins: GPIO numbers, pins[0] is driven by bit 0 of bus word
+*/
+struct gpio_lkm_bus_config
+{
+    __u32 npins;
+    __u32 pins[GPIO_LKM_BUS_MAX_PINS];
+};
+
+/*
+* struct gpio_lkm_bus_word - Binary record written to a bus device
+* @value: new logic levels of bus pins, bit n drives pins[n]
+* @mask: only pins with corresponding bit set are changed
+*/
+struct gpio_lkm_bus_word
+{
+    __u64 value;
+    __u64 mask;
+};
+
+/* maximum number of pins described by shared state page */
+#define GPIO_LKM_STATE_MAX_PINS 512
+#define GPIO_LKM_STATE_WORDS (GPIO_LKM_STATE_MAX_PINS / 64)
+
+/* number of quadrature decoders */
+#define GPIO_LKM_QUAD_NUM 4
+/* velocity of quadrature decoder is counted over this window */
+#define GPIO_LKM_QUAD_WINDOW_NS 10000000
+
+/*
+* struct gpio_lkm_quad_state - Quadrature decoder in state page
+* @seq: update sequence counter of this decoder, odd while updated
+* @enabled: decoder is bound to a pin pair
+* @position: counts, 4 per encoder cycle, up when A leads B
+* @velocity: counts per second over last GPIO_LKM_QUAD_WINDOW_NS
+* @transitions: number of valid transitions decoded
+* @errors: number of illegal transitions, both inputs changed
+* @ktime_ns: CLOCK_MONOTONIC time of last transition
+*/
+struct gpio_lkm_quad_state
+{
+    __u32 seq;
+    __u32 enabled;
+    __s64 position;
+    __s64 velocity;
+    __u64 transitions;
+    __u64 errors;
+    __u64 ktime_ns;
+};
+
+/*
+* struct gpio_lkm_state_page - Layout of page mapped from /dev/gpio_lkm
+* @seq: update sequence counter, odd while driver updates the page
+* @npins: number of valid pins, bit n of bitmaps describes gpio[n]
+* @gpio: GPIO numbers of managed pins
+* @dir: direction bitmap, bit set for output pins
+* @level: logic level bitmap, bit set for high level
+* @quad: quadrature decoders, each with its own @seq
+*
+* page is read-only for user space. to get consistent snapshot
+* reader should load @seq, retry while it is odd, copy bitmaps
+* and retry if @seq changed in the meantime, the same way as
+* seqcount_t readers do in kernel
+*/
+struct gpio_lkm_state_page
+{
+    __u32 seq;
+    __u32 npins;
+    __u32 gpio[GPIO_LKM_STATE_MAX_PINS];
+    __u64 dir[GPIO_LKM_STATE_WORDS];
+    __u64 level[GPIO_LKM_STATE_WORDS];
+    struct gpio_lkm_quad_state quad[GPIO_LKM_QUAD_NUM];
+};
+
+/*
+* struct gpio_lkm_quad_config - Binding of quadrature decoder
+* @id: decoder, 0 .. GPIO_LKM_QUAD_NUM - 1
+* @pin_a: GPIO number of encoder output A
+* @pin_b: GPIO number of encoder output B
+* @enable: non zero binds pins and resets position, zero unbinds
+*/
+struct gpio_lkm_quad_config
+{
+    __u32 id;
+    __u32 pin_a;
+    __u32 pin_b;
+    __u32 enable;
+};
+
+/*
+* struct gpio_lkm_quad - State of quadrature decoder read by ioctl
+* @id: decoder to read, set by caller
+* @enabled: decoder is bound to a pin pair
+* @pin_a: GPIO number of encoder output A
+* @pin_b: GPIO number of encoder output B
+* other fields are as in struct gpio_lkm_quad_state
+*/
+struct gpio_lkm_quad
+{
+    __u32 id;
+    __u32 enabled;
+    __u32 pin_a;
+    __u32 pin_b;
+    __s64 position;
+    __s64 velocity;
+    __u64 transitions;
+    __u64 errors;
+    __u64 ktime_ns;
+};
+
+/* edges of input pin which produce event records, used as bitmask */
+#define GPIO_LKM_EDGE_NONE    0
+#define GPIO_LKM_EDGE_RISING  1
+#define GPIO_LKM_EDGE_FALLING 2
+#define GPIO_LKM_EDGE_BOTH    (GPIO_LKM_EDGE_RISING | GPIO_LKM_EDGE_FALLING)
+/* flag of GPIO_LKM_IOC_SET_EDGE mask, read() returns struct
+ * gpio_lkm_event_batch records instead of struct gpio_lkm_event */
+#define GPIO_LKM_EDGE_BATCH   4
+
+/*
+* struct gpio_lkm_event - Edge event record read from /dev/GPIOn
+* @pin: GPIO number of pin
+* @edge: GPIO_LKM_EDGE_RISING or GPIO_LKM_EDGE_FALLING
+* @ktime_ns: CLOCK_MONOTONIC time of interrupt in nanoseconds
+* @seq: per pin edge sequence number, gaps show skipped edges
+*/
+struct gpio_lkm_event
+{
+    __u32 pin;
+    __u32 edge;
+    __u64 ktime_ns;
+    __u64 seq;
+};
+
+/*
+* struct gpio_lkm_event_batch - Record of edges read from /dev/GPIOn
+* by files subscribed with GPIO_LKM_EDGE_BATCH. while edge rate of
+* pin is below its coalescing threshold each edge makes a record,
+* above it one record covers all edges of coalescing interval
+* @pin: GPIO number of pin
+* @level: level of pin after last edge
+* @rising: rising edges covered by record
+* @falling: falling edges covered by record
+* @coalesced: 1 if record was made in coalesced mode
+* @first_ns: CLOCK_MONOTONIC time of first edge
+* @last_ns: time of last edge
+* @seq: sequence number of last edge
+* @word: index of @levels in level bitmap of state page
+* @levels: word of level bitmap holding the pin, as of last edge
+*/
+struct gpio_lkm_event_batch
+{
+    __u32 pin;
+    __u32 level;
+    __u32 rising;
+    __u32 falling;
+    __u32 coalesced;
+    __u32 word;
+    __u64 first_ns;
+    __u64 last_ns;
+    __u64 seq;
+    __u64 levels;
+};
+
+/*
+* struct gpio_lkm_event_stats - Event counters of an open file
+* @queued: number of records put to file queue
+* @dropped: number of records lost because queue was full
+* @filter_accepted: number of records accepted by filter program
+* @filter_rejected: number of records dropped by filter program
+*/
+struct gpio_lkm_event_stats
+{
+    __u64 queued;
+    __u64 dropped;
+    __u64 filter_accepted;
+    __u64 filter_rejected;
+};
+
+/*
+* struct gpio_lkm_filter - Event filter program of an open file
+* @len: number of instructions, 0 detaches filter
+* @reserved: should be zero
+* @insns: user space pointer to array of struct sock_filter
+*
+* program is classic BPF, as for SO_ATTACH_FILTER, and runs on
+* every event record before it is queued. it returns 0 to drop
+* the record, any other value accepts it. instead of packet data
+* it loads 32 bit words of struct gpio_lkm_filter_data with
+* BPF_LD | BPF_W | BPF_ABS, BPF_LEN gives size of the structure
+*/
+struct gpio_lkm_filter
+{
+    __u32 len;
+    __u32 reserved;
+    __u64 insns;
+};
+
+/*
+* struct gpio_lkm_filter_data - Data seen by event filter program
+* @pin: GPIO number of pin, offset 0
+* @edge: GPIO_LKM_EDGE_RISING or GPIO_LKM_EDGE_FALLING, offset 4
+* @seq: low 32 bits of event sequence number, offset 8
+* @ktime_lo: low 32 bits of event time in ns, offset 12
+* @ktime_hi: high 32 bits of event time in ns, offset 16
+* @gap_ns: time from previous edge of the pin, offset 20
+* @idle_ns: time from last record accepted by this file, offset 24
+*
+* @gap_ns and @idle_ns saturate at 0xffffffff (about 4.3 s), so
+* e.g. "accept only if idle_ns > 10 ms" passes one edge per burst
+*/
+struct gpio_lkm_filter_data
+{
+    __u32 pin;
+    __u32 edge;
+    __u32 seq;
+    __u32 ktime_lo;
+    __u32 ktime_hi;
+    __u32 gap_ns;
+    __u32 idle_ns;
+};
+
+/* limits of sampling rate of logic analyzer capture */
+#define GPIO_LKM_CAPTURE_MIN_HZ 1000
+#define GPIO_LKM_CAPTURE_MAX_HZ 1000000
+
+/*
+* struct gpio_lkm_capture_config - Parameters of capture started on
+* /dev/gpio_lkm_la
+* @rate_hz: sampling rate, from GPIO_LKM_CAPTURE_MIN_HZ to MAX_HZ
+* @watermark: number of new samples which wakes up poll(),
+* 0 selects a quarter of the ring
+*/
+struct gpio_lkm_capture_config
+{
+    __u32 rate_hz;
+    __u32 watermark;
+};
+
+/*
+* struct gpio_lkm_capture_stats - Capture quality counters
+* @rate_hz: requested sampling rate
+* @achieved_hz: average rate of samples actually taken
+* @samples: number of samples taken since capture start
+* @missed_ticks: timer periods passed without a sample, because
+* timer interrupt came too late
+* @overruns: samples lost because ring was full
+* @start_ns: CLOCK_MONOTONIC time of capture start
+* @last_ns: time of the last sample
+*/
+struct gpio_lkm_capture_stats
+{
+    __u32 rate_hz;
+    __u32 achieved_hz;
+    __u64 samples;
+    __u64 missed_ticks;
+    __u64 overruns;
+    __u64 start_ns;
+    __u64 last_ns;
+};
+
+/*
+* struct gpio_lkm_capture_ring - Header page of capture ring buffer
+* @sample_size: size of one struct gpio_lkm_capture_sample in bytes
+* @nsamples: capacity of ring in samples
+* @data_offset: offset of first sample from start of mapping
+* @npins: number of pins in a sample, bit n is pin n of state page
+* @head: number of samples written by driver, free running counter
+* @tail: number of samples consumed, advanced by user space
+* @stats: capture counters, updated by driver along with @head
+*
+* @nsamples is a power of 2 and counters wrap around, so sample
+* number n is located at data_offset + (n & (nsamples - 1)) *
+* sample_size. reader should load @head with acquire semantic,
+* process samples from @tail to @head and store new @tail with
+* release semantic. counters are 32 bit to be updated atomically
+* on 32 bit ARM as well. all fields but @tail are only a copy of
+* driver state, writing them has no effect
+*/
+struct gpio_lkm_capture_ring
+{
+    __u32 sample_size;
+    __u32 nsamples;
+    __u32 data_offset;
+    __u32 npins;
+    __u32 head;
+    __u32 tail;
+    struct gpio_lkm_capture_stats stats;
+};
+
+/*
+* struct gpio_lkm_capture_sample - One sample of all pins
+* @ktime_ns: CLOCK_MONOTONIC time of sample
+* @bits: levels of pins, (npins + 63) / 64 words
+*/
+struct gpio_lkm_capture_sample
+{
+    __u64 ktime_ns;
+    __u64 bits[];
+};
+
+/* write protocols of /dev/GPIOn, selected per open file */
+#define GPIO_LKM_MODE_TEXT   0 /* "out", "in", "low", "high" strings */
+#define GPIO_LKM_MODE_BINARY 1 /* arrays of struct gpio_lkm_cmd */
+
+/* opcodes of binary commands */
+#define GPIO_LKM_OP_OUT  0 /* set direction output, low level */
+#define GPIO_LKM_OP_IN   1 /* set direction input */
+#define GPIO_LKM_OP_LOW  2 /* set low level on output */
+#define GPIO_LKM_OP_HIGH 3 /* set high level on output */
+#define GPIO_LKM_OP_SET  4 /* set level given by value on output */
+#define GPIO_LKM_OP_DELAY 5 /* wait value ns, pin is ignored. scripts only */
+
+/*
+* struct gpio_lkm_cmd - Binary command record
+* @op: one of GPIO_LKM_OP_* opcodes
+* @reserved: should be zero
+* @pin: GPIO number of managed pin to apply command to
+* @value: argument of command, level for GPIO_LKM_OP_SET,
+*   time in ns for GPIO_LKM_OP_DELAY
+*
+* several records may be written by one write() call to
+* /dev/gpio_lkm or to /dev/GPIOn switched to binary mode,
+* they are executed in order. /dev/GPIOn accepts only records
+* for its own pin and fails others with EPERM
+*
+* writev() to /dev/gpio_lkm runs records as a timed script:
+* level commands and delays only, executed from a high
+* resolution timer as one unit. read() from the same open
+* file returns struct gpio_lkm_step_time per executed step
+*/
+struct gpio_lkm_cmd
+{
+    __u8 op;
+    __u8 reserved;
+    __u16 pin;
+    __u32 value;
+};
+
+/* script limits: number of steps and sum of delays */
+#define GPIO_LKM_SCRIPT_MAX_STEPS 256
+#define GPIO_LKM_SCRIPT_MAX_NS    1000000000ULL
+
+/*
+* struct gpio_lkm_step_time - Measured timing of a script step
+* @planned_ns: time step was scheduled at, from script start.
+*   it is the sum of delays before the step
+* @actual_ns: time step was executed at, from script start
+*/
+struct gpio_lkm_step_time
+{
+    __u64 planned_ns;
+    __u64 actual_ns;
+};
+
+/* waveform playback limits */
+#define GPIO_LKM_WAVE_MAX_STEPS 4096
+#define GPIO_LKM_WAVE_MIN_STEP_NS 1000
+
+/* kinds of pattern uploaded for waveform playback */
+#define GPIO_LKM_WAVE_STEPS 0 /* array of struct gpio_lkm_wave_step */
+#define GPIO_LKM_WAVE_PWM   1 /* array of struct gpio_lkm_wave_pwm */
+
+/*
+* struct gpio_lkm_wave_step - One step of a waveform
+* @delta_ns: time to hold this step before the next one
+* @bits: levels of pins, bit n drives pin n of device
+*/
+struct gpio_lkm_wave_step
+{
+    __u64 delta_ns;
+    __u64 bits;
+};
+
+/*
+* struct gpio_lkm_wave_pwm - One PWM period of a waveform
+* @period_ns: length of period
+* @duty_ns: time of high level at start of period, all device
+* pins are driven high for it and low for the rest of period
+*/
+struct gpio_lkm_wave_pwm
+{
+    __u64 period_ns;
+    __u64 duty_ns;
+};
+
+/*
+* struct gpio_lkm_wave_config - Waveform uploaded to pin or bus device
+* @type: GPIO_LKM_WAVE_STEPS or GPIO_LKM_WAVE_PWM
+* @count: number of elements in @data
+* @data: user pointer to array of elements of @type
+* @repeat: number of times to play pattern, 0 repeats until stopped
+* @reserved: should be zero
+*/
+struct gpio_lkm_wave_config
+{
+    __u32 type;
+    __u32 count;
+    __u64 data;
+    __u32 repeat;
+    __u32 reserved;
+};
+
+/*
+* struct gpio_lkm_wave_stats - Timing statistics of playback
+* @cycles: number of completed pattern cycles
+* @steps: number of steps applied
+* @period_ns: nominal length of pattern cycle
+* @period_min_ns: shortest measured cycle
+* @period_max_ns: longest measured cycle
+* @period_mean_ns: average measured cycle
+* @jitter_min_ns: smallest delay of a step from its schedule
+* @jitter_max_ns: largest delay of a step from its schedule
+* @jitter_mean_ns: average delay of steps from schedule
+* @running: playback is active
+* @reserved: padding
+*/
+struct gpio_lkm_wave_stats
+{
+    __u64 cycles;
+    __u64 steps;
+    __u64 period_ns;
+    __u64 period_min_ns;
+    __u64 period_max_ns;
+    __u64 period_mean_ns;
+    __s64 jitter_min_ns;
+    __s64 jitter_max_ns;
+    __s64 jitter_mean_ns;
+    __u32 running;
+    __u32 reserved;
+};
+
+/* weight of the newest period in exponentially weighted moving
+ * averages of measurement, 1 / (1 << GPIO_LKM_MEASURE_EWMA_SHIFT) */
+#define GPIO_LKM_MEASURE_EWMA_SHIFT 3
+
+/*
+* struct gpio_lkm_measure_value - Statistics of one measured quantity
+* @last: value of the last complete period
+* @min: smallest value since measurement was enabled
+* @max: largest value since measurement was enabled
+* @ewma: exponentially weighted moving average
+*/
+struct gpio_lkm_measure_value
+{
+    __u64 last;
+    __u64 min;
+    __u64 max;
+    __u64 ewma;
+};
+
+/*
+* struct gpio_lkm_measure - Frequency and pulse width of input pin
+* @edges: number of edges seen since measurement was enabled
+* @periods: number of complete periods, rising edge to rising edge.
+*   values below are valid only if it is not zero
+* @last_edge_ns: CLOCK_MONOTONIC time of the last edge, tells if
+*   the signal stopped
+* @enabled: measurement is running
+* @reserved: padding
+* @period_ns: signal period
+* @high_ns: time of high level within period
+* @duty_ppm: high time to period ratio, parts per million
+* @freq_mhz: frequency in millihertz. min and max are derived from
+*   period, ewma is derived from period ewma
+*/
+struct gpio_lkm_measure
+{
+    __u64 edges;
+    __u64 periods;
+    __u64 last_edge_ns;
+    __u32 enabled;
+    __u32 reserved;
+    struct gpio_lkm_measure_value period_ns;
+    struct gpio_lkm_measure_value high_ns;
+    struct gpio_lkm_measure_value duty_ppm;
+    struct gpio_lkm_measure_value freq_mhz;
+};
+
+/* number of buckets of latency histogram, bucket n counts
+ * latencies from 2^n to 2^(n+1) - 1 ns, last one all above */
+#define GPIO_LKM_LAT_BUCKETS 32
+
+/*
+* struct gpio_lkm_lat_hist - Latency of write() to pin level change
+* collected when "latency" module parameter is set. time is taken
+* from entry to write method to return from gpio_set_value(), for
+* the first command of each write
+* @count: number of measured commands
+* @sum_ns: sum of latencies, for mean value
+* @max_ns: largest latency
+* @buckets: log2 histogram of latencies
+*/
+struct gpio_lkm_lat_hist
+{
+    __u64 count;
+    __u64 sum_ns;
+    __u64 max_ns;
+    __u64 buckets[GPIO_LKM_LAT_BUCKETS];
+};
+
+/* bit-banged serial protocols, see struct gpio_lkm_serial */
+#define GPIO_LKM_SERIAL_WS2812 0 /* one wire LED strip protocol, data pin only */
+#define GPIO_LKM_SERIAL_SPI0   1 /* SPI mode 0 shifting, MSB first, data and clock pins */
+/* longest frame in bytes and in time, frame is sent with
+ * preemption disabled */
+#define GPIO_LKM_SERIAL_MAX_BYTES 1024
+#define GPIO_LKM_SERIAL_MAX_NS    20000000
+/* WS2812 frame is also sent with interrupts disabled, but for at
+ * most this time at once. then interrupts are enabled for a moment
+ * in low phase before next bit. a handler running longer than the
+ * strip tolerates there stretches the low phase, which shows up
+ * in max_late_ns */
+#define GPIO_LKM_SERIAL_IRQOFF_NS 40000
+
+/*
+* struct gpio_lkm_serial - Frame sent by bit-bang engine
+* @protocol: GPIO_LKM_SERIAL_* protocol
+* @len: number of bytes in @data
+* @data: user space pointer to bytes, sent MSB first
+* @data_pin: GPIO number of data line
+* @clock_pin: GPIO number of clock line, SPI only
+* @t0h_ns: WS2812 high time of 0 bit, 0 selects 400 ns
+* @t0l_ns: WS2812 low time of 0 bit, 0 selects 850 ns
+* @t1h_ns: WS2812 high time of 1 bit, 0 selects 800 ns
+* @t1l_ns: WS2812 low time of 1 bit, 0 selects 450 ns
+* @reset_ns: WS2812 low time latching the frame, 0 selects 50 us
+* @half_period_ns: SPI clock half period, 0 clocks as fast as possible
+* @bits: set by driver, number of bits sent
+* @elapsed_ns: set by driver, time from first to last edge
+* @bit_rate: set by driver, achieved bits per second
+* @max_late_ns: set by driver, largest delay of an edge from schedule
+*
+* both pins should be managed by gpio_lkm and configured as
+* outputs. frame is checked against GPIO_LKM_SERIAL_MAX_* limits
+*/
+struct gpio_lkm_serial
+{
+    __u32 protocol;
+    __u32 len;
+    __u64 data;
+    __u32 data_pin;
+    __u32 clock_pin;
+    __u32 t0h_ns;
+    __u32 t0l_ns;
+    __u32 t1h_ns;
+    __u32 t1l_ns;
+    __u32 reset_ns;
+    __u32 half_period_ns;
+    __u64 bits;
+    __u64 elapsed_ns;
+    __u64 bit_rate;
+    __u64 max_late_ns;
+};
+
+/* actions of reflex rules, see struct gpio_lkm_reflex */
+#define GPIO_LKM_REFLEX_SET    0 /* drive output high */
+#define GPIO_LKM_REFLEX_CLEAR  1 /* drive output low */
+#define GPIO_LKM_REFLEX_TOGGLE 2 /* invert output */
+#define GPIO_LKM_REFLEX_PULSE  3 /* invert output for pulse_ns, then restore */
+#define GPIO_LKM_REFLEX_MAX 16 /* number of rules in driver table */
+#define GPIO_LKM_REFLEX_MAX_PULSE_NS 1000000000
+
+/*
+* struct gpio_lkm_reflex - Rule driving output from input edge
+* @id: slot of rule in table, set by driver on add, selects rule
+*   for get
+* @in_pin: GPIO number of input pin watched by rule
+* @edges: GPIO_LKM_EDGE_* mask of edges which fire the rule
+* @out_pin: GPIO number of driven output pin
+* @action: GPIO_LKM_REFLEX_* action
+* @pulse_ns: pulse width of GPIO_LKM_REFLEX_PULSE. edge during
+*   a pulse restarts it
+* @hits: set by driver, number of times rule fired
+* @lat_last_ns: set by driver, reaction latency of last hit
+* @lat_min_ns: set by driver, shortest reaction latency
+* @lat_max_ns: set by driver, longest reaction latency
+* @lat_avg_ns: set by driver, mean reaction latency
+*
+* rules are executed in interrupt handler of input pin, latency
+* is time from edge timestamp to return from output write. with
+* debounce enabled edge is confirmed at the end of the window and
+* the window is included in latency. both pins should be managed
+* by gpio_lkm on chips which do not sleep
+*/
+struct gpio_lkm_reflex
+{
+    __u32 id;
+    __u32 in_pin;
+    __u32 edges;
+    __u32 out_pin;
+    __u32 action;
+    __u32 pulse_ns;
+    __u64 hits;
+    __u64 lat_last_ns;
+    __u64 lat_min_ns;
+    __u64 lat_max_ns;
+    __u64 lat_avg_ns;
+};
+
+/* number of stepper axes and length of move queue of each */
+#define GPIO_LKM_STEPPER_NUM 4
+#define GPIO_LKM_STEPPER_QUEUE 32
+/* highest step rate and limits of step pulse width */
+#define GPIO_LKM_STEPPER_MAX_HZ 100000
+#define GPIO_LKM_STEPPER_MIN_PULSE_NS 1000
+#define GPIO_LKM_STEPPER_MAX_PULSE_NS 100000
+#define GPIO_LKM_STEPPER_MAX_ACCEL 10000000
+
+/*
+* struct gpio_lkm_stepper_config - Binding of stepper axis
+* @id: axis, 0 .. GPIO_LKM_STEPPER_NUM - 1
+* @step_pin: GPIO number of step input of driver
+* @dir_pin: GPIO number of direction input of driver
+* @pulse_ns: step pulse width, also direction setup time before
+*   first step after direction change. 0 selects 2 us
+* @enable: non zero binds pins and resets position, zero unbinds
+*/
+struct gpio_lkm_stepper_config
+{
+    __u32 id;
+    __u32 step_pin;
+    __u32 dir_pin;
+    __u32 pulse_ns;
+    __u32 enable;
+};
+
+/*
+* struct gpio_lkm_stepper_move - Move queued to stepper axis
+* @id: axis
+* @steps: signed number of steps, positive drives direction pin high
+* @max_velocity: cruise step rate, steps per second
+* @accel: acceleration and deceleration, steps per second squared
+*
+* move follows trapezoidal velocity profile. when next move of
+* the same direction is already queued as move starts, axis
+* passes from one to the other without stopping
+*/
+struct gpio_lkm_stepper_move
+{
+    __u32 id;
+    __s32 steps;
+    __u32 max_velocity;
+    __u32 accel;
+};
+
+/*
+* struct gpio_lkm_stepper_status - State of stepper axis
+* @id: axis to read, set by caller
+* @queued: moves waiting in queue, not counting current one
+* @running: axis is moving
+* @velocity: current step rate, steps per second
+* @position: steps done, signed
+* @moves: number of completed moves
+* @max_late_ns: largest delay of a step from its schedule
+*/
+struct gpio_lkm_stepper_status
+{
+    __u32 id;
+    __u32 queued;
+    __u32 running;
+    __u32 velocity;
+    __s64 position;
+    __u64 moves;
+    __u64 max_late_ns;
+};
+
+/* limits of matrix keypad. key index is row * GPIO_LKM_KEYPAD_MAX_COLS + col */
+#define GPIO_LKM_KEYPAD_MAX_ROWS 8
+#define GPIO_LKM_KEYPAD_MAX_COLS 8
+/* shortest time a row is driven before columns are read */
+#define GPIO_LKM_KEYPAD_MIN_TICK_NS 20000
+#define GPIO_LKM_KEYPAD_MAX_SCAN_NS 100000000
+#define GPIO_LKM_KEYPAD_MAX_DEBOUNCE 32
+
+/*
+* struct gpio_lkm_keypad_config - Binding of matrix keypad
+* @nrows: number of rows, 0 unbinds keypad
+* @ncols: number of columns
+* @rows: GPIO numbers of rows. row being scanned is driven low,
+*   the others are left floating
+* @cols: GPIO numbers of columns, pulled up outside of driver.
+*   pressed key pulls its column low
+* @scan_ns: period of complete scan of all rows. 0 selects 5 ms
+* @debounce: number of scans key should agree on before press or
+*   release is reported. 0 selects 4
+*/
+struct gpio_lkm_keypad_config
+{
+    __u32 nrows;
+    __u32 ncols;
+    __u32 rows[GPIO_LKM_KEYPAD_MAX_ROWS];
+    __u32 cols[GPIO_LKM_KEYPAD_MAX_COLS];
+    __u32 scan_ns;
+    __u32 debounce;
+};
+
+/*
+* struct gpio_lkm_key_event - Record read from /dev/gpio_lkm_keypad
+* @row: row of the key
+* @col: column of the key
+* @pressed: 1 if key was pressed, 0 if released
+* @reserved: zero
+* @ktime_ns: CLOCK_MONOTONIC time of scan which accepted change
+*/
+struct gpio_lkm_key_event
+{
+    __u32 row;
+    __u32 col;
+    __u32 pressed;
+    __u32 reserved;
+    __u64 ktime_ns;
+};
+
+/*
+* struct gpio_lkm_keypad_stats - Counters of matrix keypad
+* @bound: keypad is bound
+* @scanning: keypad is scanned now, otherwise it waits for a key
+*   with all rows driven and column interrupts enabled
+* @scans: complete scans done
+* @wakeups: number of times a column interrupt started scanning
+* @events: key events queued
+* @dropped: key events lost because queue was full
+*/
+struct gpio_lkm_keypad_stats
+{
+    __u32 bound;
+    __u32 scanning;
+    __u64 scans;
+    __u64 wakeups;
+    __u64 events;
+    __u64 dropped;
+};
+
+/* output transitions scheduled at once and results kept for reading */
+#define GPIO_LKM_AT_MAX 256
+#define GPIO_LKM_AT_RESULTS 256
+
+/*
+* struct gpio_lkm_at - Output transition scheduled at absolute time
+* @pin: GPIO number of output pin
+* @value: level to set, 0 or 1
+* @time_ns: CLOCK_REALTIME time to set it at, ns since the epoch.
+*   time in the past fires at once and is reported late
+* @id: set by driver, identifies the transition in results and
+*   cancel requests
+*
+* transitions are fired from one high resolution timer in order
+* of time, transitions with equal time in order they were added.
+* pin should be an output of a chip which does not sleep
+*/
+struct gpio_lkm_at
+{
+    __u32 pin;
+    __u32 value;
+    __u64 time_ns;
+    __u64 id;
+};
+
+/*
+* struct gpio_lkm_at_result - Outcome of scheduled transition
+* @id: id returned when transition was added
+* @pin: GPIO number of pin
+* @value: level set
+* @status: 0 on success, -EPERM if pin was not an output
+* @time_ns: CLOCK_REALTIME time transition was requested at
+* @fired_ns: CLOCK_REALTIME time right after pin was written
+* @late_ns: lateness, @fired_ns - @time_ns
+*/
+struct gpio_lkm_at_result
+{
+    __u64 id;
+    __u32 pin;
+    __u32 value;
+    __s32 status;
+    __u32 reserved;
+    __u64 time_ns;
+    __u64 fired_ns;
+    __s64 late_ns;
+};
+
+/*
+* struct gpio_lkm_at_stats - Counters of scheduled transitions
+* @pending: transitions waiting for their time
+* @queued: transitions added
+* @fired: transitions done
+* @failed: transitions which found pin not an output
+* @cancelled: transitions cancelled before their time
+* @lost: results dropped because nobody read them
+* @late_min_ns: smallest lateness of done transitions
+* @late_max_ns: largest lateness
+* @late_avg_ns: mean lateness
+*/
+struct gpio_lkm_at_stats
+{
+    __u32 pending;
+    __u32 reserved;
+    __u64 queued;
+    __u64 fired;
+    __u64 failed;
+    __u64 cancelled;
+    __u64 lost;
+    __s64 late_min_ns;
+    __s64 late_max_ns;
+    __s64 late_avg_ns;
+};
+
+/*
+* struct gpio_lkm_ring_stats - Counters of per cpu event ring
+* @cpu: set by caller, cpu the ring belongs to
+* @depth: records waiting in the ring
+* @queued: records put to the ring
+* @dropped: records lost because the ring was full
+*/
+struct gpio_lkm_ring_stats
+{
+    __u32 cpu;
+    __u32 depth;
+    __u64 queued;
+    __u64 dropped;
+};
+
+/* assign list of pins to a bus device, all pins should be managed
+ * by gpio_lkm and configured as outputs before bus is written */
+#define GPIO_LKM_IOC_BUS_SET_PINS _IOW(GPIO_LKM_IOC_MAGIC, 0x01, struct gpio_lkm_bus_config)
+/* get list of pins currently assigned to a bus device */
+#define GPIO_LKM_IOC_BUS_GET_PINS _IOR(GPIO_LKM_IOC_MAGIC, 0x02, struct gpio_lkm_bus_config)
+/* select edges reported to this open file of input pin, any value
+ * other than GPIO_LKM_EDGE_NONE switches read() to event records.
+ * GPIO_LKM_EDGE_BATCH selects batch records. when pin stops being
+ * an input, read() fails with EPERM and poll() reports POLLERR
+ * once queued records are read */
+#define GPIO_LKM_IOC_SET_EDGE _IOW(GPIO_LKM_IOC_MAGIC, 0x03, __u32)
+/* get event counters of this open file */
+#define GPIO_LKM_IOC_GET_EVENT_STATS _IOR(GPIO_LKM_IOC_MAGIC, 0x04, struct gpio_lkm_event_stats)
+/* start sampling all pins into ring mapped from /dev/gpio_lkm_la,
+ * ring is reset, so previous samples are discarded */
+#define GPIO_LKM_IOC_CAPTURE_START _IOW(GPIO_LKM_IOC_MAGIC, 0x05, struct gpio_lkm_capture_config)
+/* stop sampling, samples remain in ring */
+#define GPIO_LKM_IOC_CAPTURE_STOP _IO(GPIO_LKM_IOC_MAGIC, 0x06)
+/* get capture counters */
+#define GPIO_LKM_IOC_CAPTURE_STATS _IOR(GPIO_LKM_IOC_MAGIC, 0x07, struct gpio_lkm_capture_stats)
+/* select write protocol of this open file of /dev/GPIOn */
+#define GPIO_LKM_IOC_SET_MODE _IOW(GPIO_LKM_IOC_MAGIC, 0x08, __u32)
+/* start playing waveform on pin or bus device, replaces current one.
+ * all pins should be outputs not driven by waveform of another device,
+ * EBUSY otherwise. switching a pin to input stops waveform driving it */
+#define GPIO_LKM_IOC_WAVE_START _IOW(GPIO_LKM_IOC_MAGIC, 0x09, struct gpio_lkm_wave_config)
+/* stop waveform playback, pins keep their last levels */
+#define GPIO_LKM_IOC_WAVE_STOP _IO(GPIO_LKM_IOC_MAGIC, 0x0a)
+/* get timing statistics of current or last waveform */
+#define GPIO_LKM_IOC_WAVE_STATS _IOR(GPIO_LKM_IOC_MAGIC, 0x0b, struct gpio_lkm_wave_stats)
+/* enable (non zero) or disable period and pulse width measurement
+ * of input pin, enabling resets statistics */
+#define GPIO_LKM_IOC_SET_MEASURE _IOW(GPIO_LKM_IOC_MAGIC, 0x0c, __u32)
+/* get measurement statistics of input pin */
+#define GPIO_LKM_IOC_GET_MEASURE _IOR(GPIO_LKM_IOC_MAGIC, 0x0d, struct gpio_lkm_measure)
+/* get latency histogram, ioctl of control device /dev/gpio_lkm */
+#define GPIO_LKM_IOC_LAT_HIST _IOR(GPIO_LKM_IOC_MAGIC, 0x0e, struct gpio_lkm_lat_hist)
+/* clear latency histogram, ioctl of control device /dev/gpio_lkm */
+#define GPIO_LKM_IOC_LAT_RESET _IO(GPIO_LKM_IOC_MAGIC, 0x0f)
+/* send a frame with bit-bang engine and get its timing, ioctl
+ * of control device /dev/gpio_lkm */
+#define GPIO_LKM_IOC_SERIAL_XFER _IOWR(GPIO_LKM_IOC_MAGIC, 0x10, struct gpio_lkm_serial)
+/* add reflex rule, id of its slot is returned in the structure,
+ * ioctl of control device /dev/gpio_lkm */
+#define GPIO_LKM_IOC_REFLEX_ADD _IOWR(GPIO_LKM_IOC_MAGIC, 0x11, struct gpio_lkm_reflex)
+/* delete reflex rule by id, pulse in progress is finished at once */
+#define GPIO_LKM_IOC_REFLEX_DEL _IOW(GPIO_LKM_IOC_MAGIC, 0x12, __u32)
+/* get reflex rule with statistics, id selects the rule */
+#define GPIO_LKM_IOC_REFLEX_GET _IOWR(GPIO_LKM_IOC_MAGIC, 0x13, struct gpio_lkm_reflex)
+/* attach event filter program to this open file of /dev/GPIOn,
+ * replaces current one and resets filter counters */
+#define GPIO_LKM_IOC_SET_FILTER _IOW(GPIO_LKM_IOC_MAGIC, 0x14, struct gpio_lkm_filter)
+/* bind or unbind quadrature decoder, ioctl of control device.
+ * bound pins are switched to inputs */
+#define GPIO_LKM_IOC_QUAD_SET _IOW(GPIO_LKM_IOC_MAGIC, 0x15, struct gpio_lkm_quad_config)
+/* get state of quadrature decoder selected by id. unlike state
+ * page, velocity decays to 0 when encoder stops */
+#define GPIO_LKM_IOC_QUAD_GET _IOWR(GPIO_LKM_IOC_MAGIC, 0x16, struct gpio_lkm_quad)
+/* bind or unbind stepper axis, ioctl of control device. bound
+ * pins are switched to outputs, low */
+#define GPIO_LKM_IOC_STEPPER_SET _IOW(GPIO_LKM_IOC_MAGIC, 0x17, struct gpio_lkm_stepper_config)
+/* queue a move, fails with EAGAIN while queue is full */
+#define GPIO_LKM_IOC_STEPPER_MOVE _IOW(GPIO_LKM_IOC_MAGIC, 0x18, struct gpio_lkm_stepper_move)
+/* stop axis at once and drop queued moves */
+#define GPIO_LKM_IOC_STEPPER_STOP _IOW(GPIO_LKM_IOC_MAGIC, 0x19, __u32)
+/* get position and queue depth of axis selected by id */
+#define GPIO_LKM_IOC_STEPPER_GET _IOWR(GPIO_LKM_IOC_MAGIC, 0x1a, struct gpio_lkm_stepper_status)
+
+/* bind or unbind matrix keypad, ioctl of /dev/gpio_lkm_keypad.
+ * rows and columns are switched to inputs and dedicated to it */
+#define GPIO_LKM_IOC_KEYPAD_SET _IOW(GPIO_LKM_IOC_MAGIC, 0x1b, struct gpio_lkm_keypad_config)
+/* get keypad counters */
+#define GPIO_LKM_IOC_KEYPAD_STATS _IOR(GPIO_LKM_IOC_MAGIC, 0x1c, struct gpio_lkm_keypad_stats)
+
+/* schedule output transition at CLOCK_REALTIME time, ioctl of
+ * /dev/gpio_lkm. id of the transition is returned in the structure */
+#define GPIO_LKM_IOC_AT_ADD _IOWR(GPIO_LKM_IOC_MAGIC, 0x1d, struct gpio_lkm_at)
+/* cancel scheduled transition by id, 0 cancels all of them */
+#define GPIO_LKM_IOC_AT_CANCEL _IOW(GPIO_LKM_IOC_MAGIC, 0x1e, __u64)
+/* take result of oldest fired transition, EAGAIN if there is none */
+#define GPIO_LKM_IOC_AT_RESULT _IOR(GPIO_LKM_IOC_MAGIC, 0x1f, struct gpio_lkm_at_result)
+/* get counters and lateness statistics of scheduled transitions */
+#define GPIO_LKM_IOC_AT_STATS _IOR(GPIO_LKM_IOC_MAGIC, 0x20, struct gpio_lkm_at_stats)
+
+/* bind open file of /dev/gpio_lkm_events to ring of a cpu, read()
+ * returns struct gpio_lkm_event records of edges handled there */
+#define GPIO_LKM_IOC_RING_BIND _IOW(GPIO_LKM_IOC_MAGIC, 0x21, __u32)
+/* get counters of ring of cpu given in the structure */
+#define GPIO_LKM_IOC_RING_STATS _IOWR(GPIO_LKM_IOC_MAGIC, 0x22, struct gpio_lkm_ring_stats)
+
+#ifdef __KERNEL__
+/* in-kernel API for drivers built on top of gpio_lkm, for example
+ * seg7 display driver. pin group is a set of managed pins which
+ * are switched to outputs and then set with one array call.
+ * gpio_lkm_group_set() may be called from atomic context, e.g.
+ * from timer callback, so pins of sleeping chips are refused
+ */
+struct gpio_lkm_group;
+
+struct gpio_lkm_group *gpio_lkm_group_get(const unsigned int *gpios, unsigned int npins);
+int gpio_lkm_group_set(struct gpio_lkm_group *grp, u64 value);
+void gpio_lkm_group_put(struct gpio_lkm_group *grp);
+
+/* edge counters of managed pins, e.g. button presses. edges are
+ * counted per cpu without locks, readers sum them up and may
+ * poll at any rate without slowing down interrupt handler
+ */
+struct gpio_lkm_count
+{
+    unsigned int pin;
+    u64 rising;
+    u64 falling;
+};
+
+int gpio_lkm_count_read(unsigned int gpio, struct gpio_lkm_count *count);
+unsigned int gpio_lkm_count_snapshot(struct gpio_lkm_count *counts, unsigned int n);
+#endif /* __KERNEL__ */
+
+#endif /* GPIO_LKM_H */
@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * gpio_ring_bench - event throughput of gpio_lkm per cpu rings
+ *
+ * Several inputs are toggled at full speed by threads writing the
+ * pull of gpio-mockup lines through debugfs. Mockup interrupt fires
+ * on the cpu of the writer, so edges are handled and queued to the
+ * ring of that cpu. One reader per cpu is bound to the ring of its
+ * cpu. The test runs with 1, 2, ... cpus, togglers and readers are
+ * spread over the cpus in use, and prints events read per second:
+ *   modprobe gpio-mockup gpio_mockup_ranges=-1,32
+ *   insmod gpio_lkm.ko chip=gpio-mockup-A
+ *   ./gpio_ring_bench -d 2 -i 8
+ *
+ * With gpio_lkm loaded with threaded=1 edges are queued on cpu
+ * of worker thread of their bank instead, see bank_cpu.
+ *
+ * Author: Roman Okhrimenko <mrromanjoe@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "gpio_lkm.h"
+
+#define CTL_DEVICE "/dev/gpio_lkm"
+#define RING_DEVICE "/dev/gpio_lkm_events"
+#define MOCKUP_DIR "/sys/kernel/debug/gpio-mockup/gpiochip0"
+#define MAX_THREADS 64
+#define READ_BATCH 256
+
+static unsigned int duration = 2;
+static unsigned int ninputs = 4;
+static unsigned int maxcpus;
+static const char *mockup = MOCKUP_DIR;
+static const struct gpio_lkm_state_page *state;
+static volatile int stop_toggle;
+static volatile int stop_read;
+
+struct toggler
+{
+    pthread_t thread;
+    unsigned int gpio;
+    int cpu;
+    uint64_t toggles;
+};
+
+struct reader
+{
+    pthread_t thread;
+    int cpu;
+    uint64_t events;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void result(const char *test, const char *metric, double value)
+{
+    printf("%s.%s=%.1f\n", test, metric, value);
+}
+
+static void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* make pin an input, its edge interrupt is requested then */
+static int pin_input(unsigned int gpio)
+{
+    char path[32];
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "/dev/GPIO%u", gpio);
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    ret = write(fd, "in\n", 3) == 3 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+/* toggle pull of mockup line of the pin. gpio_lkm manages
+ * whole mockup chip, so its first pin is line 0
+ */
+static void *toggler_run(void *arg)
+{
+    struct toggler *t = arg;
+    char path[256];
+    int fd;
+
+    pin_to_cpu(t->cpu);
+    snprintf(path, sizeof(path), "%s/%u", mockup, t->gpio - state->gpio[0]);
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+    while (!stop_toggle)
+    {
+        if (pwrite(fd, "1", 1, 0) != 1 || pwrite(fd, "0", 1, 0) != 1)
+        {
+            perror(path);
+            break;
+        }
+        t->toggles += 2;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *reader_run(void *arg)
+{
+    struct gpio_lkm_event events[READ_BATCH];
+    struct reader *r = arg;
+    struct pollfd pfd;
+    __u32 cpu = r->cpu;
+    ssize_t ret;
+
+    pin_to_cpu(r->cpu);
+    pfd.fd = open(RING_DEVICE, O_RDONLY | O_NONBLOCK);
+    if (pfd.fd < 0)
+    {
+        perror(RING_DEVICE);
+        return NULL;
+    }
+    if (ioctl(pfd.fd, GPIO_LKM_IOC_RING_BIND, &cpu) < 0)
+    {
+        perror("GPIO_LKM_IOC_RING_BIND");
+        close(pfd.fd);
+        return NULL;
+    }
+    /* ring is drained after togglers stop, so the next
+     * run starts with it empty
+     */
+    pfd.events = POLLIN;
+    for (;;)
+    {
+        ret = read(pfd.fd, events, sizeof(events));
+        if (ret > 0)
+            r->events += ret / sizeof(events[0]);
+        else if (ret < 0 && errno == EAGAIN && !stop_read)
+            poll(&pfd, 1, 100);
+        else
+            break;
+    }
+    close(pfd.fd);
+    return NULL;
+}
+
+static uint64_t ring_dropped(int fd, unsigned int ncpus)
+{
+    struct gpio_lkm_ring_stats st;
+    uint64_t dropped = 0;
+    unsigned int cpu;
+
+    for (cpu = 0; cpu < ncpus; cpu++)
+    {
+        st.cpu = cpu;
+        if (ioctl(fd, GPIO_LKM_IOC_RING_STATS, &st) == 0)
+            dropped += st.dropped;
+    }
+    return dropped;
+}
+
+/* run togglers and readers on first ncpus cpus */
+static void bench_cpus(int fd, unsigned int ncpus)
+{
+    struct toggler togglers[MAX_THREADS];
+    struct reader readers[MAX_THREADS];
+    uint64_t start, elapsed, toggles = 0, events = 0, dropped;
+    char test[32];
+    unsigned int i;
+
+    dropped = ring_dropped(fd, maxcpus);
+    stop_toggle = 0;
+    stop_read = 0;
+    for (i = 0; i < ncpus; i++)
+    {
+        readers[i].cpu = i;
+        readers[i].events = 0;
+        pthread_create(&readers[i].thread, NULL, reader_run, &readers[i]);
+    }
+    start = now_ns();
+    for (i = 0; i < ninputs; i++)
+    {
+        togglers[i].gpio = state->gpio[i];
+        togglers[i].cpu = i % ncpus;
+        togglers[i].toggles = 0;
+        pthread_create(&togglers[i].thread, NULL, toggler_run, &togglers[i]);
+    }
+
+    sleep(duration);
+    stop_toggle = 1;
+    for (i = 0; i < ninputs; i++)
+    {
+        pthread_join(togglers[i].thread, NULL);
+        toggles += togglers[i].toggles;
+    }
+    stop_read = 1;
+    for (i = 0; i < ncpus; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        events += readers[i].events;
+    }
+    elapsed = now_ns() - start;
+    dropped = ring_dropped(fd, maxcpus) - dropped;
+
+    snprintf(test, sizeof(test), "cpus_%u", ncpus);
+    result(test, "toggles_per_sec", toggles * 1e9 / elapsed);
+    result(test, "events_per_sec", events * 1e9 / elapsed);
+    result(test, "dropped_per_sec", dropped * 1e9 / elapsed);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-d seconds] [-i inputs] [-c cpus] [-m dir]\n"
+                    "  -d  duration of each run in seconds (default 2)\n"
+                    "  -i  inputs toggled at once, first managed pins (default 4)\n"
+                    "  -c  highest number of cpus to run on (default: online cpus)\n"
+                    "  -m  debugfs directory of mockup chip (default " MOCKUP_DIR ")\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int i, n;
+    int fd, opt;
+
+    maxcpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "d:i:c:m:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd': duration = atoi(optarg); break;
+        case 'i': ninputs = atoi(optarg); break;
+        case 'c': maxcpus = atoi(optarg); break;
+        case 'm': mockup = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!duration || !ninputs || ninputs > MAX_THREADS || !maxcpus || maxcpus > MAX_THREADS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* pin list is taken from state page of control device */
+    fd = open(CTL_DEVICE, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(CTL_DEVICE);
+        return 1;
+    }
+    state = mmap(NULL, sizeof(*state), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (state == MAP_FAILED || state->npins < ninputs)
+    {
+        fprintf(stderr, "cannot get %u pins from %s\n", ninputs, CTL_DEVICE);
+        return 1;
+    }
+    for (i = 0; i < ninputs; i++)
+    {
+        if (pin_input(state->gpio[i]))
+            return 1;
+    }
+
+    /* counters of rings are read through this file */
+    fd = open(RING_DEVICE, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(RING_DEVICE);
+        return 1;
+    }
+
+    printf("bench.inputs=%u\n", ninputs);
+    printf("bench.duration_sec=%u\n", duration);
+
+    for (n = 1; n <= maxcpus; n++)
+        bench_cpus(fd, n);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * gpio_stress - stress and benchmark tool for gpio_lkm driver
+ *
+ * Several threads send binary commands to control device
+ * /dev/gpio_lkm for random pins: mostly level changes and a few
+ * direction changes, so writers of the same pin race each other.
+ * Run is split into epochs. At the end of each epoch all threads
+ * stop and direction and level cached by driver (state page) are
+ * compared with hardware, as reported by gpiolib in debugfs.
+ * Any mismatch is a consistency violation.
+ *
+ * Intended to be run against gpio-mockup lines, for example:
+ *   modprobe gpio-mockup gpio_mockup_ranges=-1,64
+ *   insmod gpio_lkm.ko chip=gpio-mockup-A
+ *   ./gpio_stress -t 4 -d 10
+ *
+ * Author: Roman Okhrimenko <mrromanjoe@gmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "gpio_lkm.h"
+
+#define CTL_DEVICE "/dev/gpio_lkm"
+#define DEBUGFS_GPIO "/sys/kernel/debug/gpio"
+#define MAX_THREADS 64
+#define MAX_REPORTED 10 /* violations printed in detail per epoch */
+
+struct worker
+{
+    pthread_t thread;
+    unsigned int id;
+    int fd;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t refused;
+    uint64_t errors;
+};
+
+static struct worker workers[MAX_THREADS];
+static pthread_barrier_t epoch_start, epoch_end;
+static volatile int running;
+static volatile int finished;
+
+static unsigned int nthreads = 4;
+static unsigned int seconds = 10;
+static unsigned int epochs = 10;
+static unsigned int dir_permille = 10;
+
+static const struct gpio_lkm_state_page *state;
+static unsigned int npins;
+
+static uint64_t xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* hammer random pins until epoch ends, then wait for the check */
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct gpio_lkm_cmd cmd;
+    uint64_t r;
+
+    memset(&cmd, 0, sizeof(cmd));
+
+    for (;;)
+    {
+        pthread_barrier_wait(&epoch_start);
+        if (finished)
+            break;
+
+        while (running)
+        {
+            r = xorshift(&w->rng);
+            cmd.pin = state->gpio[r % npins];
+            r >>= 32;
+            if (r % 1000 < dir_permille)
+            {
+                cmd.op = (r & 1024) ? GPIO_LKM_OP_IN : GPIO_LKM_OP_OUT;
+            }
+            else
+            {
+                cmd.op = GPIO_LKM_OP_SET;
+                cmd.value = (r >> 10) & 1;
+            }
+
+            if (write(w->fd, &cmd, sizeof(cmd)) == sizeof(cmd))
+                w->ops++;
+            else if (errno == EPERM)
+                w->refused++; /* level change of input pin */
+            else
+                w->errors++;
+        }
+
+        pthread_barrier_wait(&epoch_end);
+    }
+
+    return NULL;
+}
+
+/* copy bitmaps from state page following its seq protocol */
+static void state_snapshot(uint64_t *dir, uint64_t *level)
+{
+    uint32_t seq;
+
+    do
+    {
+        while ((seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(dir, (const void *)state->dir, sizeof(state->dir));
+        memcpy(level, (const void *)state->level, sizeof(state->level));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&state->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static int pin_index(unsigned int gpio)
+{
+    unsigned int i;
+
+    for (i = 0; i < npins; i++)
+    {
+        if (state->gpio[i] == gpio)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * compare cached state with lines of gpiolib debugfs file:
+ *  " gpio-20  (                    |?                   ) out hi"
+ * returns number of violations or -1 if debugfs is not available
+ */
+static int check_epoch(unsigned int epoch)
+{
+    uint64_t dir[GPIO_LKM_STATE_WORDS], level[GPIO_LKM_STATE_WORDS];
+    char line[256], hw_dir[8], hw_level[8];
+    int index, cached_out, cached_high, hw_out, hw_high;
+    unsigned int gpio, seen = 0;
+    int violations = 0;
+    char *p;
+    FILE *f;
+
+    f = fopen(DEBUGFS_GPIO, "r");
+    if (!f)
+        return -1;
+
+    state_snapshot(dir, level);
+
+    while (fgets(line, sizeof(line), f))
+    {
+        p = strstr(line, "gpio-");
+        if (!p || sscanf(p, "gpio-%u", &gpio) != 1)
+            continue;
+        index = pin_index(gpio);
+        p = strchr(p, ')');
+        if (index < 0 || !p || sscanf(p + 1, "%7s %7s", hw_dir, hw_level) != 2)
+            continue;
+
+        seen++;
+        cached_out = !!(dir[index / 64] & (1ULL << (index % 64)));
+        cached_high = !!(level[index / 64] & (1ULL << (index % 64)));
+        hw_out = !strcmp(hw_dir, "out");
+        hw_high = !strcmp(hw_level, "hi");
+
+        /* level of input is driven from outside, only outputs
+         * are expected to match the cache exactly */
+        if (cached_out != hw_out || (hw_out && cached_high != hw_high))
+        {
+            if (violations < MAX_REPORTED)
+                printf("violation: epoch=%u gpio=%u cached=%s/%s hw=%s/%s\n", epoch, gpio,
+                       cached_out ? "out" : "in", cached_high ? "hi" : "lo", hw_dir, hw_level);
+            violations++;
+        }
+    }
+    fclose(f);
+
+    if (seen != npins)
+        fprintf(stderr, "warning: %u of %u pins found in %s\n", seen, npins, DEBUGFS_GPIO);
+
+    return violations;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-e epochs] [-m dir_permille]\n"
+                    "  -t  number of writer threads (default 4)\n"
+                    "  -d  total run time in seconds (default 10)\n"
+                    "  -e  number of consistency checks (default 10)\n"
+                    "  -m  direction changes per 1000 commands (default 10)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t ops = 0, refused = 0, errors = 0;
+    long violations = 0;
+    int checked = 1;
+    double start, busy = 0;
+    unsigned int i, e;
+    int fd, opt, ret;
+
+    while ((opt = getopt(argc, argv, "t:d:e:m:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': nthreads = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'e': epochs = atoi(optarg); break;
+        case 'm': dir_permille = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!nthreads || nthreads > MAX_THREADS || !seconds || !epochs || dir_permille > 1000)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(CTL_DEVICE, O_RDWR);
+    if (fd < 0)
+    {
+        perror(CTL_DEVICE);
+        return 1;
+    }
+    state = mmap(NULL, sizeof(*state), PROT_READ, MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    npins = state->npins;
+    if (!npins)
+    {
+        fprintf(stderr, "driver manages no pins\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&epoch_start, NULL, nthreads + 1);
+    pthread_barrier_init(&epoch_end, NULL, nthreads + 1);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].id = i;
+        workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].fd = open(CTL_DEVICE, O_WRONLY);
+        if (workers[i].fd < 0)
+        {
+            perror(CTL_DEVICE);
+            return 1;
+        }
+        ret = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        if (ret)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            return 1;
+        }
+    }
+
+    for (e = 0; e < epochs; e++)
+    {
+        running = 1;
+        start = now_sec();
+        pthread_barrier_wait(&epoch_start);
+        usleep(seconds * 1000000ULL / epochs);
+        running = 0;
+        pthread_barrier_wait(&epoch_end);
+        busy += now_sec() - start;
+
+        /* all writers are stopped here, cache should be settled */
+        ret = check_epoch(e);
+        if (ret < 0)
+            checked = 0;
+        else
+            violations += ret;
+    }
+
+    finished = 1;
+    pthread_barrier_wait(&epoch_start);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].fd);
+        ops += workers[i].ops;
+        refused += workers[i].refused;
+        errors += workers[i].errors;
+        printf("thread=%u ops=%llu ops_per_sec=%.0f\n", i,
+               (unsigned long long)workers[i].ops, workers[i].ops / busy);
+    }
+
+    /* machine readable summary, one key=value per line */
+    printf("pins=%u\n", npins);
+    printf("threads=%u\n", nthreads);
+    printf("seconds=%.3f\n", busy);
+    printf("ops=%llu\n", (unsigned long long)ops);
+    printf("ops_per_sec=%.0f\n", ops / busy);
+    printf("refused=%llu\n", (unsigned long long)refused);
+    printf("errors=%llu\n", (unsigned long long)errors);
+    if (checked)
+        printf("violations=%ld\n", violations);
+    else
+        printf("violations=unknown (%s is not readable)\n", DEBUGFS_GPIO);
+
+    munmap((void *)state, sizeof(*state));
+    close(fd);
+
+    return (checked && violations) || errors ? 2 : 0;
+}
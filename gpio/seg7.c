@@ -0,0 +1,473 @@
+/*
+* seg7.c - Multiplexed 7 segment display driver
+* Drives several digits sharing segment lines. Pins are taken
+* from gpio_lkm driver through its exported pin group API and
+* digits are lit one by one from a high resolution timer.
+* User interface is in /sys/kernel/seg7/
+* Author: Roman Okhrimenko <mrromanjoe@gmail.com>
+* License: GPL
+*/
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#include "gpio_lkm.h"
+
+#define SEG7_MAX_DIGITS 8
+#define SEG7_SEGMENTS 8 /* a, b, c, d, e, f, g and decimal point */
+#define SEG7_DP (1 << 7)
+#define SEG7_TEXT_LEN (SEG7_MAX_DIGITS * 2) /* each digit may be followed by '.' */
+
+/* segment lines, in order a, b, c, d, e, f, g, dp */
+static unsigned int segments[SEG7_SEGMENTS];
+static int segments_num;
+module_param_array(segments, uint, &segments_num, 0444);
+MODULE_PARM_DESC(segments, " GPIO numbers of segments a,b,c,d,e,f,g,dp");
+
+/* digit select lines, leftmost digit first */
+static unsigned int digits[SEG7_MAX_DIGITS];
+static int digits_num;
+module_param_array(digits, uint, &digits_num, 0444);
+MODULE_PARM_DESC(digits, " GPIO numbers of digit commons, leftmost first");
+
+static bool common_anode;
+module_param(common_anode, bool, 0444);
+MODULE_PARM_DESC(common_anode, " Display has common anode (default=0, common cathode)");
+
+/* each digit is lit frame_hz times per second. at 100 Hz and more
+ * multiplexing is not visible, timer runs frame_hz * digits times
+ */
+static unsigned int frame_hz = 100;
+module_param(frame_hz, uint, 0444);
+MODULE_PARM_DESC(frame_hz, " Display refresh rate, 50..1000 Hz (default=100)");
+
+static unsigned int idle_sec = 10;
+module_param(idle_sec, uint, 0644);
+MODULE_PARM_DESC(idle_sec, " Blank display after this time without access, 0 - never (default=10)");
+
+/* segment patterns of characters, bit 0 is segment a ... bit 6 is g.
+ * characters which cannot be shown are left zero and refused
+ */
+static const u8 seg7_font[128] =
+{
+    [' '] = 0x00, ['-'] = 0x40, ['_'] = 0x08, ['='] = 0x48,
+    ['0'] = 0x3f, ['1'] = 0x06, ['2'] = 0x5b, ['3'] = 0x4f, ['4'] = 0x66,
+    ['5'] = 0x6d, ['6'] = 0x7d, ['7'] = 0x07, ['8'] = 0x7f, ['9'] = 0x6f,
+    ['A'] = 0x77, ['b'] = 0x7c, ['C'] = 0x39, ['c'] = 0x58, ['d'] = 0x5e,
+    ['E'] = 0x79, ['F'] = 0x71, ['G'] = 0x3d, ['H'] = 0x76, ['h'] = 0x74,
+    ['I'] = 0x06, ['J'] = 0x1e, ['L'] = 0x38, ['n'] = 0x54, ['o'] = 0x5c,
+    ['P'] = 0x73, ['q'] = 0x67, ['r'] = 0x50, ['S'] = 0x6d, ['t'] = 0x78,
+    ['U'] = 0x3e, ['u'] = 0x1c, ['y'] = 0x6e,
+};
+
+/*
+* struct seg7 - Display state
+* @group: segment pins (bits 0..7) and digit pins (bits 8..) of gpio_lkm
+* @lock: serializes user requests and blanking
+* @timer: lights next digit on every tick
+* @idle_work: blanks display after idle timeout
+* @pattern_lock: protects @patterns, taken from timer
+* @patterns: group value lighting each digit, precomputed on write
+* @blank: group value with all digits off
+* @ndigits: number of digits
+* @cur: digit lit now
+* @period_ns: time each digit is lit
+* @blanked: display is off and timer is stopped
+* @text: text shown, as written by user
+* @number: number shown, valid if @is_number
+* @is_number: last write was to number attribute
+* @ticks: timer ticks, refresh statistics are protected by @pattern_lock
+* @missed: ticks skipped because timer was late
+* @errors: group writes refused by gpio_lkm, e.g. pin made an input
+* @cost_sum: time spent in timer callback
+* @cost_max: longest timer callback
+*/
+struct seg7
+{
+    struct gpio_lkm_group *group;
+    struct mutex lock;
+    struct hrtimer timer;
+    struct delayed_work idle_work;
+    spinlock_t pattern_lock;
+    u64 patterns[SEG7_MAX_DIGITS];
+    u64 blank;
+    unsigned int ndigits;
+    unsigned int cur;
+    u64 period_ns;
+    bool blanked;
+    char text[SEG7_TEXT_LEN + 1];
+    int number;
+    bool is_number;
+    u64 ticks;
+    u64 missed;
+    u64 errors;
+    u64 cost_sum;
+    u64 cost_max;
+};
+
+static struct seg7 seg7;
+static struct kobject *seg7_kobj;
+
+/*
+* seg7_digit_value - Compute group value lighting one digit
+*/
+static u64 seg7_digit_value(unsigned int digit, u8 segs)
+{
+    u64 value;
+    unsigned int i;
+
+    /* common cathode lights segment with high level and selects
+     * digit with low level, common anode is the opposite
+     */
+    value = common_anode ? (u8)~segs : segs;
+    for (i = 0; i < seg7.ndigits; i++)
+    {
+        if ((i == digit) == common_anode)
+            value |= 1ULL << (SEG7_SEGMENTS + i);
+    }
+    return value;
+}
+
+/*
+* seg7_render - Decode text to digit patterns
+* '.' is shown as decimal point of preceding character, text
+* is aligned to the left and rest of digits is blank
+*/
+static int seg7_render(const char *text, u64 *patterns)
+{
+    u8 segs[SEG7_MAX_DIGITS] = { 0 };
+    unsigned int n = 0, i;
+    unsigned char c;
+
+    for (; *text; text++)
+    {
+        c = *text;
+        if (c == '.' && n && !(segs[n - 1] & SEG7_DP))
+        {
+            segs[n - 1] |= SEG7_DP;
+            continue;
+        }
+        if (n == seg7.ndigits)
+            return -ERANGE;
+        if (c == '.')
+            segs[n++] = SEG7_DP;
+        else if (c < ARRAY_SIZE(seg7_font) && (seg7_font[c] || c == ' '))
+            segs[n++] = seg7_font[c];
+        else
+            return -EINVAL;
+    }
+
+    for (i = 0; i < seg7.ndigits; i++)
+        patterns[i] = seg7_digit_value(i, segs[i]);
+
+    return 0;
+}
+
+/*
+* seg7_write - Set group value and account failure
+* should be called with seg7.pattern_lock held or timer stopped
+*/
+static int seg7_write(u64 value)
+{
+    int ret = gpio_lkm_group_set(seg7.group, value);
+
+    if (ret)
+    {
+        seg7.errors++;
+        printk_ratelimited(KERN_WARNING "[SEG7] - Cannot set pins, error %d\n", ret);
+    }
+    return ret;
+}
+
+/*
+* seg7_tick - Light next digit
+* one array call per tick switches both segments and digit
+*/
+static enum hrtimer_restart seg7_tick(struct hrtimer *timer)
+{
+    u64 start = ktime_get_ns();
+    u64 overruns, cost;
+
+    spin_lock(&seg7.pattern_lock);
+
+    seg7.cur = seg7.cur + 1 < seg7.ndigits ? seg7.cur + 1 : 0;
+    seg7_write(seg7.patterns[seg7.cur]);
+
+    overruns = hrtimer_forward_now(timer, ns_to_ktime(seg7.period_ns));
+    cost = ktime_get_ns() - start;
+    seg7.ticks++;
+    seg7.missed += overruns > 1 ? overruns - 1 : 0;
+    seg7.cost_sum += cost;
+    seg7.cost_max = max(seg7.cost_max, cost);
+
+    spin_unlock(&seg7.pattern_lock);
+
+    return HRTIMER_RESTART;
+}
+
+/*
+* seg7_touch - Register user access to display
+* wakes display up if it was blanked and restarts idle timeout.
+* should be called with seg7.lock held
+*/
+static void seg7_touch(void)
+{
+    if (seg7.blanked)
+    {
+        seg7.blanked = false;
+        hrtimer_start(&seg7.timer, ns_to_ktime(seg7.period_ns), HRTIMER_MODE_REL);
+    }
+
+    if (idle_sec)
+        mod_delayed_work(system_wq, &seg7.idle_work, idle_sec * HZ);
+}
+
+/*
+* seg7_idle - Blank display to save power
+*/
+static void seg7_idle(struct work_struct *work)
+{
+    mutex_lock(&seg7.lock);
+
+    if (!seg7.blanked)
+    {
+        hrtimer_cancel(&seg7.timer);
+        spin_lock_irq(&seg7.pattern_lock);
+        seg7_write(seg7.blank);
+        spin_unlock_irq(&seg7.pattern_lock);
+        seg7.blanked = true;
+    }
+
+    mutex_unlock(&seg7.lock);
+}
+
+/*
+* seg7_show_text - Show new text on display
+*/
+static int seg7_show_text(const char *text, bool is_number, int number)
+{
+    u64 patterns[SEG7_MAX_DIGITS];
+    unsigned long flags;
+    int ret;
+
+    ret = seg7_render(text, patterns);
+    if (ret)
+        return ret;
+
+    mutex_lock(&seg7.lock);
+
+    spin_lock_irqsave(&seg7.pattern_lock, flags);
+    memcpy(seg7.patterns, patterns, sizeof(patterns));
+    spin_unlock_irqrestore(&seg7.pattern_lock, flags);
+
+    strscpy(seg7.text, text, sizeof(seg7.text));
+    seg7.is_number = is_number;
+    seg7.number = number;
+    seg7_touch();
+
+    mutex_unlock(&seg7.lock);
+
+    return 0;
+}
+
+/*
+* number_show - sysfs attributes of display
+* reads and writes of number and text wake display up
+*/
+static ssize_t number_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t ret;
+
+    mutex_lock(&seg7.lock);
+    seg7_touch();
+    ret = seg7.is_number ? sprintf(buf, "%d\n", seg7.number) : -ENODATA;
+    mutex_unlock(&seg7.lock);
+
+    return ret;
+}
+
+static ssize_t number_store(struct kobject *kobj, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    char text[SEG7_TEXT_LEN + 1];
+    int number, ret;
+
+    if ((ret = kstrtoint(buf, 10, &number)))
+        return ret;
+
+    /* numbers are aligned to the right */
+    if (snprintf(text, sizeof(text), "%*d", seg7.ndigits, number) > seg7.ndigits)
+        return -ERANGE;
+
+    ret = seg7_show_text(text, true, number);
+    return ret ? ret : count;
+}
+
+static ssize_t text_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t ret;
+
+    mutex_lock(&seg7.lock);
+    seg7_touch();
+    ret = sprintf(buf, "%s\n", seg7.text);
+    mutex_unlock(&seg7.lock);
+
+    return ret;
+}
+
+static ssize_t text_store(struct kobject *kobj, struct kobj_attribute *attr,
+                          const char *buf, size_t count)
+{
+    char text[SEG7_TEXT_LEN + 1];
+    size_t len = count;
+    int ret;
+
+    if (len && buf[len - 1] == '\n')
+        len--;
+    if (len > SEG7_TEXT_LEN)
+        return -ERANGE;
+
+    memcpy(text, buf, len);
+    text[len] = '\0';
+
+    ret = seg7_show_text(text, false, 0);
+    return ret ? ret : count;
+}
+
+/* refresh cost, to check that multiplexing load stays bounded */
+static ssize_t stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    u64 ticks, missed, errors, cost_sum, cost_max, avg = 0, load_ppm;
+    unsigned long flags;
+
+    spin_lock_irqsave(&seg7.pattern_lock, flags);
+    ticks = seg7.ticks;
+    missed = seg7.missed;
+    errors = seg7.errors;
+    cost_sum = seg7.cost_sum;
+    cost_max = seg7.cost_max;
+    spin_unlock_irqrestore(&seg7.pattern_lock, flags);
+
+    if (ticks)
+        avg = div64_u64(cost_sum, ticks);
+    /* share of one CPU spent in refresh while display is on */
+    load_ppm = div64_u64(avg * 1000000, seg7.period_ns);
+
+    return sprintf(buf, "ticks=%llu\nmissed=%llu\nerrors=%llu\ncost_avg_ns=%llu\ncost_max_ns=%llu\n"
+                   "period_ns=%llu\nload_ppm=%llu\nblanked=%d\n",
+                   (unsigned long long)ticks, (unsigned long long)missed,
+                   (unsigned long long)errors, (unsigned long long)avg,
+                   (unsigned long long)cost_max, (unsigned long long)seg7.period_ns,
+                   (unsigned long long)load_ppm, READ_ONCE(seg7.blanked));
+}
+
+static struct kobj_attribute number_attribute = __ATTR(number, 0664, number_show, number_store);
+static struct kobj_attribute text_attribute = __ATTR(text, 0664, text_show, text_store);
+static struct kobj_attribute stats_attribute = __ATTR_RO(stats);
+
+static struct attribute *seg7_attrs[] =
+{
+    &number_attribute.attr,
+    &text_attribute.attr,
+    &stats_attribute.attr,
+    NULL,
+};
+
+static struct attribute_group seg7_attr_group =
+{
+    .attrs = seg7_attrs,
+};
+
+/*
+* seg7_init - Take pins from gpio_lkm and start display
+*/
+static int __init seg7_init(void)
+{
+    unsigned int gpios[SEG7_SEGMENTS + SEG7_MAX_DIGITS];
+    unsigned int i;
+    int ret;
+
+    if (segments_num != SEG7_SEGMENTS || !digits_num)
+    {
+        printk(KERN_ALERT "[SEG7] - segments=a,b,c,d,e,f,g,dp and digits=... are required\n");
+        return -EINVAL;
+    }
+    if (frame_hz < 50 || frame_hz > 1000)
+        return -EINVAL;
+
+    seg7.ndigits = digits_num;
+    seg7.period_ns = div_u64(NSEC_PER_SEC, frame_hz * seg7.ndigits);
+
+    memcpy(gpios, segments, sizeof(segments));
+    for (i = 0; i < seg7.ndigits; i++)
+        gpios[SEG7_SEGMENTS + i] = digits[i];
+
+    seg7.group = gpio_lkm_group_get(gpios, SEG7_SEGMENTS + seg7.ndigits);
+    if (IS_ERR(seg7.group))
+    {
+        printk(KERN_ALERT "[SEG7] - Cannot get pins from gpio_lkm\n");
+        return PTR_ERR(seg7.group);
+    }
+
+    mutex_init(&seg7.lock);
+    spin_lock_init(&seg7.pattern_lock);
+    INIT_DELAYED_WORK(&seg7.idle_work, seg7_idle);
+    hrtimer_init(&seg7.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    seg7.timer.function = seg7_tick;
+
+    seg7.blank = seg7_digit_value(SEG7_MAX_DIGITS, 0);
+    seg7_render("", seg7.patterns);
+    if ((ret = seg7_write(seg7.blank)))
+        goto fail_kobj;
+    seg7.blanked = true;
+
+    seg7_kobj = kobject_create_and_add("seg7", kernel_kobj);
+    if (!seg7_kobj)
+    {
+        ret = -ENOMEM;
+        goto fail_kobj;
+    }
+
+    if ((ret = sysfs_create_group(seg7_kobj, &seg7_attr_group)))
+        goto fail_group;
+
+    printk(KERN_INFO "[SEG7] - %u digits, digit period %llu ns\n", seg7.ndigits,
+           (unsigned long long)seg7.period_ns);
+    return 0;
+
+fail_group:
+    kobject_put(seg7_kobj);
+fail_kobj:
+    gpio_lkm_group_put(seg7.group);
+    return ret;
+}
+
+/*
+* seg7_exit - Turn display off and release pins
+*/
+static void __exit seg7_exit(void)
+{
+    /* attributes are gone after this, nothing restarts timer */
+    kobject_put(seg7_kobj);
+    cancel_delayed_work_sync(&seg7.idle_work);
+    hrtimer_cancel(&seg7.timer);
+    seg7_write(seg7.blank);
+    gpio_lkm_group_put(seg7.group);
+    printk(KERN_INFO "[SEG7] - Display driver removed\n");
+}
+
+module_init(seg7_init);
+module_exit(seg7_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Roman Okhrimenko <mrromanjoe@gmail.com>");
+MODULE_DESCRIPTION("Multiplexed 7 segment display driver on top of gpio_lkm");